@@ -0,0 +1,494 @@
+#define _GNU_SOURCE
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <string.h>
+
+#include "libosuqlsp.h"
+
+/*
+ * _osuqlsp: the hot path of osuqlsp, in C
+ *
+ * Device wraps an SPDevice from libosuqlsp, so it keeps one O_DIRECT fd
+ * open for as long as it lives. read_into() and write_from() convert
+ * between device bit order and one-byte-per-bit arrays in a single
+ * pass, without the temporaries osuqlsp's numpy path makes. I/O
+ * releases the GIL, so close() refuses to run while another thread is
+ * using the device.
+ */
+
+/* read-only buffer arguments */
+#if PY_MAJOR_VERSION >= 3
+#define BUFFER_ARG "y*"
+#else
+#define BUFFER_ARG "s*"
+#endif
+
+/* unpack_table[b] holds the 8 bits of b, LSB first, one per byte */
+static uint64_t unpack_table[256];
+
+static void init_unpack_table(void) {
+    unsigned int b, k;
+    for (b = 0; b < 256; b++) {
+        uint8_t bits[8];
+        for (k = 0; k < 8; k++)
+            bits[k] = (b >> k) & 1;
+        memcpy(&unpack_table[b], bits, 8);
+    }
+}
+
+/* device rows (LSB first) to rows of width 0/1 bytes */
+static void unpack_rows(const uint8_t* src, unsigned int src_stride, uint8_t* dest, unsigned int width, unsigned int rows) {
+    unsigned int full = width / 8;
+    unsigned int tail = width % 8;
+    unsigned int r, i;
+    for (r = 0; r < rows; r++) {
+        const uint8_t* s = src + (size_t)r * src_stride;
+        uint8_t* d = dest + (size_t)r * width;
+        for (i = 0; i < full; i++)
+            memcpy(d + 8 * i, &unpack_table[s[i]], 8);
+        if (tail)
+            memcpy(d + 8 * full, &unpack_table[s[full]], tail);
+    }
+}
+
+/* rows of width bytes (any nonzero is a 1) to device rows, zeroing
+ * everything past width in each row and past rows in dest
+ */
+static void pack_rows(const uint8_t* src, unsigned int width, unsigned int rows, uint8_t* dest, unsigned int dest_stride, unsigned int dest_rows) {
+    unsigned int r, i, k;
+    for (r = 0; r < rows; r++) {
+        const uint8_t* s = src + (size_t)r * width;
+        uint8_t* d = dest + (size_t)r * dest_stride;
+        memset(d, 0, dest_stride);
+        for (i = 0; i < width / 8; i++) {
+            uint8_t b = 0;
+            for (k = 0; k < 8; k++)
+                b |= (s[8 * i + k] != 0) << k;
+            d[i] = b;
+        }
+        for (k = 0; k < width % 8; k++)
+            d[width / 8] |= (s[8 * (width / 8) + k] != 0) << k;
+    }
+    if (dest_rows > rows)
+        memset(dest + (size_t)rows * dest_stride, 0, (size_t)(dest_rows - rows) * dest_stride);
+}
+
+/*
+ * the Device type
+ */
+
+typedef struct {
+    PyObject_HEAD
+    SPDevice* dev;
+    /* calls using dev, which may have let go of the GIL. only touched
+     * with the GIL held
+     */
+    unsigned int busy;
+} DeviceObject;
+
+static int device_check_open(DeviceObject* self) {
+    if (!self->dev) {
+        PyErr_SetString(PyExc_ValueError, "device is closed");
+        return 0;
+    }
+    return 1;
+}
+
+static int device_check_idle(DeviceObject* self) {
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "device is in use by another thread");
+        return 0;
+    }
+    return 1;
+}
+
+/* marks the device in use until device_leave, so it can't be closed
+ * while the GIL is released. returns 0 if it's closed
+ */
+static int device_enter(DeviceObject* self) {
+    if (!device_check_open(self))
+        return 0;
+    self->busy++;
+    return 1;
+}
+
+static void device_leave(DeviceObject* self) {
+    self->busy--;
+}
+
+static int device_init(DeviceObject* self, PyObject* args, PyObject* kwds) {
+    static char* kwlist[] = {"name", NULL};
+    const char* name;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &name))
+        return -1;
+
+    /* accept "/dev/sampler0" as well as "sampler0" */
+    if (strncmp(name, "/dev/", 5) == 0)
+        name += 5;
+
+    if (!device_check_idle(self))
+        return -1;
+    if (self->dev)
+        sp_device_close(self->dev);
+    self->dev = NULL;
+    Py_BEGIN_ALLOW_THREADS
+    self->dev = sp_device_open(name);
+    Py_END_ALLOW_THREADS
+    if (!self->dev) {
+        PyErr_Format(PyExc_RuntimeError, "could not open /dev/%s", name);
+        return -1;
+    }
+    return 0;
+}
+
+static void device_dealloc(DeviceObject* self) {
+    if (self->dev)
+        sp_device_close(self->dev);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* device_close(DeviceObject* self, PyObject* unused) {
+    if (!device_check_idle(self))
+        return NULL;
+    if (self->dev)
+        sp_device_close(self->dev);
+    self->dev = NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject* device_fileno(DeviceObject* self, PyObject* unused) {
+    if (!device_check_open(self))
+        return NULL;
+    return PyLong_FromLong(self->dev->fd);
+}
+
+/* gets a writable, contiguous buffer of at least size bytes */
+static int get_out_buffer(PyObject* obj, Py_buffer* view, size_t size) {
+    if (PyObject_GetBuffer(obj, view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) < 0)
+        return 0;
+    if ((size_t)view->len < size) {
+        PyErr_Format(PyExc_ValueError, "buffer too small, need %zu bytes", size);
+        PyBuffer_Release(view);
+        return 0;
+    }
+    return 1;
+}
+
+static int device_read_raw_nogil(DeviceObject* self) {
+    const uint8_t* ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = sp_device_read_raw(self->dev);
+    Py_END_ALLOW_THREADS
+    if (!ok) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return 0;
+    }
+    return 1;
+}
+
+static PyObject* device_read_raw(DeviceObject* self, PyObject* args) {
+    PyObject* out = NULL;
+    PyObject* ret = NULL;
+    Py_buffer view;
+    if (!PyArg_ParseTuple(args, "|O", &out))
+        return NULL;
+    if (!device_enter(self))
+        return NULL;
+
+    if (!out || out == Py_None) {
+        if (device_read_raw_nogil(self))
+            ret = PyBytes_FromStringAndSize((const char*)self->dev->data, self->dev->length);
+    } else if (get_out_buffer(out, &view, self->dev->length)) {
+        if (device_read_raw_nogil(self)) {
+            memcpy(view.buf, self->dev->data, self->dev->length);
+            Py_INCREF(out);
+            ret = out;
+        }
+        PyBuffer_Release(&view);
+    }
+
+    device_leave(self);
+    return ret;
+}
+
+static PyObject* device_read_into(DeviceObject* self, PyObject* args) {
+    PyObject* out;
+    PyObject* ret = NULL;
+    Py_buffer view;
+    SPDevice* dev;
+    if (!PyArg_ParseTuple(args, "O", &out))
+        return NULL;
+    if (!device_enter(self))
+        return NULL;
+    dev = self->dev;
+
+    if (get_out_buffer(out, &view, (size_t)dev->time_length * dev->sample_width)) {
+        if (device_read_raw_nogil(self)) {
+            Py_BEGIN_ALLOW_THREADS
+            unpack_rows(dev->data, dev->sample_length, view.buf, dev->sample_width, dev->time_length);
+            Py_END_ALLOW_THREADS
+            Py_INCREF(out);
+            ret = out;
+        }
+        PyBuffer_Release(&view);
+    }
+
+    device_leave(self);
+    return ret;
+}
+
+static PyObject* device_write_nogil(DeviceObject* self) {
+    int ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = sp_device_write_raw(self->dev);
+    Py_END_ALLOW_THREADS
+    if (!ok)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    Py_RETURN_NONE;
+}
+
+static PyObject* device_write_raw(DeviceObject* self, PyObject* args) {
+    PyObject* ret = NULL;
+    Py_buffer view;
+    if (!device_check_open(self))
+        return NULL;
+    if (!PyArg_ParseTuple(args, BUFFER_ARG, &view))
+        return NULL;
+    if (!device_enter(self)) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+
+    if ((size_t)view.len > (size_t)self->dev->length) {
+        PyErr_SetString(PyExc_ValueError, "too much data to write");
+    } else {
+        memcpy(self->dev->data, view.buf, view.len);
+        memset(self->dev->data + view.len, 0, self->dev->length - view.len);
+        ret = device_write_nogil(self);
+    }
+    PyBuffer_Release(&view);
+
+    device_leave(self);
+    return ret;
+}
+
+static PyObject* device_write_from(DeviceObject* self, PyObject* args) {
+    PyObject* ret = NULL;
+    Py_buffer view;
+    unsigned int rows, cols;
+    SPDevice* dev;
+    if (!device_check_open(self))
+        return NULL;
+    if (!PyArg_ParseTuple(args, BUFFER_ARG "II", &view, &rows, &cols))
+        return NULL;
+    if (!device_enter(self)) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    dev = self->dev;
+
+    if (rows > (unsigned int)dev->time_length || cols > (unsigned int)dev->sample_width) {
+        PyErr_SetString(PyExc_ValueError, "too much data to write");
+    } else if ((size_t)view.len < (size_t)rows * cols) {
+        PyErr_SetString(PyExc_ValueError, "buffer smaller than rows * cols");
+    } else {
+        Py_BEGIN_ALLOW_THREADS
+        pack_rows(view.buf, cols, rows, dev->data, dev->sample_length, dev->time_length);
+        Py_END_ALLOW_THREADS
+        ret = device_write_nogil(self);
+    }
+    PyBuffer_Release(&view);
+
+    device_leave(self);
+    return ret;
+}
+
+static PyObject* device_wait_done(DeviceObject* self, PyObject* args) {
+    unsigned int spins = 0;
+    if (!PyArg_ParseTuple(args, "|I", &spins))
+        return NULL;
+    if (!device_enter(self))
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    sp_device_wait_done(self->dev, spins);
+    Py_END_ALLOW_THREADS
+    device_leave(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject* device_acquire(DeviceObject* self, PyObject* args) {
+    int nonblock = 0;
+    int ret;
+    if (!PyArg_ParseTuple(args, "|i", &nonblock))
+        return NULL;
+    if (!device_enter(self))
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    ret = sp_device_acquire(self->dev, nonblock);
+    Py_END_ALLOW_THREADS
+    device_leave(self);
+    if (ret < 0)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    return PyBool_FromLong(ret);
+}
+
+static PyObject* device_release(DeviceObject* self, PyObject* unused) {
+    if (!device_check_open(self))
+        return NULL;
+    sp_device_release(self->dev);
+    Py_RETURN_NONE;
+}
+
+static PyObject* device_get_enabled(DeviceObject* self, void* closure) {
+    if (!device_check_open(self))
+        return NULL;
+    return PyBool_FromLong(sp_device_get_enabled(self->dev) > 0);
+}
+
+static int device_set_enabled(DeviceObject* self, PyObject* value, void* closure) {
+    int enabled;
+    if (!value) {
+        PyErr_SetString(PyExc_AttributeError, "cannot delete enabled");
+        return -1;
+    }
+    if (!device_check_open(self))
+        return -1;
+    enabled = PyObject_IsTrue(value);
+    if (enabled < 0)
+        return -1;
+    sp_device_set_enabled(self->dev, enabled);
+    return 0;
+}
+
+static PyObject* device_get_done(DeviceObject* self, void* closure) {
+    if (!device_check_open(self))
+        return NULL;
+    return PyBool_FromLong(sp_device_get_done(self->dev) > 0);
+}
+
+static PyObject* device_get_type(DeviceObject* self, void* closure) {
+    if (!device_check_open(self))
+        return NULL;
+    return PyUnicode_FromString(self->dev->type == SP_SAMPLER ? "sampler" : "player");
+}
+
+static PyObject* device_get_name(DeviceObject* self, void* closure) {
+    if (!device_check_open(self))
+        return NULL;
+    return PyUnicode_FromString(self->dev->name);
+}
+
+/* the geometry, all plain ints in SPDevice */
+#define DEVICE_INT_GETTER(field)                                        \
+    static PyObject* device_get_##field(DeviceObject* self, void* closure) { \
+        if (!device_check_open(self))                                   \
+            return NULL;                                                \
+        return PyLong_FromLong(self->dev->field);                       \
+    }
+DEVICE_INT_GETTER(sample_width)
+DEVICE_INT_GETTER(sample_bits)
+DEVICE_INT_GETTER(sample_length)
+DEVICE_INT_GETTER(time_bits)
+DEVICE_INT_GETTER(time_length)
+DEVICE_INT_GETTER(bits)
+DEVICE_INT_GETTER(length)
+DEVICE_INT_GETTER(caps)
+#undef DEVICE_INT_GETTER
+
+static PyMethodDef device_methods[] = {
+    {"close", (PyCFunction)device_close, METH_NOARGS,
+     "Close the device. Fails while another thread is using it."},
+    {"fileno", (PyCFunction)device_fileno, METH_NOARGS,
+     "The device's file descriptor."},
+    {"read_raw", (PyCFunction)device_read_raw, METH_VARARGS,
+     "read_raw([out]) -> the device's memory, in device bit order.\n"
+     "If out is given, fill it instead of making a new bytes."},
+    {"read_into", (PyCFunction)device_read_into, METH_VARARGS,
+     "read_into(out) -> out, filled with time_length x sample_width\n"
+     "bytes, one per bit."},
+    {"write_raw", (PyCFunction)device_write_raw, METH_VARARGS,
+     "write_raw(data): write data, in device bit order, padding with 0."},
+    {"write_from", (PyCFunction)device_write_from, METH_VARARGS,
+     "write_from(data, rows, cols): write rows x cols bytes, one per bit\n"
+     "(nonzero is 1), padding with 0."},
+    {"wait_done", (PyCFunction)device_wait_done, METH_VARARGS,
+     "wait_done([spins]): wait for done, sleeping after spins polls."},
+    {"acquire", (PyCFunction)device_acquire, METH_VARARGS,
+     "acquire([nonblock]): take the device's lease, see linux/ioctls.h.\n"
+     "Returns True if someone else held it since our last lease. With\n"
+     "nonblock, raises IOError (EBUSY) instead of waiting for it."},
+    {"release", (PyCFunction)device_release, METH_NOARGS,
+     "Release the device's lease."},
+    {NULL}
+};
+
+static PyGetSetDef device_getset[] = {
+    {"enabled", (getter)device_get_enabled, (setter)device_set_enabled, NULL, NULL},
+    {"done", (getter)device_get_done, NULL, NULL, NULL},
+    {"type", (getter)device_get_type, NULL, NULL, NULL},
+    {"name", (getter)device_get_name, NULL, NULL, NULL},
+    {"sample_width", (getter)device_get_sample_width, NULL, NULL, NULL},
+    {"sample_bits", (getter)device_get_sample_bits, NULL, NULL, NULL},
+    {"sample_length", (getter)device_get_sample_length, NULL, NULL, NULL},
+    {"time_bits", (getter)device_get_time_bits, NULL, NULL, NULL},
+    {"time_length", (getter)device_get_time_length, NULL, NULL, NULL},
+    {"bits", (getter)device_get_bits, NULL, NULL, NULL},
+    {"length", (getter)device_get_length, NULL, NULL, NULL},
+    {"caps", (getter)device_get_caps, NULL, NULL, NULL},
+    {NULL}
+};
+
+static PyTypeObject DeviceType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_osuqlsp.Device",
+    sizeof(DeviceObject),
+};
+
+/*
+ * module setup, for both Python 2 and 3
+ */
+
+static PyMethodDef module_methods[] = {
+    {NULL}
+};
+
+#define MODULE_DOC "Native device access for osuqlsp."
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef module_def = {
+    PyModuleDef_HEAD_INIT, "_osuqlsp", MODULE_DOC, -1, module_methods,
+};
+#define MODULE_RETURN(m) return m
+PyMODINIT_FUNC PyInit__osuqlsp(void)
+#else
+#define MODULE_RETURN(m) return
+PyMODINIT_FUNC init_osuqlsp(void)
+#endif
+{
+    PyObject* m;
+
+    init_unpack_table();
+
+    DeviceType.tp_flags = Py_TPFLAGS_DEFAULT;
+    DeviceType.tp_doc = "Device(name): a sampler or player, kept open.";
+    DeviceType.tp_new = PyType_GenericNew;
+    DeviceType.tp_init = (initproc)device_init;
+    DeviceType.tp_dealloc = (destructor)device_dealloc;
+    DeviceType.tp_methods = device_methods;
+    DeviceType.tp_getset = device_getset;
+    if (PyType_Ready(&DeviceType) < 0)
+        MODULE_RETURN(NULL);
+
+#if PY_MAJOR_VERSION >= 3
+    m = PyModule_Create(&module_def);
+#else
+    m = Py_InitModule3("_osuqlsp", module_methods, MODULE_DOC);
+#endif
+    if (!m)
+        MODULE_RETURN(NULL);
+
+    Py_INCREF(&DeviceType);
+    PyModule_AddObject(m, "Device", (PyObject*)&DeviceType);
+    MODULE_RETURN(m);
+}
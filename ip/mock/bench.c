@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mock.h"
+#include "sampler.h"
+#include "player.h"
+
+// a 64-bit wide, 4096 sample pair, as Qsys would describe it in system.h
+#define BENCH_WIDTH 64
+#define BENCH_SAMPLE_BITS 3
+#define BENCH_TIME_BITS 12
+#define BENCH_WORDS ((1 << BENCH_TIME_BITS) << (BENCH_SAMPLE_BITS - 2))
+
+static alt_u32 samp_buffer[BENCH_WORDS];
+static alt_u32 samp_csr[1];
+static alt_u32 play_buffer[BENCH_WORDS];
+static alt_u32 play_csr[1];
+
+#define SAMP_BUFFER_BASE samp_buffer
+#define SAMP_BUFFER_SPAN sizeof(samp_buffer)
+#define SAMP_BUFFER_WIDTH BENCH_WIDTH
+#define SAMP_BUFFER_SAMPLE_BITS BENCH_SAMPLE_BITS
+#define SAMP_BUFFER_TIME_BITS BENCH_TIME_BITS
+#define SAMP_CSR_BASE samp_csr
+#define SAMP_CSR_SPAN sizeof(samp_csr)
+#define SAMP_CSR_IRQ 1
+#define SAMP_CSR_IRQ_INTERRUPT_CONTROLLER_ID 0
+
+#define PLAY_BUFFER_BASE play_buffer
+#define PLAY_BUFFER_SPAN sizeof(play_buffer)
+#define PLAY_BUFFER_WIDTH BENCH_WIDTH
+#define PLAY_BUFFER_SAMPLE_BITS BENCH_SAMPLE_BITS
+#define PLAY_BUFFER_TIME_BITS BENCH_TIME_BITS
+#define PLAY_CSR_BASE play_csr
+#define PLAY_CSR_SPAN sizeof(play_csr)
+#define PLAY_CSR_IRQ 2
+#define PLAY_CSR_IRQ_INTERRUPT_CONTROLLER_ID 0
+
+SAMPLER_INSTANCE(SAMP, samp);
+PLAYER_INSTANCE(PLAY, play);
+
+static alt_u32 local[BENCH_WORDS];
+
+/*
+ * bulk copies
+ */
+
+// the per-word loop firmware used to write by hand
+static void naive_read(sampler_state* s, alt_u32* dest) {
+    alt_u32 t, w;
+    for (t = 0; t < s->time_length; t++) {
+        volatile alt_u32* sample = sampler_get_time(s, t);
+        for (w = 0; w < s->width_words; w++)
+            dest[(t << (s->sample_bits - 2)) + w] = sample[w];
+    }
+}
+
+static void naive_write(player_state* s, const alt_u32* src) {
+    alt_u32 t, w;
+    for (t = 0; t < s->time_length; t++) {
+        volatile alt_u32* sample = player_get_time(s, t);
+        for (w = 0; w < s->width_words; w++)
+            sample[w] = src[(t << (s->sample_bits - 2)) + w];
+    }
+}
+
+// smallest per-word cost of reps copies of the whole buffer
+#define BENCH_COPY(label, reps, stmt)                                   \
+    do {                                                                \
+        alt_u64 best = ~0ull;                                           \
+        int i;                                                          \
+        for (i = 0; i < (reps); i++) {                                  \
+            alt_u64 start = mock_cycles();                              \
+            stmt;                                                       \
+            alt_u64 took = mock_cycles() - start;                       \
+            if (took < best)                                            \
+                best = took;                                            \
+        }                                                               \
+        printf("  %-22s %8.3f %s/word\n", label,                        \
+               (double)best / BENCH_WORDS, mock_cycles_unit);           \
+    } while (0)
+
+static void bench_copy(int reps) {
+    int i;
+    for (i = 0; i < BENCH_WORDS; i++)
+        samp_buffer[i] = i * 2654435761u;
+
+    printf("bulk copy, %u time steps of %u words:\n", samp.time_length, 1 << (samp.sample_bits - 2));
+    BENCH_COPY("sampler, per word", reps, naive_read(&samp, local));
+    BENCH_COPY("sampler_read_times", reps, sampler_read_times(&samp, 0, samp.time_length, local));
+    BENCH_COPY("memcpy", reps, memcpy(local, samp_buffer, sizeof(local)));
+    if (memcmp(local, samp_buffer, sizeof(local)))
+        printf("  sampler_read_times copied the wrong data!\n");
+
+    BENCH_COPY("player, per word", reps, naive_write(&play, local));
+    BENCH_COPY("player_write_times", reps, player_write_times(&play, 0, play.time_length, local));
+    if (memcmp(local, play_buffer, sizeof(local)))
+        printf("  player_write_times copied the wrong data!\n");
+}
+
+/*
+ * waiting for runs
+ */
+
+// stands in for the work of building the next stimulus
+static void prepare_stimulus(alt_u32* dest, alt_u32 seed, int rounds) {
+    int r, i;
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < BENCH_WORDS; i++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            dest[i] = seed;
+        }
+    }
+}
+
+static volatile unsigned int completions;
+static volatile alt_u64 completed_at;
+
+static void on_done(sampler_state* s, void* context) {
+    completed_at = mock_cycles();
+    completions++;
+}
+
+static void run_start(void) {
+    sampler_start(&samp);
+    player_start(&play);
+}
+
+static void run_finish(void) {
+    player_set_enabled(&play, 0);
+    sampler_set_enabled(&samp, 0);
+}
+
+static void bench_wait(int runs, int rounds) {
+    alt_u64 start, spin_ns, irq_ns, prep_ns, latency = 0;
+    int i;
+
+    // how long one stimulus takes to build, alone
+    prep_ns = ~0ull;
+    for (i = 0; i < 5; i++) {
+        start = mock_now_ns();
+        prepare_stimulus(local, 1, rounds);
+        if (mock_now_ns() - start < prep_ns)
+            prep_ns = mock_now_ns() - start;
+    }
+
+    printf("%i runs, building each stimulus takes %llu ns:\n", runs, (unsigned long long)prep_ns);
+
+    // the old way: busy-wait for done, then build the next stimulus
+    start = mock_now_ns();
+    for (i = 0; i < runs; i++) {
+        run_start();
+        player_wait_done(&play);
+        sampler_wait_done(&samp);
+        run_finish();
+        prepare_stimulus(local, i + 2, rounds);
+        player_write_times(&play, 0, play.time_length, local);
+    }
+    spin_ns = mock_now_ns() - start;
+    printf("  %-22s %10llu ns/run\n", "wait_done, then build", (unsigned long long)(spin_ns / runs));
+
+    // build the next stimulus while this run is going
+    sampler_set_callback(&samp, on_done, NULL);
+    completions = 0;
+    prepare_stimulus(local, 1, rounds);
+    start = mock_now_ns();
+    for (i = 0; i < runs; i++) {
+        player_write_times(&play, 0, play.time_length, local);
+        run_start();
+        prepare_stimulus(local, i + 2, rounds);
+        player_wait(&play);
+        sampler_wait(&samp);
+        latency += mock_cycles() - completed_at;
+        run_finish();
+    }
+    irq_ns = mock_now_ns() - start;
+    sampler_set_callback(&samp, NULL, NULL);
+    printf("  %-22s %10llu ns/run\n", "build during run", (unsigned long long)(irq_ns / runs));
+    // how long the finished pair sat idle before we got back to it
+    printf("  %-22s %10llu %s/run\n", "idle after callback", (unsigned long long)(latency / runs), mock_cycles_unit);
+    if (completions != (unsigned int)runs)
+        printf("  expected %i callbacks, got %u!\n", runs, completions);
+}
+
+int main(int argc, char** argv) {
+    int runs = argc > 1 ? atoi(argv[1]) : 200;
+    alt_u64 latency_ns = argc > 2 ? strtoull(argv[2], NULL, 10) : 500000;
+    int rounds = argc > 3 ? atoi(argv[3]) : 2;
+    mock_device* samp_hw;
+    mock_device* play_hw;
+
+    if (runs <= 0 || rounds <= 0) {
+        fprintf(stderr, "usage: %s [runs] [latency_ns] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    SAMPLER_INIT(SAMP, samp);
+    PLAYER_INIT(PLAY, play);
+    if (sampler_open("/dev/samp") != &samp || player_open("/dev/play") != &play) {
+        fprintf(stderr, "could not find registered devices\n");
+        return 1;
+    }
+
+    bench_copy(50);
+
+    samp_hw = mock_device_start(samp.csr, SAMP_CSR_IRQ_INTERRUPT_CONTROLLER_ID, SAMP_CSR_IRQ, latency_ns);
+    play_hw = mock_device_start(play.csr, PLAY_CSR_IRQ_INTERRUPT_CONTROLLER_ID, PLAY_CSR_IRQ, latency_ns);
+    if (!samp_hw || !play_hw) {
+        fprintf(stderr, "could not start fake hardware\n");
+        return 1;
+    }
+    printf("\n");
+    bench_wait(runs, rounds);
+    mock_device_stop(samp_hw);
+    mock_device_stop(play_hw);
+    return 0;
+}
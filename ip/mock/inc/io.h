@@ -0,0 +1,16 @@
+#ifndef __IO_H__
+#define __IO_H__
+
+// host stand-in for the Nios II HAL's io.h. there's no cache to
+// bypass here, so these are plain volatile accesses.
+
+#include "alt_types.h"
+
+#define __IO_CALC_ADDRESS_NATIVE(base, offset) \
+    ((volatile alt_u32*)(base) + (offset))
+#define IORD(base, offset) \
+    (*__IO_CALC_ADDRESS_NATIVE(base, offset))
+#define IOWR(base, offset, data) \
+    (*__IO_CALC_ADDRESS_NATIVE(base, offset) = (data))
+
+#endif /* __IO_H__ */
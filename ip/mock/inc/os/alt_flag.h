@@ -0,0 +1,22 @@
+#ifndef __ALT_FLAG_H__
+#define __ALT_FLAG_H__
+
+// host stand-in for the Nios II HAL's os/alt_flag.h. like the real
+// one without an OS, these do nothing, so drivers fall back to
+// whatever they do on the bare HAL.
+
+#include "alt_types.h"
+
+ALT_INLINE int ALT_ALWAYS_INLINE alt_no_error(void) {
+    return 0;
+}
+
+#define ALT_FLAG_GRP(group)
+#define ALT_EXTERN_FLAG_GRP(group)
+#define ALT_STATIC_FLAG_GRP(group)
+
+#define ALT_FLAG_CREATE(group, flags) alt_no_error()
+#define ALT_FLAG_PEND(group, flags, wait_type, timeout) alt_no_error()
+#define ALT_FLAG_POST(group, flags, opt) alt_no_error()
+
+#endif /* __ALT_FLAG_H__ */
@@ -0,0 +1,12 @@
+#ifndef __ALT_FILE_H__
+#define __ALT_FILE_H__
+
+// host stand-in for the Nios II HAL's priv/alt_file.h
+
+#include "sys/alt_dev.h"
+
+extern alt_llist alt_dev_list;
+
+extern alt_dev* alt_find_dev(const char* name, alt_llist* list);
+
+#endif /* __ALT_FILE_H__ */
@@ -0,0 +1,21 @@
+#ifndef __ALT_DEV_H__
+#define __ALT_DEV_H__
+
+// host stand-in for the Nios II HAL's sys/alt_dev.h, with just enough
+// of alt_dev for drivers to register and be found by name
+
+typedef struct alt_llist_s {
+    struct alt_llist_s* next;
+    struct alt_llist_s* previous;
+} alt_llist;
+
+#define ALT_LLIST_ENTRY { 0, 0 }
+
+typedef struct alt_dev_s {
+    alt_llist llist;
+    const char* name;
+} alt_dev;
+
+extern int alt_dev_reg(alt_dev* dev);
+
+#endif /* __ALT_DEV_H__ */
@@ -0,0 +1,22 @@
+#ifndef __ALT_IRQ_H__
+#define __ALT_IRQ_H__
+
+// host stand-in for the Nios II HAL's sys/alt_irq.h, with the enhanced
+// interrupt API. interrupts arrive as SIGALRM from the fake hardware in
+// mock.c, and disabling them blocks that signal.
+
+#include "alt_types.h"
+
+#define ALT_ENHANCED_INTERRUPT_API_PRESENT
+#define ALT_IRQ_NOT_CONNECTED (-1)
+
+typedef void (*alt_isr_func)(void* isr_context);
+typedef int alt_irq_context;
+
+extern int alt_ic_isr_register(alt_u32 ic_id, alt_u32 irq, alt_isr_func isr,
+                               void* isr_context, void* flags);
+
+extern alt_irq_context alt_irq_disable_all(void);
+extern void alt_irq_enable_all(alt_irq_context context);
+
+#endif /* __ALT_IRQ_H__ */
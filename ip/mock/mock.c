@@ -0,0 +1,225 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "mock.h"
+#include "sys/alt_dev.h"
+#include "sys/alt_irq.h"
+#include "priv/alt_file.h"
+
+// these match the sampler and player csr layout
+#define MOCK_CSR_ENABLED 0x1
+#define MOCK_CSR_DONE 0x2
+#define MOCK_CSR_IRQ 0x4
+
+#define MOCK_IC_MAX 4
+#define MOCK_IRQ_MAX 32
+
+/*
+ * devices
+ */
+
+alt_llist alt_dev_list = { &alt_dev_list, &alt_dev_list };
+
+int alt_dev_reg(alt_dev* dev) {
+    // add to the end, like the HAL
+    dev->llist.next = &alt_dev_list;
+    dev->llist.previous = alt_dev_list.previous;
+    alt_dev_list.previous->next = &dev->llist;
+    alt_dev_list.previous = &dev->llist;
+    return 0;
+}
+
+alt_dev* alt_find_dev(const char* name, alt_llist* list) {
+    alt_llist* node;
+    for (node = list->next; node != list; node = node->next) {
+        // llist is the first member, so this is the device
+        alt_dev* dev = (alt_dev*)node;
+        if (strcmp(dev->name, name) == 0)
+            return dev;
+    }
+    return NULL;
+}
+
+/*
+ * interrupts
+ */
+
+// interrupts are delivered as SIGALRM, which "disabling" them blocks.
+// like on a Nios II, handlers run on top of whatever main was doing.
+
+static struct {
+    alt_isr_func isr;
+    void* context;
+} handlers[MOCK_IC_MAX][MOCK_IRQ_MAX];
+
+int alt_ic_isr_register(alt_u32 ic_id, alt_u32 irq, alt_isr_func isr,
+                        void* isr_context, void* flags) {
+    if (ic_id >= MOCK_IC_MAX || irq >= MOCK_IRQ_MAX)
+        return -1;
+    alt_irq_context ctx = alt_irq_disable_all();
+    handlers[ic_id][irq].isr = isr;
+    handlers[ic_id][irq].context = isr_context;
+    alt_irq_enable_all(ctx);
+    return 0;
+}
+
+alt_irq_context alt_irq_disable_all(void) {
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGALRM);
+    sigprocmask(SIG_BLOCK, &block, &old);
+    // remember whether they were already disabled, for nesting
+    return sigismember(&old, SIGALRM);
+}
+
+void alt_irq_enable_all(alt_irq_context context) {
+    sigset_t block;
+    if (context)
+        return;
+    sigemptyset(&block);
+    sigaddset(&block, SIGALRM);
+    sigprocmask(SIG_UNBLOCK, &block, NULL);
+}
+
+void mock_raise_irq(alt_u32 ic_id, alt_u32 irq) {
+    if (ic_id >= MOCK_IC_MAX || irq >= MOCK_IRQ_MAX)
+        return;
+    alt_irq_context ctx = alt_irq_disable_all();
+    if (handlers[ic_id][irq].isr)
+        handlers[ic_id][irq].isr(handlers[ic_id][irq].context);
+    alt_irq_enable_all(ctx);
+}
+
+/*
+ * fake hardware
+ */
+
+// the fake hardware only looks at its csr this often
+#define MOCK_TICK_US 20
+
+#define MOCK_DEVICES_MAX 8
+
+struct mock_device_s {
+    volatile alt_u32* csr;
+    alt_u32 ic_id;
+    alt_u32 irq;
+    alt_u64 latency_ns;
+    // when the current run finishes, or 0 if not running
+    alt_u64 done_at;
+};
+
+static mock_device* devices[MOCK_DEVICES_MAX];
+static int devices_running;
+
+alt_u64 mock_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (alt_u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void mock_device_tick(mock_device* d, alt_u64 now) {
+    alt_u32 csr = *d->csr;
+    if (!(csr & MOCK_CSR_ENABLED)) {
+        *d->csr = csr & ~MOCK_CSR_DONE;
+        d->done_at = 0;
+    } else if (!(csr & MOCK_CSR_DONE)) {
+        if (!d->done_at) {
+            d->done_at = now + d->latency_ns;
+        } else if (now >= d->done_at) {
+            *d->csr = csr | MOCK_CSR_DONE | MOCK_CSR_IRQ;
+            d->done_at = 0;
+            mock_raise_irq(d->ic_id, d->irq);
+        }
+    }
+}
+
+static void mock_tick(int signum) {
+    alt_u64 now = mock_now_ns();
+    int i;
+    for (i = 0; i < MOCK_DEVICES_MAX; i++)
+        if (devices[i])
+            mock_device_tick(devices[i], now);
+}
+
+static void mock_set_ticking(int ticking) {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    if (ticking) {
+        timer.it_interval.tv_usec = MOCK_TICK_US;
+        timer.it_value.tv_usec = MOCK_TICK_US;
+    }
+    setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+mock_device* mock_device_start(volatile alt_u32* csr, alt_u32 ic_id, alt_u32 irq, alt_u64 latency_ns) {
+    struct sigaction action;
+    mock_device* d;
+    alt_irq_context ctx;
+    int i;
+
+    d = calloc(1, sizeof(mock_device));
+    if (!d)
+        return NULL;
+    d->csr = csr;
+    d->ic_id = ic_id;
+    d->irq = irq;
+    d->latency_ns = latency_ns;
+
+    ctx = alt_irq_disable_all();
+    for (i = 0; i < MOCK_DEVICES_MAX; i++)
+        if (!devices[i])
+            break;
+    if (i == MOCK_DEVICES_MAX) {
+        alt_irq_enable_all(ctx);
+        free(d);
+        return NULL;
+    }
+    devices[i] = d;
+
+    if (!devices_running++) {
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = mock_tick;
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGALRM, &action, NULL);
+        mock_set_ticking(1);
+    }
+    alt_irq_enable_all(ctx);
+    return d;
+}
+
+void mock_device_stop(mock_device* d) {
+    alt_irq_context ctx = alt_irq_disable_all();
+    int i;
+    for (i = 0; i < MOCK_DEVICES_MAX; i++)
+        if (devices[i] == d)
+            devices[i] = NULL;
+    if (!--devices_running)
+        mock_set_ticking(0);
+    alt_irq_enable_all(ctx);
+    free(d);
+}
+
+/*
+ * timing
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+const char* mock_cycles_unit = "cycles";
+
+alt_u64 mock_cycles(void) {
+    return __rdtsc();
+}
+#else
+const char* mock_cycles_unit = "ns";
+
+alt_u64 mock_cycles(void) {
+    return mock_now_ns();
+}
+#endif
@@ -0,0 +1,27 @@
+#ifndef __MOCK_H__
+#define __MOCK_H__
+
+// controls for the host-side HAL mock, see README.md
+
+#include "alt_types.h"
+
+// fake hardware for one sampler or player. every few microseconds
+// (on SIGALRM, so it interrupts whatever main is doing) it looks at its
+// csr: latency_ns after enabled is set, it sets done and irq and calls
+// the handler registered for ic_id/irq. clearing enabled clears done.
+typedef struct mock_device_s mock_device;
+
+extern mock_device* mock_device_start(volatile alt_u32* csr, alt_u32 ic_id, alt_u32 irq, alt_u64 latency_ns);
+extern void mock_device_stop(mock_device* d);
+
+// runs the handler registered for ic_id/irq, if any, with interrupts
+// disabled (which here means SIGALRM is blocked)
+extern void mock_raise_irq(alt_u32 ic_id, alt_u32 irq);
+
+// a cycle counter where we have one, and ns otherwise
+extern alt_u64 mock_cycles(void);
+extern const char* mock_cycles_unit;
+
+extern alt_u64 mock_now_ns(void);
+
+#endif /* __MOCK_H__ */
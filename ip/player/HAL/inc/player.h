@@ -4,11 +4,21 @@
 #include "player_regs.h"
 #include "alt_types.h"
 #include "sys/alt_dev.h"
+#include "os/alt_flag.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
 
+struct player_state_s;
+
+// called from the interrupt handler when a run finishes, see
+// player_set_callback
+typedef void (*player_callback)(struct player_state_s* s, void* context);
+
+// posted to events by the interrupt handler
+#define PLAYER_EVENT_DONE 0x1
+
 typedef struct player_state_s {
     alt_dev dev;
     
@@ -24,6 +34,16 @@ typedef struct player_state_s {
     alt_u8 sample_bits;
     alt_u8 time_bits;
     alt_u32 time_length;
+
+    // everything below starts zeroed, and is set up at runtime
+    player_callback callback;
+    void* callback_context;
+    // interrupts as of the last player_start
+    volatile unsigned int started;
+    // halves committed since player_stream_begin
+    alt_u32 stream_halves;
+    // for sleeping in player_wait, under an OS
+    ALT_FLAG_GRP(events)
 } player_state;
 
 #define PLAYER_INSTANCE(name, state)            \
@@ -49,6 +69,52 @@ extern void player_initialize(player_state* s);
 
 extern player_state* player_open(const char* name);
 
+// sets (or with NULL, clears) the function to call when a run finishes
+extern void player_set_callback(player_state* s, player_callback callback, void* context);
+
+// starts a run, to be finished with player_wait
+extern void player_start(player_state* s);
+
+// waits for the run begun by player_start. under uC/OS-II the calling
+// task sleeps until the interrupt arrives; on the bare HAL this spins
+// on memory rather than the bus. without an irq, this is
+// player_wait_done.
+extern void player_wait(player_state* s);
+
+// copies count time steps from src into the buffer, from time on. src
+// must hold count << (sample_bits - 2) words.
+// returns 0, or -EINVAL if the range is outside the buffer
+extern int player_write_times(player_state* s, alt_u32 time, alt_u32 count, const alt_u32* src);
+
+// streaming plays the buffer as a ring of two halves, for stimuli
+// longer than the buffer. begin, then write one half at a time; each
+// write waits for the half to be free, and playback starts once both
+// are full. the player interrupts every time it finishes a half, and
+// stops (as done, with an underrun) if it catches up with the writes.
+extern void player_stream_begin(player_state* s);
+
+// copies half a buffer (time_length / 2 time steps) from src into the
+// next free half and hands it to the player, waiting for space first.
+// returns 0, or -EPIPE if the player has underrun
+extern int player_stream_write(player_state* s, const alt_u32* src);
+
+// starts playback if it hasn't yet, waits for everything written to
+// play out, and leaves stream mode. a player that underran between
+// writes has already said so, through player_stream_write
+extern void player_stream_end(player_state* s);
+
+static inline alt_u32 player_stream_half_length(player_state* s) {
+    return s->time_length / 2;
+}
+
+static inline int player_stream_has_space(player_state* s) {
+    return s->csr[0] & PLAYER_CSR_SPACE_MSK;
+}
+
+static inline int player_stream_underrun(player_state* s) {
+    return s->csr[0] & PLAYER_CSR_UNDERRUN_MSK;
+}
+
 static inline int player_is_done(player_state* s) {
     return s->csr[0] & PLAYER_CSR_DONE_MSK;
 }
@@ -73,6 +139,22 @@ static inline volatile alt_u32* player_get_time(player_state* s, alt_u32 time) {
     return &(s->buffer[time << (s->sample_bits - 2)]);
 }
 
+// copies words into the buffer, 8 at a time so the loop overhead
+// doesn't dominate each bus write
+static inline void player_copy_to(volatile alt_u32* dest, const alt_u32* src, alt_u32 words) {
+    while (words >= 8) {
+        alt_u32 a = src[0], b = src[1], c = src[2], d = src[3];
+        alt_u32 e = src[4], f = src[5], g = src[6], h = src[7];
+        dest[0] = a; dest[1] = b; dest[2] = c; dest[3] = d;
+        dest[4] = e; dest[5] = f; dest[6] = g; dest[7] = h;
+        src += 8;
+        dest += 8;
+        words -= 8;
+    }
+    while (words--)
+        *dest++ = *src++;
+}
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include <errno.h>
 #include "player.h"
 #include "sys/alt_irq.h"
 #include "priv/alt_file.h"
@@ -11,10 +12,15 @@ static void player_handle_irq(void* context
     player_state* s = context;
     s->csr[0] &= ~PLAYER_CSR_IRQ_MSK;
     s->interrupts++;
+    ALT_FLAG_POST(s->events, PLAYER_EVENT_DONE, OS_FLAG_SET);
+    if (s->callback)
+        s->callback(s, s->callback_context);
 }
 
 void player_initialize(player_state* s) {
-    if (s->irq != ALT_IRQ_NOT_CONNECTED) {
+    ALT_FLAG_CREATE(&(s->events), 0);
+
+    if (s->irq != (alt_u8)ALT_IRQ_NOT_CONNECTED) {
 #ifdef ALT_ENHANCED_INTERRUPT_API_PRESENT
         alt_ic_isr_register(s->irq_controller_id, s->irq, player_handle_irq, s, NULL);
 #else
@@ -30,3 +36,96 @@ player_state* player_open(const char* name) {
     player_state* s = (player_state*)alt_find_dev(name, &alt_dev_list);
     return s;
 }
+
+void player_set_callback(player_state* s, player_callback callback, void* context) {
+    // so the handler never sees half of this
+    alt_irq_context ctx = alt_irq_disable_all();
+    s->callback = callback;
+    s->callback_context = context;
+    alt_irq_enable_all(ctx);
+}
+
+void player_start(player_state* s) {
+    // disabling resets the device, but that has to cross into the
+    // sample clock before done drops, so a quick 0-1 pulse may be missed.
+    // this also leaves stream mode, if we were in it
+    s->csr[0] &= ~(PLAYER_CSR_ENABLED_MSK | PLAYER_CSR_STREAM_MSK);
+    while (player_is_done(s));
+    ALT_FLAG_POST(s->events, PLAYER_EVENT_DONE, OS_FLAG_CLR);
+    s->started = s->interrupts;
+    player_set_enabled(s, 1);
+}
+
+void player_wait(player_state* s) {
+    if (s->irq == (alt_u8)ALT_IRQ_NOT_CONNECTED) {
+        player_wait_done(s);
+        return;
+    }
+
+    // this is a no-op without an OS
+    ALT_FLAG_PEND(s->events, PLAYER_EVENT_DONE, OS_FLAG_WAIT_SET_ANY + OS_FLAG_CONSUME, 0);
+    while (s->interrupts == s->started);
+}
+
+void player_stream_begin(player_state* s) {
+    // the ring only empties once the reset has crossed over, which is
+    // also when done (an old underrun) drops
+    s->csr[0] = 0;
+    while (player_is_done(s));
+    s->csr[0] = PLAYER_CSR_STREAM_MSK;
+    s->stream_halves = 0;
+}
+
+// waits until the next half can be written
+static int player_stream_wait(player_state* s) {
+    unsigned int seen;
+    alt_u32 csr;
+
+    for (;;) {
+        // every half played interrupts, so note where we are first
+        seen = s->interrupts;
+        csr = s->csr[0];
+        if (csr & PLAYER_CSR_UNDERRUN_MSK)
+            return -EPIPE;
+        if (csr & PLAYER_CSR_SPACE_MSK)
+            return 0;
+
+        if (s->irq != (alt_u8)ALT_IRQ_NOT_CONNECTED) {
+            ALT_FLAG_PEND(s->events, PLAYER_EVENT_DONE, OS_FLAG_WAIT_SET_ANY + OS_FLAG_CONSUME, 0);
+            while (s->interrupts == seen);
+        }
+    }
+}
+
+int player_stream_write(player_state* s, const alt_u32* src) {
+    alt_u32 half = player_stream_half_length(s);
+    int err = player_stream_wait(s);
+    if (err)
+        return err;
+
+    player_write_times(s, (s->csr[0] & PLAYER_CSR_HALF_MSK) ? half : 0, half, src);
+    s->csr[0] |= PLAYER_CSR_COMMIT_MSK;
+    if (++s->stream_halves == 2) {
+        ALT_FLAG_POST(s->events, PLAYER_EVENT_DONE, OS_FLAG_CLR);
+        s->started = s->interrupts;
+        player_set_enabled(s, 1);
+    }
+    return 0;
+}
+
+void player_stream_end(player_state* s) {
+    // running out of halves is how a stream finishes
+    if (s->stream_halves) {
+        if (!player_is_enabled(s))
+            player_set_enabled(s, 1);
+        player_wait_done(s);
+    }
+    s->csr[0] = 0;
+}
+
+int player_write_times(player_state* s, alt_u32 time, alt_u32 count, const alt_u32* src) {
+    if (time > s->time_length || count > s->time_length - time)
+        return -EINVAL;
+    player_copy_to(player_get_time(s, time), src, count << (s->sample_bits - 2));
+    return 0;
+}
@@ -17,5 +17,15 @@
 #define PLAYER_CSR_DONE_OFST    (1)
 #define PLAYER_CSR_IRQ_MSK      (0x4)
 #define PLAYER_CSR_IRQ_OFST     (2)
+#define PLAYER_CSR_STREAM_MSK   (0x8)
+#define PLAYER_CSR_STREAM_OFST  (3)
+#define PLAYER_CSR_COMMIT_MSK   (0x10)
+#define PLAYER_CSR_COMMIT_OFST  (4)
+#define PLAYER_CSR_SPACE_MSK    (0x20)
+#define PLAYER_CSR_SPACE_OFST   (5)
+#define PLAYER_CSR_HALF_MSK     (0x40)
+#define PLAYER_CSR_HALF_OFST    (6)
+#define PLAYER_CSR_UNDERRUN_MSK  (0x80)
+#define PLAYER_CSR_UNDERRUN_OFST (7)
 
 #endif /* __PLAYER_REGS_H__ */
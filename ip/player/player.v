@@ -1,7 +1,7 @@
 // a simple chunk of memory that you can fill with samples on the write side
 // and then allows playing back in order on the read side
 // (both sides work on different clocks)
-module player(r_clk, r_reset_n, r_out, r_done, w_clk, w_enable, w_addr, w_in);
+module player(r_clk, r_reset_n, r_stream, r_go, r_out, r_done, w_clk, w_enable, w_addr, w_in);
     parameter timeBits = 10;
 
     // read: clock, reset, and output, and a done flag
@@ -10,6 +10,11 @@ module player(r_clk, r_reset_n, r_out, r_done, w_clk, w_enable, w_addr, w_in);
     output reg [31:0] r_out;
     output r_done;
 
+    // in stream mode the cursor wraps around instead of finishing, and
+    // only moves (or changes r_out) while r_go is set
+    input r_stream;
+    input r_go;
+
     // the internal read cursor, with an extra bit
     // when this bit is set, we are done playing
     reg [timeBits:0] r_addr = 1 << timeBits;
@@ -28,9 +33,12 @@ module player(r_clk, r_reset_n, r_out, r_done, w_clk, w_enable, w_addr, w_in);
     always @(posedge r_clk)
     begin
         // if we're not reset, and we're playing...
-        if (r_reset_n && !r_done)
+        if (r_reset_n && !r_done && (!r_stream || r_go))
         begin
-            r_addr <= r_addr + 1;
+            if (r_stream)
+                r_addr <= {1'b0, r_addr[timeBits-1:0] + 1'b1};
+            else
+                r_addr <= r_addr + 1;
         end
 
         // if we're reset
@@ -39,7 +47,8 @@ module player(r_clk, r_reset_n, r_out, r_done, w_clk, w_enable, w_addr, w_in);
             r_addr <= 0;
         end
 
-        r_out <= memory[r_addr[timeBits-1:0]];
+        if (!r_stream || r_go)
+            r_out <= memory[r_addr[timeBits-1:0]];
     end
 
     // write side
@@ -55,6 +64,7 @@ module qsys_player
     #(parameter outputBits = 32,
       parameter words_log_2 = 0,
       parameter words = 1,
+      // at least 2, so each half of the stream ring has a couple of steps
       parameter timeBits = 10
       )
     (// read side
@@ -82,7 +92,6 @@ module qsys_player
     wire [timeBits-1:0] w_addr;
     wire [words-1:0] w_enable;
     wire [words-1:0] r_dones;
-    wire r_done = r_dones[0];
     reg csr_enable = 0;
 
     // r_reset_n is driven by clk, but needs to be crossed into r_clk
@@ -99,25 +108,126 @@ module qsys_player
         r_reset_n_sync_out <= r_reset_n_sync_in;
     end
 
+    // streaming: the buffer becomes a ring of two halves, played over
+    // and over. the host fills a half and commits it; the read side
+    // plays committed halves in order and hands each back once it is
+    // played, which fires irq so the host can refill it. if the read
+    // side reaches a half that isn't committed, it underruns and stops,
+    // which counts as done. counts of halves committed (w_halves) and
+    // played (r_halves) cross clocks in gray code, mod 4.
+    reg csr_stream = 0;
+    reg [1:0] w_halves = 0;
+    reg [1:0] w_halves_gray = 0;
+    reg [1:0] r_halves = 0;
+    reg [1:0] r_halves_gray = 0;
+
+    function [1:0] to_gray(input [1:0] b);
+        to_gray = b ^ (b >> 1);
+    endfunction
+
+    function [1:0] from_gray(input [1:0] g);
+        from_gray = {g[1], g[1] ^ g[0]};
+    endfunction
+
+    // clk side, crossed into r_clk
+    reg r_stream_sync_in, r_stream_sync_out;
+    reg [1:0] w_halves_sync_in, w_halves_sync_out;
+    always @(posedge r_clk)
+    begin
+        r_stream_sync_in <= csr_stream;
+        r_stream_sync_out <= r_stream_sync_in;
+        w_halves_sync_in <= w_halves_gray;
+        w_halves_sync_out <= w_halves_sync_in;
+    end
+
+    // r_clk side: where we are in the current half, and whether it is
+    // committed. this moves in step with every player's cursor
+    reg [timeBits-2:0] r_pos = 0;
+    reg r_underrun = 0;
+    wire r_go = from_gray(w_halves_sync_out) != r_halves && !r_underrun;
+    always @(posedge r_clk)
+    begin
+        if (!r_reset_n_sync_out)
+        begin
+            r_pos <= 0;
+            r_halves <= 0;
+            r_halves_gray <= 0;
+            r_underrun <= 0;
+        end
+        else if (r_stream_sync_out)
+        begin
+            if (r_go)
+            begin
+                r_pos <= r_pos + 1'b1;
+                if (&r_pos)
+                begin
+                    r_halves <= r_halves + 1'b1;
+                    r_halves_gray <= to_gray(r_halves + 1'b1);
+                end
+            end
+            else
+            begin
+                r_underrun <= 1;
+            end
+        end
+    end
+
+    // r_clk side, crossed into clk
+    reg [1:0] r_halves_sync_in, r_halves_sync_out;
+    always @(posedge clk)
+    begin
+        r_halves_sync_in <= r_halves_gray;
+        r_halves_sync_out <= r_halves_sync_in;
+    end
+    wire [1:0] halves_played = from_gray(r_halves_sync_out);
+    // we may lag the read side, so this errs on the side of full
+    wire space = csr_stream && (w_halves - halves_played) != 2'd2;
+
+    // in stream mode, the players never finish on their own
+    wire r_done = r_stream_sync_out ? r_underrun : r_dones[0];
+
     // control
     // bits, least significant to most
     // - reset_n (rw)
     // - done (ro)
     // - irq (rw -- can only set to 0)
-    
+    // - stream (rw -- clearing it empties the ring)
+    // - commit (wo -- reads 0, writing 1 commits the next half)
+    // - space (ro -- the next half may be filled)
+    // - half (ro -- which half is next, 0 for the lower)
+    // - underrun (ro)
+
     reg old_done = 0;
+    reg [1:0] old_halves_played = 0;
     always @(posedge clk)
     begin
         if (csr_write)
         begin
             csr_enable <= csr_writedata[0];
+            csr_stream <= csr_writedata[3];
             irq <= 0;
+
+            if (!csr_writedata[3])
+            begin
+                w_halves <= 0;
+                w_halves_gray <= 0;
+            end
+            else if (csr_writedata[4] && space)
+            begin
+                w_halves <= w_halves + 1'b1;
+                w_halves_gray <= to_gray(w_halves + 1'b1);
+            end
         end
         else if (csr_read)
         begin
+            csr_readdata <= 0;
             csr_readdata[0] <= csr_enable;
             csr_readdata[1] <= r_done;
             csr_readdata[2] <= irq;
+            csr_readdata[3] <= csr_stream;
+            csr_readdata[5] <= space;
+            csr_readdata[6] <= w_halves[0];
+            csr_readdata[7] <= r_underrun;
         end
 
         // fire irq when we finish
@@ -125,10 +235,18 @@ module qsys_player
             irq <= 1;
         old_done <= r_done;
 
+        // ...and in stream mode, whenever a half is played
+        if (csr_stream && csr_enable && halves_played != old_halves_played)
+            irq <= 1;
+        old_halves_played <= halves_played;
+
         // if reset, then reset our reset (eww)
         if (!reset_n)
         begin
             csr_enable <= 0;
+            csr_stream <= 0;
+            w_halves <= 0;
+            w_halves_gray <= 0;
             old_done <= 0;
             irq <= 0;
         end
@@ -147,7 +265,7 @@ module qsys_player
     generate
         for (i = 0; i < words; i = i + 1)
         begin : players
-            player #(timeBits) p(r_clk, r_reset_n_sync_out, r_out[((i == words-1) ? (outputBits-1) : (32*i+31)):32*i], r_dones[i], clk, w_enable[i], w_addr, buffer_writedata);
+            player #(timeBits) p(r_clk, r_reset_n_sync_out, r_stream_sync_out, r_go, r_out[((i == words-1) ? (outputBits-1) : (32*i+31)):32*i], r_dones[i], clk, w_enable[i], w_addr, buffer_writedata);
         end
     endgenerate
 endmodule
@@ -93,7 +93,7 @@ set_parameter_property timeBits DISPLAY_NAME "Time Width"
 set_parameter_property timeBits WIDTH ""
 set_parameter_property timeBits TYPE POSITIVE
 set_parameter_property timeBits UNITS bits
-set_parameter_property timeBits ALLOWED_RANGES 1:32
+set_parameter_property timeBits ALLOWED_RANGES 2:32
 set_parameter_property timeBits DESCRIPTION "number of bits of time data to keep"
 set_parameter_property timeBits HDL_PARAMETER true
 add_parameter addrBits POSITIVE 1 "total bits of address space occupied"
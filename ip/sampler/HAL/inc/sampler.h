@@ -4,11 +4,21 @@
 #include "sampler_regs.h"
 #include "alt_types.h"
 #include "sys/alt_dev.h"
+#include "os/alt_flag.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
 
+struct sampler_state_s;
+
+// called from the interrupt handler when a run finishes, see
+// sampler_set_callback
+typedef void (*sampler_callback)(struct sampler_state_s* s, void* context);
+
+// posted to events by the interrupt handler
+#define SAMPLER_EVENT_DONE 0x1
+
 typedef struct sampler_state_s {
     alt_dev dev;
     
@@ -24,6 +34,14 @@ typedef struct sampler_state_s {
     alt_u8 sample_bits;
     alt_u8 time_bits;
     alt_u32 time_length;
+
+    // everything below starts zeroed, and is set up at runtime
+    sampler_callback callback;
+    void* callback_context;
+    // interrupts as of the last sampler_start
+    volatile unsigned int started;
+    // for sleeping in sampler_wait, under an OS
+    ALT_FLAG_GRP(events)
 } sampler_state;
 
 #define SAMPLER_INSTANCE(name, state)           \
@@ -49,6 +67,23 @@ extern void sampler_initialize(sampler_state* s);
 
 extern sampler_state* sampler_open(const char* name);
 
+// sets (or with NULL, clears) the function to call when a run finishes
+extern void sampler_set_callback(sampler_state* s, sampler_callback callback, void* context);
+
+// starts a run, to be finished with sampler_wait
+extern void sampler_start(sampler_state* s);
+
+// waits for the run begun by sampler_start. under uC/OS-II the calling
+// task sleeps until the interrupt arrives; on the bare HAL this spins
+// on memory rather than the bus. without an irq, this is
+// sampler_wait_done.
+extern void sampler_wait(sampler_state* s);
+
+// copies count time steps, from time on, out of the buffer into dest,
+// which must hold count << (sample_bits - 2) words.
+// returns 0, or -EINVAL if the range is outside the buffer
+extern int sampler_read_times(sampler_state* s, alt_u32 time, alt_u32 count, alt_u32* dest);
+
 static inline int sampler_is_done(sampler_state* s) {
     return s->csr[0] & SAMPLER_CSR_DONE_MSK;
 }
@@ -73,6 +108,22 @@ static inline volatile alt_u32* sampler_get_time(sampler_state* s, alt_u32 time)
     return &(s->buffer[time << (s->sample_bits - 2)]);
 }
 
+// copies words out of the buffer, 8 at a time so the loop overhead
+// doesn't dominate each bus read
+static inline void sampler_copy_from(alt_u32* dest, volatile const alt_u32* src, alt_u32 words) {
+    while (words >= 8) {
+        alt_u32 a = src[0], b = src[1], c = src[2], d = src[3];
+        alt_u32 e = src[4], f = src[5], g = src[6], h = src[7];
+        dest[0] = a; dest[1] = b; dest[2] = c; dest[3] = d;
+        dest[4] = e; dest[5] = f; dest[6] = g; dest[7] = h;
+        src += 8;
+        dest += 8;
+        words -= 8;
+    }
+    while (words--)
+        *dest++ = *src++;
+}
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
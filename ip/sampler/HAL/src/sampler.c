@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include <errno.h>
 #include "sampler.h"
 #include "sys/alt_irq.h"
 #include "priv/alt_file.h"
@@ -11,10 +12,15 @@ static void sampler_handle_irq(void* context
     sampler_state* s = context;
     s->csr[0] &= ~SAMPLER_CSR_IRQ_MSK;
     s->interrupts++;
+    ALT_FLAG_POST(s->events, SAMPLER_EVENT_DONE, OS_FLAG_SET);
+    if (s->callback)
+        s->callback(s, s->callback_context);
 }
 
 void sampler_initialize(sampler_state* s) {
-    if (s->irq != ALT_IRQ_NOT_CONNECTED) {
+    ALT_FLAG_CREATE(&(s->events), 0);
+
+    if (s->irq != (alt_u8)ALT_IRQ_NOT_CONNECTED) {
 #ifdef ALT_ENHANCED_INTERRUPT_API_PRESENT
         alt_ic_isr_register(s->irq_controller_id, s->irq, sampler_handle_irq, s, NULL);
 #else
@@ -30,3 +36,39 @@ sampler_state* sampler_open(const char* name) {
     sampler_state* s = (sampler_state*)alt_find_dev(name, &alt_dev_list);
     return s;
 }
+
+void sampler_set_callback(sampler_state* s, sampler_callback callback, void* context) {
+    // so the handler never sees half of this
+    alt_irq_context ctx = alt_irq_disable_all();
+    s->callback = callback;
+    s->callback_context = context;
+    alt_irq_enable_all(ctx);
+}
+
+void sampler_start(sampler_state* s) {
+    // disabling resets the device, but that has to cross into the
+    // sample clock before done drops, so a quick 0-1 pulse may be missed
+    sampler_set_enabled(s, 0);
+    while (sampler_is_done(s));
+    ALT_FLAG_POST(s->events, SAMPLER_EVENT_DONE, OS_FLAG_CLR);
+    s->started = s->interrupts;
+    sampler_set_enabled(s, 1);
+}
+
+void sampler_wait(sampler_state* s) {
+    if (s->irq == (alt_u8)ALT_IRQ_NOT_CONNECTED) {
+        sampler_wait_done(s);
+        return;
+    }
+
+    // this is a no-op without an OS
+    ALT_FLAG_PEND(s->events, SAMPLER_EVENT_DONE, OS_FLAG_WAIT_SET_ANY + OS_FLAG_CONSUME, 0);
+    while (s->interrupts == s->started);
+}
+
+int sampler_read_times(sampler_state* s, alt_u32 time, alt_u32 count, alt_u32* dest) {
+    if (time > s->time_length || count > s->time_length - time)
+        return -EINVAL;
+    sampler_copy_from(dest, sampler_get_time(s, time), count << (s->sample_bits - 2));
+    return 0;
+}
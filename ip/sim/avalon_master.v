@@ -0,0 +1,57 @@
+`timescale 1ns / 1ps
+
+// an Avalon-MM master for testbenches, with fixed wait states to match
+// a slave's readWaitTime and writeWaitTime. call the tasks just after a
+// rising edge of clk (see sync); they return the same way, so calls can
+// go back to back like a real master's would.
+module avalon_master
+    #(parameter addrBits = 1,
+      parameter readWait = 1,
+      parameter writeWait = 0
+      )
+    (input clk,
+     output reg [addrBits-1:0] address = 0,
+     output reg read = 0,
+     output reg write = 0,
+     output reg [31:0] writedata = 0,
+     input [31:0] readdata
+     );
+
+    // transfers so far
+    integer reads = 0;
+    integer writes = 0;
+
+    task sync;
+        begin
+            @(posedge clk);
+            #1;
+        end
+    endtask
+
+    task do_read(input [addrBits-1:0] addr, output [31:0] data);
+        begin
+            address = addr;
+            read = 1;
+            repeat (readWait) @(posedge clk);
+            // readdata is sampled on the edge that ends the transfer
+            @(negedge clk);
+            data = readdata;
+            @(posedge clk);
+            #1;
+            read = 0;
+            reads = reads + 1;
+        end
+    endtask
+
+    task do_write(input [addrBits-1:0] addr, input [31:0] data);
+        begin
+            address = addr;
+            writedata = data;
+            write = 1;
+            repeat (writeWait + 1) @(posedge clk);
+            #1;
+            write = 0;
+            writes = writes + 1;
+        end
+    endtask
+endmodule
@@ -0,0 +1,463 @@
+`timescale 1ns / 1ps
+
+// a testbench for qsys_sampler and qsys_player, driving them over
+// Avalon-MM the way a Nios II or HPS bridge would. it checks their data
+// end to end, and reports bus throughput, enable-to-done latency and
+// irq timing. it also streams through the player's two-half ring,
+// refilling it over the bus as it plays. see the Makefile for how to
+// run it.
+module sp_tb;
+    // the cores' own parameters
+    parameter width = 32;
+    parameter timeBits = 10;
+    // half periods, in ns, of the bus clock and the sample/play clock
+    parameter clkHalf = 10;
+    parameter sclkHalf = 10;
+    // enable/done cycles to run each core through
+    parameter runs = 2;
+
+    localparam words = (width + 31) / 32;
+    localparam wordsLog2 = $clog2(words);
+    localparam addrBits = timeBits + wordsLog2;
+    localparam timeLength = 1 << timeBits;
+    // halves to stream through the player's ring, and how long that is
+    localparam halfLength = timeLength / 2;
+    localparam streamHalves = 6;
+    localparam streamLength = streamHalves * halfLength;
+    // streams are refilled over the bus as they play, so they play on
+    // a clock slow enough to rewrite a half while the other one plays
+    localparam streamClkHalf = clkHalf * (2 * words + 32 / halfLength + 2);
+    localparam streamSclkHalf = streamClkHalf > sclkHalf ? streamClkHalf : sclkHalf;
+    // give up on done after this many csr polls
+    localparam pollLimit = 4 * timeLength * (streamSclkHalf + clkHalf) / clkHalf + 64;
+
+    // csr bits, as in the *_regs.h headers
+    localparam CSR_ENABLED = 32'h1;
+    localparam CSR_DONE = 32'h2;
+    localparam CSR_IRQ = 32'h4;
+    // players only
+    localparam CSR_STREAM = 32'h8;
+    localparam CSR_COMMIT = 32'h10;
+    localparam CSR_SPACE = 32'h20;
+    localparam CSR_HALF = 32'h40;
+    localparam CSR_UNDERRUN = 32'h80;
+
+    reg clk = 0;
+    reg sclk = 0;
+    reg reset_n = 0;
+    always #clkHalf clk = !clk;
+    always #sclkHalf sclk = !sclk;
+
+    // the player's clock, switched over (while it's reset) for streams
+    reg stream_sclk = 0;
+    reg play_slow = 0;
+    always #streamSclkHalf stream_sclk = !stream_sclk;
+    wire play_clk = play_slow ? stream_sclk : sclk;
+
+    // bus clock cycles so far
+    integer cycle = 0;
+    always @(posedge clk)
+        cycle <= cycle + 1;
+
+    integer errors = 0;
+
+    // word w of the sample at time t is t, with w in its top byte
+    function [32*words-1:0] pattern(input integer t);
+        integer w;
+        begin
+            for (w = 0; w < words; w = w + 1)
+                pattern[32*w +: 32] = t ^ (w << 24);
+        end
+    endfunction
+
+    /*
+     * the sampler, recording a counter
+     */
+
+    wire [addrBits-1:0] samp_address;
+    wire samp_read;
+    wire [31:0] samp_readdata;
+    wire samp_csr_write;
+    wire [31:0] samp_csr_writedata;
+    wire samp_csr_read;
+    wire [31:0] samp_csr_readdata;
+    wire samp_irq;
+    wire samp_reset_n;
+
+    reg [width-1:0] samp_in = 0;
+    integer samp_count = 0;
+    always @(posedge sclk) begin
+        samp_count <= samp_count + 1;
+        samp_in <= pattern(samp_count + 1);
+    end
+
+    qsys_sampler #(.inputBits(width), .words_log_2(wordsLog2), .words(words), .timeBits(timeBits))
+    samp(.w_clk(sclk), .w_in(samp_in), .w_reset_n(samp_reset_n), .w_enable(1'b0),
+         .clk(clk), .reset_n(reset_n),
+         .buffer_read(samp_read), .buffer_address(samp_address), .buffer_readdata(samp_readdata),
+         .csr_write(samp_csr_write), .csr_writedata(samp_csr_writedata),
+         .csr_read(samp_csr_read), .csr_readdata(samp_csr_readdata),
+         .irq(samp_irq));
+
+    avalon_master #(.addrBits(addrBits), .readWait(1), .writeWait(0))
+    samp_bus(.clk(clk), .address(samp_address), .read(samp_read), .write(),
+             .writedata(), .readdata(samp_readdata));
+
+    avalon_master #(.readWait(1), .writeWait(0))
+    samp_csr(.clk(clk), .address(), .read(samp_csr_read), .write(samp_csr_write),
+             .writedata(samp_csr_writedata), .readdata(samp_csr_readdata));
+
+    /*
+     * the player, checked against pattern()
+     */
+
+    wire [addrBits-1:0] play_address;
+    wire play_write;
+    wire [31:0] play_writedata;
+    wire play_csr_write;
+    wire [31:0] play_csr_writedata;
+    wire play_csr_read;
+    wire [31:0] play_csr_readdata;
+    wire play_irq;
+    wire play_reset_n;
+    wire [width-1:0] play_out;
+
+    qsys_player #(.outputBits(width), .words_log_2(wordsLog2), .words(words), .timeBits(timeBits))
+    play(.r_clk(play_clk), .r_out(play_out), .r_reset_n(play_reset_n), .r_enable(1'b0),
+         .clk(clk), .reset_n(reset_n),
+         .buffer_write(play_write), .buffer_address(play_address), .buffer_writedata(play_writedata),
+         .csr_write(play_csr_write), .csr_writedata(play_csr_writedata),
+         .csr_read(play_csr_read), .csr_readdata(play_csr_readdata),
+         .irq(play_irq));
+
+    avalon_master #(.addrBits(addrBits), .readWait(1), .writeWait(0))
+    play_bus(.clk(clk), .address(play_address), .read(), .write(play_write),
+             .writedata(play_writedata), .readdata(32'h0));
+
+    avalon_master #(.readWait(1), .writeWait(0))
+    play_csr(.clk(clk), .address(), .read(play_csr_read), .write(play_csr_write),
+             .writedata(play_csr_writedata), .readdata(play_csr_readdata));
+
+    // how far through pattern() the player has got, in order
+    reg play_check = 0;
+    integer played = 0;
+    reg [width-1:0] play_expect;
+    always @(posedge play_clk) begin
+        play_expect = pattern(played);
+        if (play_check && played < timeLength && play_out === play_expect)
+            played <= played + 1;
+    end
+
+    // the same for streams, which must also play without gaps: once
+    // under way, every sample clock should bring the next sample. the
+    // first sample shows up while the player is still held in reset,
+    // so gaps only count from the second
+    reg stream_check = 0;
+    integer streamed = 0;
+    integer stream_gaps = 0;
+    reg [width-1:0] stream_expect;
+    always @(posedge play_clk) begin
+        stream_expect = pattern(streamed);
+        if (stream_check && streamed < streamLength) begin
+            if (play_out === stream_expect)
+                streamed <= streamed + 1;
+            else if (streamed > 1)
+                stream_gaps <= stream_gaps + 1;
+        end
+    end
+
+    /*
+     * irq timing
+     */
+
+    integer samp_irqs = 0;
+    integer samp_irq_at = 0;
+    integer play_irqs = 0;
+    integer play_irq_at = 0;
+    reg samp_irq_last = 0;
+    reg play_irq_last = 0;
+    always @(posedge clk) begin
+        samp_irq_last <= samp_irq;
+        play_irq_last <= play_irq;
+        if (samp_irq && !samp_irq_last) begin
+            samp_irqs = samp_irqs + 1;
+            samp_irq_at = cycle;
+        end
+        if (play_irq && !play_irq_last) begin
+            play_irqs = play_irqs + 1;
+            play_irq_at = cycle;
+        end
+    end
+
+    /*
+     * helpers
+     */
+
+    // writes csr, then polls it until (csr & mask) == value, setting
+    // took to the cycles from the write to the poll that saw it
+    task samp_csr_wait(input [31:0] csr, input [31:0] mask, input [31:0] value, output integer took);
+        reg [31:0] data;
+        integer start;
+        integer polls;
+        begin
+            start = cycle;
+            samp_csr.do_write(0, csr);
+            data = ~value;
+            polls = 0;
+            while ((data & mask) !== value && polls < pollLimit) begin
+                samp_csr.do_read(0, data);
+                polls = polls + 1;
+            end
+            took = cycle - start;
+            if (polls >= pollLimit) begin
+                $display("  sampler: csr never read 0x%0h under mask 0x%0h", value, mask);
+                errors = errors + 1;
+            end
+        end
+    endtask
+
+    task play_csr_wait(input [31:0] csr, input [31:0] mask, input [31:0] value, output integer took);
+        reg [31:0] data;
+        integer start;
+        integer polls;
+        begin
+            start = cycle;
+            play_csr.do_write(0, csr);
+            data = ~value;
+            polls = 0;
+            while ((data & mask) !== value && polls < pollLimit) begin
+                play_csr.do_read(0, data);
+                polls = polls + 1;
+            end
+            took = cycle - start;
+            if (polls >= pollLimit) begin
+                $display("  player: csr never read 0x%0h under mask 0x%0h", value, mask);
+                errors = errors + 1;
+            end
+        end
+    endtask
+
+    // waits for the player's irq count to pass count
+    task play_irq_wait(input integer count);
+        integer polls;
+        begin
+            polls = 0;
+            while (play_irqs <= count && polls < pollLimit) begin
+                play_csr.sync;
+                polls = polls + 1;
+            end
+            if (polls >= pollLimit) begin
+                $display("  player stream: irq %0d never came", count + 1);
+                errors = errors + 1;
+            end
+        end
+    endtask
+
+    // writes half k of the stream into half h of the player's ring
+    task play_write_half(input integer k, input integer h);
+        reg [32*words-1:0] sample;
+        integer t;
+        integer w;
+        begin
+            for (t = 0; t < halfLength; t = t + 1) begin
+                sample = pattern(k * halfLength + t);
+                for (w = 0; w < words; w = w + 1)
+                    play_bus.do_write(((h * halfLength + t) << wordsLog2) | w, sample[32*w +: 32]);
+            end
+        end
+    endtask
+
+    /*
+     * the tests
+     */
+
+    integer run;
+    integer k;
+    integer t;
+    integer w;
+    integer start;
+    integer took;
+    integer first;
+    integer irqs_before;
+    integer bus_cycles;
+    reg [31:0] data;
+    reg [32*words-1:0] sample;
+    reg [width-1:0] wanted;
+
+    initial begin
+        $display("width %0d, timeBits %0d, clk %0d ns, sample clk %0d ns",
+                 width, timeBits, 2 * clkHalf, 2 * sclkHalf);
+
+        repeat (4) @(posedge clk);
+        #1 reset_n = 1;
+        repeat (16) @(posedge clk);
+        #1;
+        // nothing is running yet, so any irqs so far are stray
+        $display("  irqs after reset: sampler %0d, player %0d", samp_irqs, play_irqs);
+
+        // player: fill the buffer, then play it back
+        start = cycle;
+        for (t = 0; t < timeLength; t = t + 1) begin
+            sample = pattern(t);
+            for (w = 0; w < words; w = w + 1)
+                play_bus.do_write((t << wordsLog2) | w, sample[32*w +: 32]);
+        end
+        bus_cycles = cycle - start;
+        $display("  player write: %0d words in %0d cycles, %0.3f beats/cycle",
+                 timeLength * words, bus_cycles, (timeLength * words * 1.0) / bus_cycles);
+
+        for (run = 0; run < runs; run = run + 1) begin
+            play_csr_wait(0, CSR_DONE, 0, took);
+            play_check = 0;
+            #1 played = 0;
+            play_check = 1;
+            irqs_before = play_irqs;
+            start = cycle;
+            play_csr_wait(CSR_ENABLED, CSR_DONE, CSR_DONE, took);
+            if (play_irqs != irqs_before + 1) begin
+                $display("  player run %0d: expected 1 irq, got %0d", run, play_irqs - irqs_before);
+                errors = errors + 1;
+            end
+            $display("  player run %0d: enable to done %0d cycles (%0d samples), irq at +%0d",
+                     run, took, timeLength, play_irq_at - start);
+            play_check = 0;
+            if (played != timeLength) begin
+                $display("  player run %0d: played %0d of %0d samples in order", run, played, timeLength);
+                errors = errors + 1;
+            end
+        end
+        play_csr.do_write(0, 0);
+
+        // player: stream through the ring, refilling each half as its
+        // irq comes in
+        if (timeBits < 4) begin
+            $display("  player stream: skipped, halves too short to refill in time");
+        end else begin
+            play_slow = 1;
+            play_csr.do_write(0, CSR_STREAM);
+            for (k = 0; k < 2; k = k + 1) begin
+                play_csr.do_read(0, data);
+                if ((data & (CSR_SPACE | CSR_HALF)) !== (CSR_SPACE | (k ? CSR_HALF : 0))) begin
+                    $display("  player stream: csr 0x%0h before committing half %0d", data, k);
+                    errors = errors + 1;
+                end
+                play_write_half(k, k);
+                play_csr.do_write(0, CSR_STREAM | CSR_COMMIT);
+            end
+            play_csr.do_read(0, data);
+            if (data & (CSR_SPACE | CSR_HALF)) begin
+                $display("  player stream: csr 0x%0h with the ring full", data);
+                errors = errors + 1;
+            end
+
+            stream_check = 0;
+            #1 streamed = 0;
+            stream_gaps = 0;
+            stream_check = 1;
+            irqs_before = play_irqs;
+            start = cycle;
+            play_csr.do_write(0, CSR_STREAM | CSR_ENABLED);
+            for (k = 2; k < streamHalves; k = k + 1) begin
+                // each half played hands it back, with one irq
+                play_irq_wait(irqs_before + k - 2);
+                if (play_irqs != irqs_before + k - 1) begin
+                    $display("  player stream: expected %0d irqs by half %0d, got %0d",
+                             k - 1, k, play_irqs - irqs_before);
+                    errors = errors + 1;
+                end
+                play_csr.do_read(0, data);
+                if ((data & (CSR_SPACE | CSR_HALF | CSR_UNDERRUN)) !== (CSR_SPACE | ((k & 1) ? CSR_HALF : 0))) begin
+                    $display("  player stream: csr 0x%0h before committing half %0d", data, k);
+                    errors = errors + 1;
+                end
+                play_write_half(k, k & 1);
+                play_csr.do_write(0, CSR_STREAM | CSR_ENABLED | CSR_COMMIT);
+            end
+            // the last two halves play out, and running out of halves
+            // is how a stream finishes. the underrun fires irq as well,
+            // but usually while the last half's is still pending
+            play_irq_wait(irqs_before + streamHalves - 2);
+            play_csr_wait(CSR_STREAM | CSR_ENABLED, CSR_DONE, CSR_DONE, took);
+            stream_check = 0;
+            play_csr.do_read(0, data);
+            if (!(data & CSR_UNDERRUN)) begin
+                $display("  player stream: done without an underrun, csr 0x%0h", data);
+                errors = errors + 1;
+            end
+            if (play_irqs - irqs_before < streamHalves || play_irqs - irqs_before > streamHalves + 1) begin
+                $display("  player stream: expected %0d irqs, got %0d", streamHalves, play_irqs - irqs_before);
+                errors = errors + 1;
+            end
+            $display("  player stream: %0d halves in %0d cycles, %0d irqs",
+                     streamHalves, cycle - start, play_irqs - irqs_before);
+            if (streamed != streamLength || stream_gaps) begin
+                $display("  player stream: played %0d of %0d samples in order, with %0d gaps",
+                         streamed, streamLength, stream_gaps);
+                errors = errors + 1;
+            end
+
+            // stall: fill the ring but never refill it. the player should
+            // underrun once both halves are played, and stay stopped
+            // (even if a half turns up late) until it's reset
+            play_csr_wait(0, CSR_DONE | CSR_UNDERRUN, 0, took);
+            play_csr.do_write(0, CSR_STREAM);
+            play_csr.do_write(0, CSR_STREAM | CSR_COMMIT);
+            play_csr.do_write(0, CSR_STREAM | CSR_COMMIT);
+            play_csr_wait(CSR_STREAM | CSR_ENABLED, CSR_DONE | CSR_UNDERRUN, CSR_DONE | CSR_UNDERRUN, took);
+            play_csr.do_write(0, CSR_STREAM | CSR_ENABLED | CSR_COMMIT);
+            repeat (4 * streamSclkHalf / clkHalf) play_csr.sync;
+            play_csr.do_read(0, data);
+            if ((data & (CSR_DONE | CSR_UNDERRUN)) !== (CSR_DONE | CSR_UNDERRUN)) begin
+                $display("  player stream: underrun didn't latch, csr 0x%0h", data);
+                errors = errors + 1;
+            end
+            play_csr_wait(0, CSR_DONE | CSR_UNDERRUN, 0, took);
+            $display("  player stream: stalled into an underrun, reset clears it in %0d cycles", took);
+            play_slow = 0;
+        end
+
+        // sampler: record, then read it all back
+        for (run = 0; run < runs; run = run + 1) begin
+            samp_csr_wait(0, CSR_DONE, 0, took);
+            irqs_before = samp_irqs;
+            start = cycle;
+            samp_csr_wait(CSR_ENABLED, CSR_DONE, CSR_DONE, took);
+            if (samp_irqs != irqs_before + 1) begin
+                $display("  sampler run %0d: expected 1 irq, got %0d", run, samp_irqs - irqs_before);
+                errors = errors + 1;
+            end
+            $display("  sampler run %0d: enable to done %0d cycles (%0d samples), irq at +%0d",
+                     run, took, timeLength, samp_irq_at - start);
+
+            start = cycle;
+            for (t = 0; t < timeLength; t = t + 1) begin
+                for (w = 0; w < words; w = w + 1) begin
+                    samp_bus.do_read((t << wordsLog2) | w, data);
+                    sample[32*w +: 32] = data;
+                end
+                // the counter was running before we enabled, so find
+                // where we started from the first sample
+                if (t == 0)
+                    first = sample[31:0];
+                wanted = pattern(first + t);
+                if (sample[width-1:0] !== wanted) begin
+                    if (errors < 8)
+                        $display("  sampler run %0d: time %0d read 0x%0h, expected 0x%0h",
+                                 run, t, sample[width-1:0], wanted);
+                    errors = errors + 1;
+                end
+            end
+            bus_cycles = cycle - start;
+            $display("  sampler read: %0d words in %0d cycles, %0.3f beats/cycle",
+                     timeLength * words, bus_cycles, (timeLength * words * 1.0) / bus_cycles);
+        end
+        samp_csr.do_write(0, 0);
+
+        if (errors) begin
+            $display("FAIL: %0d errors", errors);
+            $fatal(1);
+        end
+        $display("PASS");
+        $finish;
+    end
+endmodule
@@ -0,0 +1,748 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "libosuqlsp.h"
+
+/*
+ * First off, some generic sampler/player drivers
+ */
+
+/* swaps bit order in a single byte */
+static const uint8_t swaptable[256] = {
+     0, 128,  64, 192,  32, 160,  96, 224,  16, 144,  80, 208,  48,
+    176, 112, 240,   8, 136,  72, 200,  40, 168, 104, 232,  24, 152,
+     88, 216,  56, 184, 120, 248,   4, 132,  68, 196,  36, 164, 100,
+    228,  20, 148,  84, 212,  52, 180, 116, 244,  12, 140,  76, 204,
+     44, 172, 108, 236,  28, 156,  92, 220,  60, 188, 124, 252,   2,
+    130,  66, 194,  34, 162,  98, 226,  18, 146,  82, 210,  50, 178,
+    114, 242,  10, 138,  74, 202,  42, 170, 106, 234,  26, 154,  90,
+    218,  58, 186, 122, 250,   6, 134,  70, 198,  38, 166, 102, 230,
+     22, 150,  86, 214,  54, 182, 118, 246,  14, 142,  78, 206,  46,
+    174, 110, 238,  30, 158,  94, 222,  62, 190, 126, 254,   1, 129,
+     65, 193,  33, 161,  97, 225,  17, 145,  81, 209,  49, 177, 113,
+    241,   9, 137,  73, 201,  41, 169, 105, 233,  25, 153,  89, 217,
+     57, 185, 121, 249,   5, 133,  69, 197,  37, 165, 101, 229,  21,
+    149,  85, 213,  53, 181, 117, 245,  13, 141,  77, 205,  45, 173,
+    109, 237,  29, 157,  93, 221,  61, 189, 125, 253,   3, 131,  67,
+    195,  35, 163,  99, 227,  19, 147,  83, 211,  51, 179, 115, 243,
+     11, 139,  75, 203,  43, 171, 107, 235,  27, 155,  91, 219,  59,
+    187, 123, 251,   7, 135,  71, 199,  39, 167, 103, 231,  23, 151,
+     87, 215,  55, 183, 119, 247,  15, 143,  79, 207,  47, 175, 111,
+    239,  31, 159,  95, 223,  63, 191, 127, 255
+};
+
+int sp_device_sysfs_read(SPDevice* self, const char* key, char* buffer, size_t buffer_len) {
+    char fname[STRBUFSIZE];
+    int i;
+    FILE* fp;
+    snprintf(fname, STRBUFSIZE, "/sys/block/%s/device/%s", self->name, key);
+    fp = fopen(fname, "r");
+    if (!fp)
+        return 0;
+    i = fread(buffer, 1, buffer_len, fp);
+    buffer[i] = 0;
+    fclose(fp);
+
+    // strip off whitespace at end
+    for (i = i - 1; i >= 0; i--) {
+        if (buffer[i] == '\n')
+            buffer[i] = 0;
+        else
+            break;
+    }
+    return 1;
+}
+
+int sp_device_sysfs_read_int(SPDevice* self, const char* key) {
+    char buffer[STRBUFSIZE];
+    if (!sp_device_sysfs_read(self, key, buffer, STRBUFSIZE)) {
+        return -1;
+    }
+    return atoi(buffer);
+}
+
+int sp_device_get_enabled(SPDevice* self) {
+    return ioctl(self->fd, OSUQL_SP_GET_ENABLED);
+}
+
+void sp_device_set_enabled(SPDevice* self, int enabled) {
+    ioctl(self->fd, OSUQL_SP_SET_ENABLED, enabled);
+}
+
+int sp_device_get_done(SPDevice* self) {
+    return ioctl(self->fd, OSUQL_SP_GET_DONE);
+}
+
+/* sleeps until we hold the device's lease, or with nonblock, fails
+ * with EBUSY if someone else holds it. returns 1 if another process
+ * held it since our last lease (and forgets what we wrote there), 0 if
+ * not, or -1 on error. drivers without leases count as never having
+ * changed hands.
+ */
+int sp_device_acquire(SPDevice* self, int nonblock) {
+    int ret;
+    do {
+        ret = ioctl(self->fd, OSUQL_SP_ACQUIRE, nonblock ? 1 : 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0)
+        return errno == ENOTTY ? 0 : -1;
+    if (ret > 0)
+        self->shadow_valid = 0;
+    return ret > 0;
+}
+
+void sp_device_release(SPDevice* self) {
+    ioctl(self->fd, OSUQL_SP_RELEASE);
+}
+
+int sp_device_eventfd(SPDevice* self) {
+    int fd;
+    if (self->event_fd >= 0)
+        return self->event_fd;
+    if (!(self->caps & OSUQL_SP_CAP_EVENTFD)) {
+        errno = ENOTTY;
+        return -1;
+    }
+
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (ioctl(self->fd, OSUQL_SP_SET_EVENTFD, fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    self->event_fd = fd;
+    return fd;
+}
+
+uint64_t sp_device_event_clear(SPDevice* self) {
+    uint64_t count = 0;
+    if (self->event_fd >= 0 && read(self->event_fd, &count, sizeof(count)) != sizeof(count))
+        count = 0;
+    return count;
+}
+
+/* polls until the device is done. after spins polls, sleep between
+ * each one. 0 spins forever.
+ */
+void sp_device_wait_done(SPDevice* self, unsigned int spins) {
+    struct timespec nap = {0, SP_POLL_SLEEP_NS};
+    unsigned int i = 0;
+    while (!sp_device_get_done(self)) {
+        if (spins && i >= spins)
+            nanosleep(&nap, NULL);
+        else
+            i++;
+    }
+}
+
+void sp_swap_bit_order(uint8_t* data, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++)
+        data[i] = swaptable[data[i]];
+}
+
+void sp_device_swap_data(SPDevice* self) {
+    sp_swap_bit_order(self->data, self->length);
+}
+
+/* reads the device into data, leaving it in device bit order */
+const uint8_t* sp_device_read_raw(SPDevice* self) {
+    uint8_t* data = self->data;
+    unsigned int length = self->length;
+    lseek(self->fd, 0, SEEK_SET);
+    while (length) {
+        ssize_t amount = read(self->fd, data, length);
+        if (amount <= 0)
+            return NULL;
+        sp_counter_add(&self->io_calls, 1);
+        sp_counter_add(&self->io_bytes, amount);
+        data += amount;
+        if (amount > length)
+            length = 0;
+        else
+            length -= amount;
+    }
+    return self->data;
+}
+
+/* reads part of the device into dest, in device bit order. like the
+ * device's own buffer, dest must be aligned to SP_IO_ALIGN, and so
+ * must start. returns 0 on error.
+ */
+int sp_device_read_range(SPDevice* self, uint8_t* dest, unsigned int start, unsigned int length) {
+    off_t offset = start;
+    while (length) {
+        ssize_t amount = pread(self->fd, dest, length, offset);
+        if (amount <= 0)
+            return 0;
+        sp_counter_add(&self->io_calls, 1);
+        sp_counter_add(&self->io_bytes, amount);
+        dest += amount;
+        offset += amount;
+        if (amount > length)
+            length = 0;
+        else
+            length -= amount;
+    }
+    return 1;
+}
+
+const uint8_t* sp_device_read(SPDevice* self) {
+    if (!sp_device_read_raw(self))
+        return NULL;
+    sp_device_swap_data(self);
+    return self->data;
+}
+
+static int sp_device_write_range(SPDevice* self, unsigned int start, unsigned int length) {
+    uint8_t* data = self->data + start;
+    off_t offset = start;
+    while (length) {
+        ssize_t amount = pwrite(self->fd, data, length, offset);
+        if (amount <= 0)
+            return 0;
+        sp_counter_add(&self->io_calls, 1);
+        sp_counter_add(&self->io_bytes, amount);
+        data += amount;
+        offset += amount;
+        if (amount > length)
+            length = 0;
+        else
+            length -= amount;
+    }
+    return 1;
+}
+
+/* writes data, already in device bit order, to the device. only rows
+ * that changed since the last write are sent, with neighbouring changed
+ * rows sent together.
+ */
+int sp_device_write_raw(SPDevice* self) {
+    unsigned int align = self->sample_length > SP_IO_ALIGN ? self->sample_length : SP_IO_ALIGN;
+    unsigned int row = 0;
+
+    if (!self->shadow_valid) {
+        if (!sp_device_write_range(self, 0, self->length))
+            return 0;
+        if (self->shadow) {
+            memcpy(self->shadow, self->data, self->length);
+            self->shadow_valid = 1;
+        }
+        return 1;
+    }
+
+    while (row < self->length) {
+        unsigned int start, end;
+
+        /* find the next changed row */
+        while (row < self->length && memcmp(self->data + row, self->shadow + row, self->sample_length) == 0)
+            row += self->sample_length;
+        if (row >= self->length)
+            break;
+        start = end = row;
+
+        /* ...and the end of the changed run, merging runs that would
+         * share an aligned block anyway
+         */
+        while (row < self->length) {
+            if (memcmp(self->data + row, self->shadow + row, self->sample_length) != 0)
+                end = row += self->sample_length;
+            else if (row % align != 0)
+                row += self->sample_length;
+            else
+                break;
+        }
+
+        start -= start % align;
+        end += (align - end % align) % align;
+        if (end > self->length)
+            end = self->length;
+
+        if (!sp_device_write_range(self, start, end - start)) {
+            self->shadow_valid = 0;
+            return 0;
+        }
+        memcpy(self->shadow + start, self->data + start, end - start);
+        row = end;
+    }
+    return 1;
+}
+
+/* writes data to the device, see sp_device_write_raw
+ * data is left in device bit order afterwards.
+ */
+int sp_device_write(SPDevice* self) {
+    sp_device_swap_data(self);
+    return sp_device_write_raw(self);
+}
+
+void sp_device_close(SPDevice* self) {
+    if (self) {
+        free(self->name);
+        if (self->event_fd >= 0) {
+            if (self->fd >= 0)
+                ioctl(self->fd, OSUQL_SP_SET_EVENTFD, -1);
+            close(self->event_fd);
+        }
+        if (self->fd >= 0)
+            close(self->fd);
+        if (self->data_mapped)
+            munmap(self->data, self->data_mapped);
+        else if (self->data)
+            free(self->data);
+        free(self->shadow);
+    }
+}
+
+/* moves data into a locked-down, already faulted-in buffer, backed by
+ * huge pages when the system has some to spare
+ */
+int sp_device_prefault(SPDevice* self) {
+    size_t size = self->length;
+    uint8_t* data = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    size = (self->length + SP_HUGEPAGE_SIZE - 1) & ~((size_t)SP_HUGEPAGE_SIZE - 1);
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+#endif
+    if (data == MAP_FAILED) {
+        size = self->length;
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    }
+    if (data == MAP_FAILED)
+        return 0;
+
+    /* MAP_POPULATE is only a hint, so touch every page ourselves */
+    memset(data, 0, size);
+    mlock(data, size);
+    memcpy(data, self->data, self->length);
+
+    if (self->data_mapped)
+        munmap(self->data, self->data_mapped);
+    else
+        free(self->data);
+    self->data = data;
+    self->data_mapped = size;
+    return 1;
+}
+
+/* the sysfs way, for drivers without GET_INFO: one file per field */
+static int sp_device_info_sysfs(SPDevice* dev, struct osuql_sp_info* info) {
+    static const char* keys[] = {
+        "sample_width", "sample_bits", "sample_length",
+        "time_bits", "time_length", "bits", "length",
+    };
+    __u32* fields[] = {
+        &info->sample_width, &info->sample_bits, &info->sample_length,
+        &info->time_bits, &info->time_length, &info->bits, &info->length,
+    };
+    char buffer[STRBUFSIZE];
+    unsigned int i;
+
+    memset(info, 0, sizeof(struct osuql_sp_info));
+    if (!sp_device_sysfs_read(dev, "type", buffer, STRBUFSIZE))
+        return 0;
+    if (strcmp(buffer, "sampler") == 0) {
+        info->type = OSUQL_SP_TYPE_SAMPLER;
+    } else if (strcmp(buffer, "player") == 0) {
+        info->type = OSUQL_SP_TYPE_PLAYER;
+    } else {
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        int value = sp_device_sysfs_read_int(dev, keys[i]);
+        if (value < 0)
+            return 0;
+        *fields[i] = value;
+    }
+    return 1;
+}
+
+/* GET_INFO on an open fd, falling back to sysfs */
+static int sp_device_info_fd(SPDevice* dev, int fd, struct osuql_sp_info* info) {
+    memset(info, 0, sizeof(struct osuql_sp_info));
+    if (ioctl(fd, OSUQL_SP_GET_INFO, info) == 0) {
+        if (info->type != OSUQL_SP_TYPE_SAMPLER && info->type != OSUQL_SP_TYPE_PLAYER)
+            return 0;
+        return 1;
+    }
+    if (errno != ENOTTY)
+        return 0;
+    return sp_device_info_sysfs(dev, info);
+}
+
+int sp_device_info(const char* name, struct osuql_sp_info* info) {
+    char path[STRBUFSIZE];
+    SPDevice dev;
+    int fd, ok;
+
+    memset(&dev, 0, sizeof(SPDevice));
+    dev.name = (char*)name;
+    snprintf(path, STRBUFSIZE, "/dev/%s", name);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    ok = sp_device_info_fd(&dev, fd, info);
+    close(fd);
+    return ok;
+}
+
+SPDevice* sp_device_open(const char* name) {
+    char buffer[STRBUFSIZE];
+    struct osuql_sp_info info;
+    
+    SPDevice* self = calloc(1, sizeof(SPDevice));
+    self->fd = -1;
+    self->event_fd = -1;
+
+    self->name = strdup(name);
+
+    /* samplers are only read and players only written, but opening
+     * both ways lets us ask what we opened before picking a buffer
+     */
+    snprintf(buffer, STRBUFSIZE, "/dev/%s", name);
+    self->fd = open(buffer, O_RDWR | O_DIRECT | O_SYNC);
+    if (self->fd < 0) {
+        sp_device_close(self);
+        return NULL;
+    }
+
+    if (!sp_device_info_fd(self, self->fd, &info)) {
+        sp_device_close(self);
+        return NULL;
+    }
+
+    self->type = info.type == OSUQL_SP_TYPE_SAMPLER ? SP_SAMPLER : SP_PLAYER;
+    self->caps = info.caps;
+    self->sample_width = info.sample_width;
+    self->sample_bits = info.sample_bits;
+    self->sample_length = info.sample_length;
+    self->time_bits = info.time_bits;
+    self->time_length = info.time_length;
+    self->bits = info.bits;
+    self->length = info.length;
+
+    posix_memalign((void**)&(self->data), 512, self->length);
+
+    /* without a shadow, every write is a full write */
+    if (self->type == SP_PLAYER)
+        self->shadow = malloc(self->length);
+
+    return self;
+}
+
+SPDevice* sp_sampler_open(const char* name) {
+    SPDevice* dev = sp_device_open(name);
+    if (dev && dev->type != SP_SAMPLER) {
+        sp_device_close(dev);
+        return NULL;
+    }
+    return dev;
+}
+
+SPDevice* sp_player_open(const char* name) {
+    SPDevice* dev = sp_device_open(name);
+    if (dev && dev->type != SP_PLAYER) {
+        sp_device_close(dev);
+        return NULL;
+    }
+    return dev;
+}
+
+/* writes the player (unless stimulus is resident, see
+ * sp_pair_run_stimulus) and enables both devices. returns 0 if the
+ * player couldn't be written, leaving both devices disabled and the
+ * inputs as they were
+ */
+int sp_pair_start(SPPair* self, uint64_t stimulus) {
+    uint64_t start, now;
+
+    sp_device_set_enabled(self->samp, 0);
+    sp_device_set_enabled(self->play, 0);
+
+    start = sp_now_ns();
+    self->write_ns = 0;
+    self->swap_ns = 0;
+    if (!stimulus || stimulus != self->resident) {
+        self->resident = 0;
+        sp_device_swap_data(self->play);
+        now = sp_now_ns();
+        self->swap_ns = now - start;
+        start = now;
+
+        if (!sp_device_write_raw(self->play)) {
+            /* back to host order, so a retry doesn't swap them twice */
+            sp_device_swap_data(self->play);
+            return 0;
+        }
+        self->resident = stimulus;
+        now = sp_now_ns();
+        self->write_ns = now - start;
+        start = now;
+    } else {
+        sp_counter_add(&self->writes_skipped, 1);
+    }
+
+    /* interrupts left over from before this run would wake us early */
+    sp_device_event_clear(self->samp);
+    sp_device_event_clear(self->play);
+
+    self->started_ns = start;
+    sp_device_set_enabled(self->samp, 1);
+    sp_device_set_enabled(self->play, 1);
+    return 1;
+}
+
+int sp_pair_done(SPPair* self) {
+    return sp_device_get_done(self->samp) > 0 && sp_device_get_done(self->play) > 0;
+}
+
+void sp_pair_stop(SPPair* self) {
+    sp_device_set_enabled(self->samp, 0);
+    sp_device_set_enabled(self->play, 0);
+    self->wait_ns = sp_now_ns() - self->started_ns;
+}
+
+const uint8_t* sp_pair_finish(SPPair* self) {
+    const uint8_t* outputs;
+    uint64_t start, now;
+
+    sp_pair_stop(self);
+    start = sp_now_ns();
+
+    outputs = sp_device_read_raw(self->samp);
+    now = sp_now_ns();
+    self->read_ns = now - start;
+    if (!outputs)
+        return NULL;
+
+    sp_device_swap_data(self->samp);
+    self->swap_ns += sp_now_ns() - now;
+    return outputs;
+}
+
+/* runs the pair. if stimulus is nonzero and is already resident in
+ * the player, the player is not rewritten. this assumes nothing else
+ * writes to the player behind our back.
+ */
+const uint8_t* sp_pair_run_stimulus(SPPair* self, uint64_t stimulus) {
+    if (!sp_pair_start(self, stimulus))
+        return NULL;
+    sp_device_wait_done(self->samp, self->spins);
+    sp_device_wait_done(self->play, self->spins);
+    return sp_pair_finish(self);
+}
+
+const uint8_t* sp_pair_run(SPPair* self) {
+    return sp_pair_run_stimulus(self, 0);
+}
+
+/* takes the player's lease, then the sampler's, so we can share the
+ * pair with other processes. if anyone else had the player since we
+ * last did, the resident stimulus is forgotten.
+ */
+int sp_pair_acquire(SPPair* self) {
+    int play = sp_device_acquire(self->play, 0);
+    if (play < 0)
+        return 0;
+    if (sp_device_acquire(self->samp, 0) < 0) {
+        sp_device_release(self->play);
+        return 0;
+    }
+    if (play)
+        self->resident = 0;
+    return 1;
+}
+
+uint8_t* sp_pair_exchange_inputs(SPPair* self, uint8_t* inputs) {
+    uint8_t* old = self->play->data;
+    if (self->play->data_mapped || (uintptr_t)inputs % SP_IO_ALIGN)
+        return NULL;
+    self->play->data = inputs;
+    self->inputs = inputs;
+    return old;
+}
+
+void sp_pair_release(SPPair* self) {
+    sp_device_release(self->samp);
+    sp_device_release(self->play);
+}
+
+void sp_pair_close(SPPair* self) {
+    if (self) {
+        if (self->samp)
+            sp_device_close(self->samp);
+        if (self->play)
+            sp_device_close(self->play);
+    }
+}
+
+int sp_pair_prefault(SPPair* self) {
+    /* each device's buffer moves as it's remapped, so follow it right
+     * away, even if the other one then fails
+     */
+    if (!sp_device_prefault(self->samp))
+        return 0;
+    self->outputs = self->samp->data;
+    if (!sp_device_prefault(self->play))
+        return 0;
+    self->inputs = self->play->data;
+    return 1;
+}
+
+SPPair* sp_pair_open(const char* sampname, const char* playname) {
+    SPPair* self = calloc(1, sizeof(SPPair));
+    self->samp = sp_sampler_open(sampname);
+    self->play = sp_player_open(playname);
+
+    if (!self->samp || !self->play) {
+        sp_pair_close(self);
+        return NULL;
+    }
+
+    self->inputs = self->play->data;
+    self->inputs_length = self->play->length;
+    self->outputs = self->samp->data;
+    self->outputs_length = self->samp->length;
+
+    return self;
+}
+
+/*
+ * finding every device and sampler/player pair on the system
+ */
+
+static int sp_compare_devices(const void* a, const void* b) {
+    const SPDeviceSpec* da = a;
+    const SPDeviceSpec* db = b;
+    if (da->info.type != db->info.type)
+        return (int)da->info.type - (int)db->info.type;
+    return (int)da->info.number - (int)db->info.number;
+}
+
+/* finds every sampler and player in /sys/block, samplers first, each
+ * in order of number. devices that can't be opened are skipped.
+ */
+int sp_devices_discover(SPDeviceSpec** specs) {
+    int specs_length = 0;
+    struct dirent* ent;
+    DIR* dir;
+
+    *specs = NULL;
+    dir = opendir("/sys/block");
+    if (!dir)
+        return 0;
+
+    while ((ent = readdir(dir))) {
+        SPDeviceSpec spec;
+        int number;
+        char extra;
+        if (sscanf(ent->d_name, "sampler%d%c", &number, &extra) != 1 &&
+            sscanf(ent->d_name, "player%d%c", &number, &extra) != 1)
+            continue;
+
+        snprintf(spec.name, STRBUFSIZE, "%s", ent->d_name);
+        if (!sp_device_info(spec.name, &spec.info)) {
+            fprintf(stderr, "could not get info for %s, skipping\n", spec.name);
+            continue;
+        }
+        /* drivers without GET_INFO don't tell us the number */
+        spec.info.number = number;
+
+        *specs = realloc(*specs, (specs_length + 1) * sizeof(SPDeviceSpec));
+        (*specs)[specs_length++] = spec;
+    }
+    closedir(dir);
+
+    qsort(*specs, specs_length, sizeof(SPDeviceSpec), sp_compare_devices);
+    return specs_length;
+}
+
+/* pairs samplerN with playerN for every N found in /sys/block */
+int sp_pairs_discover(SPPairSpec** specs) {
+    SPDeviceSpec* devices;
+    int devices_length;
+    int specs_length = 0;
+    int i, j;
+
+    *specs = NULL;
+    devices_length = sp_devices_discover(&devices);
+    for (i = 0; i < devices_length; i++) {
+        SPPairSpec* spec;
+        unsigned int number = devices[i].info.number;
+        if (devices[i].info.type != OSUQL_SP_TYPE_SAMPLER)
+            continue;
+
+        /* players sort after every sampler */
+        for (j = i + 1; j < devices_length; j++) {
+            if (devices[j].info.type == OSUQL_SP_TYPE_PLAYER && devices[j].info.number == number)
+                break;
+        }
+        if (j >= devices_length) {
+            fprintf(stderr, "%s has no matching player, skipping\n", devices[i].name);
+            continue;
+        }
+
+        *specs = realloc(*specs, (specs_length + 1) * sizeof(SPPairSpec));
+        spec = &(*specs)[specs_length++];
+        snprintf(spec->sampler, STRBUFSIZE, "%s", devices[i].name);
+        snprintf(spec->player, STRBUFSIZE, "%s", devices[j].name);
+        snprintf(spec->name, STRBUFSIZE, "%u", number);
+    }
+
+    free(devices);
+    return specs_length;
+}
+
+/* reads pairs from a file, one "SAMPLER PLAYER [NAME]" per line
+ * blank lines and lines starting with # are ignored
+ * returns -1 on error
+ */
+int sp_pairs_load(const char* path, SPPairSpec** specs) {
+    char line[STRBUFSIZE];
+    int specs_length = 0;
+    int lineno = 0;
+    FILE* fp;
+
+    *specs = NULL;
+    fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+
+    while (fgets(line, STRBUFSIZE, fp)) {
+        SPPairSpec spec;
+        int fields;
+        lineno++;
+
+        fields = sscanf(line, " %511s %511s %511s", spec.sampler, spec.player, spec.name);
+        if (fields <= 0 || spec.sampler[0] == '#')
+            continue;
+        if (fields < 2) {
+            fprintf(stderr, "%s:%i: expected SAMPLER PLAYER [NAME]\n", path, lineno);
+            fclose(fp);
+            free(*specs);
+            *specs = NULL;
+            return -1;
+        }
+        if (fields < 3)
+            snprintf(spec.name, STRBUFSIZE, "%i", specs_length);
+
+        *specs = realloc(*specs, (specs_length + 1) * sizeof(SPPairSpec));
+        (*specs)[specs_length++] = spec;
+    }
+
+    fclose(fp);
+    return specs_length;
+}
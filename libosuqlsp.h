@@ -0,0 +1,204 @@
+#ifndef __LIBOSUQLSP_H_INCLUDED__
+#define __LIBOSUQLSP_H_INCLUDED__
+
+/*
+ * libosuqlsp: talking to the sampler/player driver from C
+ *
+ * this covers opening devices, reading and writing them, running a
+ * sampler/player pair, and finding every device on the system. see
+ * sp-server.c for an example.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "linux/ioctls.h"
+
+#define STRBUFSIZE 512
+
+/* how long to sleep between polls once a bounded wait gives up spinning */
+#define SP_POLL_SLEEP_NS 20000
+
+/* smallest unit a device write can be, with O_DIRECT */
+#define SP_IO_ALIGN 512
+
+/* huge page size to round prefaulted buffers up to */
+#define SP_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+static inline uint64_t sp_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* counters that one thread adds to while others read them, without
+ * locks. readers may see them a little out of step with each other.
+ */
+static inline void sp_counter_add(uint64_t* counter, uint64_t amount) {
+    __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t sp_counter_get(const uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/*
+ * single devices
+ */
+
+typedef struct {
+    char* name;
+    enum {
+        SP_SAMPLER,
+        SP_PLAYER,
+    } type;
+    int fd;
+
+    /* OSUQL_SP_CAP_*, or 0 for drivers without GET_INFO */
+    uint32_t caps;
+
+    int sample_width;
+    int sample_bits;
+    int sample_length;
+    int time_bits;
+    int time_length;
+    int bits;
+    int length;
+
+    uint8_t* data;
+    /* if nonzero, data was mmap'd with this size by sp_device_prefault */
+    size_t data_mapped;
+
+    /* players only: what we last wrote to the device, if shadow_valid */
+    uint8_t* shadow;
+    int shadow_valid;
+
+    /* totals since opening, see sp_counter_add */
+    uint64_t io_bytes;
+    uint64_t io_calls;
+
+    /* eventfd bound with sp_device_eventfd, or -1 */
+    int event_fd;
+} SPDevice;
+
+/* fills info for the named device (like "sampler0"). uses GET_INFO
+ * when the driver has it, and sysfs otherwise. returns 0 on error.
+ */
+int sp_device_info(const char* name, struct osuql_sp_info* info);
+
+SPDevice* sp_device_open(const char* name);
+SPDevice* sp_sampler_open(const char* name);
+SPDevice* sp_player_open(const char* name);
+void sp_device_close(SPDevice* self);
+int sp_device_prefault(SPDevice* self);
+
+int sp_device_sysfs_read(SPDevice* self, const char* key, char* buffer, size_t buffer_len);
+int sp_device_sysfs_read_int(SPDevice* self, const char* key);
+
+int sp_device_get_enabled(SPDevice* self);
+void sp_device_set_enabled(SPDevice* self, int enabled);
+int sp_device_get_done(SPDevice* self);
+void sp_device_wait_done(SPDevice* self, unsigned int spins);
+
+int sp_device_acquire(SPDevice* self, int nonblock);
+void sp_device_release(SPDevice* self);
+
+/* returns an eventfd that becomes readable when the device interrupts,
+ * for use with poll or select, or -1 if the driver can't do that
+ */
+int sp_device_eventfd(SPDevice* self);
+/* clears the eventfd after a wakeup, returning how many interrupts
+ * it counted
+ */
+uint64_t sp_device_event_clear(SPDevice* self);
+
+/* converts data between device and wire bit order, in place */
+void sp_swap_bit_order(uint8_t* data, size_t length);
+void sp_device_swap_data(SPDevice* self);
+
+const uint8_t* sp_device_read_raw(SPDevice* self);
+int sp_device_read_range(SPDevice* self, uint8_t* dest, unsigned int start, unsigned int length);
+const uint8_t* sp_device_read(SPDevice* self);
+int sp_device_write_raw(SPDevice* self);
+int sp_device_write(SPDevice* self);
+
+/*
+ * sampler/player pairs
+ */
+
+typedef struct {
+    SPDevice* samp;
+    SPDevice* play;
+
+    uint8_t* inputs;
+    unsigned int inputs_length;
+    const uint8_t* outputs;
+    unsigned int outputs_length;
+
+    /* how long to busy-poll for completion, see sp_device_wait_done */
+    unsigned int spins;
+
+    /* stimulus id last written to the player, or 0 if unknown */
+    uint64_t resident;
+
+    /* when the current run was enabled, see sp_pair_start */
+    uint64_t started_ns;
+
+    /* how long each stage of the last run took, in ns */
+    uint64_t write_ns;
+    uint64_t wait_ns;
+    uint64_t read_ns;
+    uint64_t swap_ns;
+
+    /* runs that found their stimulus resident, see sp_counter_add */
+    uint64_t writes_skipped;
+} SPPair;
+
+SPPair* sp_pair_open(const char* sampname, const char* playname);
+void sp_pair_close(SPPair* self);
+int sp_pair_prefault(SPPair* self);
+int sp_pair_acquire(SPPair* self);
+void sp_pair_release(SPPair* self);
+const uint8_t* sp_pair_run_stimulus(SPPair* self, uint64_t stimulus);
+const uint8_t* sp_pair_run(SPPair* self);
+
+/* sp_pair_run_stimulus in pieces, for callers that wait on the
+ * devices' eventfds rather than blocking: start the run, check that
+ * both devices are done, and then finish it to read the outputs
+ */
+int sp_pair_start(SPPair* self, uint64_t stimulus);
+int sp_pair_done(SPPair* self);
+const uint8_t* sp_pair_finish(SPPair* self);
+/* the first half of sp_pair_finish: disables both devices, leaving the
+ * capture in the sampler for the caller to read how it likes
+ */
+void sp_pair_stop(SPPair* self);
+
+/* gives the player inputs (of its length, aligned to SP_IO_ALIGN) as
+ * its new buffer, rather than copying it in, and returns the old one,
+ * which the caller now owns. returns NULL and leaves the pair alone if
+ * the buffer can't be swapped out, like one from sp_pair_prefault.
+ */
+uint8_t* sp_pair_exchange_inputs(SPPair* self, uint8_t* inputs);
+
+/*
+ * finding every device and sampler/player pair on the system
+ */
+
+typedef struct {
+    char name[STRBUFSIZE];
+    struct osuql_sp_info info;
+} SPDeviceSpec;
+
+typedef struct {
+    char sampler[STRBUFSIZE];
+    char player[STRBUFSIZE];
+    char name[STRBUFSIZE];
+} SPPairSpec;
+
+int sp_devices_discover(SPDeviceSpec** specs);
+int sp_pairs_discover(SPPairSpec** specs);
+int sp_pairs_load(const char* path, SPPairSpec** specs);
+
+#endif /* __LIBOSUQLSP_H_INCLUDED__ */
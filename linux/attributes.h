@@ -4,13 +4,24 @@
 // #define ATTRIBUTE(name)
 // #include "attributes.h"
 //
-// to handle struct attributes / csr attributes differently, define
-// STRUCT_ATTRIBUTE(name, format) or CSR_ATTRIBUTE(name, write, mask)
+// to handle struct attributes / csr attributes / statistics differently,
+// define STRUCT_ATTRIBUTE(name, format), CSR_ATTRIBUTE(name, write, mask)
+// or STAT_ATTRIBUTE(name) (a u64 field of the same name, read under
+// sp->lock), or FUNC_ATTRIBUTE(name, func) (read-only, shown by
+// ssize_t func(struct sp_device*, char* buf))
 
 #ifndef STRUCT_ATTRIBUTE
 #define STRUCT_ATTRIBUTE(name, ...) ATTRIBUTE(name)
 #endif
 
+#ifndef STAT_ATTRIBUTE
+#define STAT_ATTRIBUTE(name) ATTRIBUTE(name)
+#endif
+
+#ifndef FUNC_ATTRIBUTE
+#define FUNC_ATTRIBUTE(name, ...) ATTRIBUTE(name)
+#endif
+
 #ifndef CSR_ATTRIBUTE
 #define CSR_ATTRIBUTE(name, write, mask) ATTRIBUTE(name)
 #endif
@@ -25,10 +36,25 @@ STRUCT_ATTRIBUTE(length, "%i\n", sp->length)
 STRUCT_ATTRIBUTE(type, "%s\n", BY_TYPE(sp->type, "sampler", "player"))
 STRUCT_ATTRIBUTE(interrupts, "%i\n", sp->interrupts)
 
+STAT_ATTRIBUTE(bytes_read)
+STAT_ATTRIBUTE(bytes_written)
+STAT_ATTRIBUTE(requests)
+STAT_ATTRIBUTE(io_ns)
+STAT_ATTRIBUTE(runs)
+STAT_ATTRIBUTE(run_ns)
+STAT_ATTRIBUTE(run_ns_last)
+STAT_ATTRIBUTE(run_ns_max)
+STAT_ATTRIBUTE(stream_halves)
+STAT_ATTRIBUTE(stream_underruns)
+
+FUNC_ATTRIBUTE(leases, osuql_sp_leases_show)
+
 // disabled, I figure the ioctls are better for this
 //CSR_ATTRIBUTE(enabled, 1, CSR_ENABLED)
 //CSR_ATTRIBUTE(done, 0, CSR_DONE)
 
 #undef STRUCT_ATTRIBUTE
 #undef CSR_ATTRIBUTE
+#undef STAT_ATTRIBUTE
+#undef FUNC_ATTRIBUTE
 #undef ATTRIBUTE
@@ -1,9 +1,15 @@
 #include <linux/blkdev.h>
+#include <linux/eventfd.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/uaccess.h>
 
 #include "sampler-player.h"
 #include "ioctls.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 #define KERNEL_SECTOR_SIZE 512
 
 int osuql_sp_major_num = 0;
@@ -18,7 +24,7 @@ static void memcpy_fromio_word(void* to, const volatile void __iomem* from, size
     }
 }
 
-static void memcpy_toio_word(volatile void __iomem* to, const void* from, size_t count) {
+void osuql_sp_memcpy_toio_word(volatile void __iomem* to, const void* from, size_t count) {
     const u32* f = from;
     while (count) {
         count--;
@@ -33,7 +39,10 @@ static void request(struct request_queue* q) {
     struct sp_device* sp;
     bool chunks_left = true;
     size_t start, size;
-    
+    u64 then, ns;
+
+    // we're called with q->queue_lock (sp->lock) held, so the
+    // statistics are ours to update
     while ((req = blk_fetch_request(q)) != NULL) {
         // skip non-fs requests
         if (req->cmd_type != REQ_TYPE_FS) {
@@ -41,6 +50,7 @@ static void request(struct request_queue* q) {
             continue;
         }
 
+        disk_to_sp(req->rq_disk)->requests++;
         while (chunks_left) {
             sp = disk_to_sp(req->rq_disk);
             start = blk_rq_pos(req) * KERNEL_SECTOR_SIZE;
@@ -54,23 +64,79 @@ static void request(struct request_queue* q) {
 
             // request buffer is in bio_data(req->bio)
             // device buffer is in sp->buffer
+            then = ktime_get_ns();
             if (rq_data_dir(req)) {
                 // write
-                memcpy_toio_word(sp->buffer + start, bio_data(req->bio), size / sizeof(u32));
+                osuql_sp_memcpy_toio_word(sp->buffer + start, bio_data(req->bio), size / sizeof(u32));
+                sp->bytes_written += size;
             } else {
                 // read
                 memcpy_fromio_word(bio_data(req->bio), sp->buffer + start, size / sizeof(u32));
+                sp->bytes_read += size;
             }
-            
+            ns = ktime_get_ns() - then;
+            sp->io_ns += ns;
+            trace_osuql_sp_request(sp, rq_data_dir(req), start, size, ns);
+
             chunks_left = __blk_end_request_cur(req, 0);
         }
     }
 }
 
-static int ioctl(struct block_device* blk, fmode_t mode, unsigned int cmd, unsigned long arg) {
+static int get_info(struct sp_device* sp, struct osuql_sp_info __user* arg) {
+    struct osuql_sp_info info;
+
+    memset(&info, 0, sizeof(struct osuql_sp_info));
+    info.version = OSUQL_SP_INFO_VERSION;
+    info.size = sizeof(struct osuql_sp_info);
+    info.type = BY_TYPE(sp->type, OSUQL_SP_TYPE_SAMPLER, OSUQL_SP_TYPE_PLAYER);
+    info.number = sp->number;
+    info.caps = OSUQL_SP_CAP_STATS | OSUQL_SP_CAP_LEASE;
+    if (sp->irq)
+        info.caps |= OSUQL_SP_CAP_IRQ | OSUQL_SP_CAP_EVENTFD;
+    if (sp->stream_registered)
+        info.caps |= OSUQL_SP_CAP_STREAM;
+
+    info.sample_width = sp->sample_width;
+    info.sample_bits = sp->sample_bits;
+    info.sample_length = sp->sample_length;
+    info.time_bits = sp->time_bits;
+    info.time_length = sp->time_length;
+    info.bits = sp->bits;
+    info.length = sp->length;
+
+    if (copy_to_user(arg, &info, sizeof(struct osuql_sp_info)))
+        return -EFAULT;
+    return 0;
+}
+
+// binds an eventfd for handle_interrupt to signal, or unbinds it if
+// fd is negative
+static int set_eventfd(struct sp_device* sp, int fd) {
+    struct eventfd_ctx* ctx = NULL;
+    struct eventfd_ctx* old;
+    unsigned long flags;
+
+    if (fd >= 0) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+
+    spin_lock_irqsave(&sp->lock, flags);
+    old = sp->eventfd;
+    sp->eventfd = ctx;
+    sp->eventfd_owner = ctx ? task_tgid_nr(current) : 0;
+    spin_unlock_irqrestore(&sp->lock, flags);
+
+    if (old)
+        eventfd_ctx_put(old);
+    return 0;
+}
+
+static int do_ioctl(struct sp_device* sp, unsigned int cmd, unsigned long arg) {
     int err = 0;
-    u8 csr;
-    struct sp_device* sp = disk_to_sp(blk->bd_disk);
+    unsigned long flags;
 
     // only handle known commands
     if (_IOC_TYPE(cmd) != OSUQL_SP_IOC_MAGIC)
@@ -91,29 +157,77 @@ static int ioctl(struct block_device* blk, fmode_t mode, unsigned int cmd, unsig
     case OSUQL_SP_GET_ENABLED:
         return (ioread8(sp->csr) & CSR_ENABLED) ? 1 : 0;
     case OSUQL_SP_SET_ENABLED:
-        csr = ioread8(sp->csr);
+        // someone else is mid-run
+        if (!osuql_sp_lease_check(sp))
+            return -EBUSY;
+        // the stream device owns the player until it's closed
+        if (READ_ONCE(sp->stream_half))
+            return -EBUSY;
+        // runs through here play the buffer once, even after a stream
         if (arg) {
-            iowrite8(csr | CSR_ENABLED, sp->csr);
+            // start timing the run, see handle_interrupt
+            spin_lock_irqsave(&sp->lock, flags);
+            sp->enabled_at = ktime_get_ns();
+            spin_unlock_irqrestore(&sp->lock, flags);
+            osuql_sp_csr_update(sp, CSR_STREAM, CSR_ENABLED);
         } else {
-            iowrite8(csr & (~CSR_ENABLED), sp->csr);
+            osuql_sp_csr_update(sp, CSR_STREAM | CSR_ENABLED, 0);
         }
         return 0;
 
     case OSUQL_SP_GET_DONE:
         return (ioread8(sp->csr) & CSR_DONE) ? 1 : 0;
 
+    case OSUQL_SP_ACQUIRE:
+        return osuql_sp_lease_acquire(sp, arg != 0);
+    case OSUQL_SP_RELEASE:
+        return osuql_sp_lease_release(sp);
+
+    case OSUQL_SP_GET_INFO:
+        return get_info(sp, (struct osuql_sp_info __user*)arg);
+
+    case OSUQL_SP_SET_EVENTFD:
+        // without an irq, nothing would ever signal it
+        if (!sp->irq)
+            return -ENOTTY;
+        if (!osuql_sp_lease_check(sp))
+            return -EBUSY;
+        return set_eventfd(sp, (int)arg);
+
     default:
         return -ENOTTY;
     }
 }
 
+static int open(struct block_device* blk, fmode_t mode) {
+    return osuql_sp_lease_open(disk_to_sp(blk->bd_disk));
+}
+
+static void release(struct gendisk* gd, fmode_t mode) {
+    struct sp_device* sp = disk_to_sp(gd);
+
+    // like leases, eventfds outlive a close, but not their owner's last
+    if (osuql_sp_lease_close(sp) && READ_ONCE(sp->eventfd_owner) == task_tgid_nr(current))
+        set_eventfd(sp, -1);
+}
+
+static int ioctl(struct block_device* blk, fmode_t mode, unsigned int cmd, unsigned long arg) {
+    struct sp_device* sp = disk_to_sp(blk->bd_disk);
+    int ret = do_ioctl(sp, cmd, arg);
+    trace_osuql_sp_ioctl(sp, cmd, arg, ret);
+    return ret;
+}
+
 static struct block_device_operations ops = {
     .owner = THIS_MODULE,
+    .open = open,
+    .release = release,
     .ioctl = ioctl,
 };
 
 void osuql_sp_remove_block(struct sp_device* sp) {
     if (sp) {
+        set_eventfd(sp, -1);
         if (sp->gd) {
             del_gendisk(sp->gd);
             put_disk(sp->gd);
@@ -124,8 +238,7 @@ void osuql_sp_remove_block(struct sp_device* sp) {
 }
 
 int osuql_sp_init_block(struct sp_device* sp) {
-    spin_lock_init(&sp->lock);
-
+    // sp->lock is set up by driver.c, as the irq handler uses it too
     sp->queue = blk_init_queue(request, &sp->lock);
     if (!sp->queue)
         return -EINVAL;
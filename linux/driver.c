@@ -3,8 +3,11 @@
 #include <linux/io.h>
 #include <linux/slab.h>
 #include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/eventfd.h>
 
 #include "sampler-player.h"
+#include "trace.h"
 
 static struct of_device_id of_match[] = {
     { .compatible = "osuql,player-1.0",  .data = (void*)TYPE_PLAYER  },
@@ -18,6 +21,20 @@ static u8 player_nums[MAX_DEVICES];
 
 MODULE_DEVICE_TABLE(of, of_match);
 
+// clears and then sets bits in the csr, returning what was written.
+// the irq handler writes the csr too, so every read-modify-write of
+// it has to go through here
+u8 osuql_sp_csr_update(struct sp_device* sp, u8 clear, u8 set) {
+    unsigned long flags;
+    u8 csr;
+
+    spin_lock_irqsave(&sp->lock, flags);
+    csr = (ioread8(sp->csr) & ~clear) | set;
+    iowrite8(csr, sp->csr);
+    spin_unlock_irqrestore(&sp->lock, flags);
+    return csr;
+}
+
 #define STRUCT_ATTRIBUTE(name, ...)                                     \
     static ssize_t name##_show(struct device* dev, struct device_attribute* attr, char* buf) { \
         struct sp_device* sp = dev_to_sp(dev);                          \
@@ -30,27 +47,64 @@ MODULE_DEVICE_TABLE(of, of_match);
     }                                                                   \
     static ssize_t name##_store(struct device* dev, struct device_attribute* attr, const char* buf, size_t count) { \
         struct sp_device* sp = dev_to_sp(dev);                          \
-        u8 input, csr;                                                  \
+        u8 input;                                                       \
         int ret = kstrtou8(buf, 10, &input);                            \
         if (ret < 0)                                                    \
             return ret;                                                 \
-        csr = ioread8(sp->csr);                                         \
         if (input) {                                                    \
-            iowrite8(csr | mask, sp->csr);                              \
+            osuql_sp_csr_update(sp, 0, mask);                           \
         } else  {                                                       \
-            iowrite8(csr & (~mask), sp->csr);                           \
+            osuql_sp_csr_update(sp, mask, 0);                           \
         }                                                               \
         return count;                                                   \
     }                                                                   \
     static DEVICE_ATTR(name, S_IRUGO | (write ? S_IWUSR : 0), name##_show, name##_store);
+#define STAT_ATTRIBUTE(name)                                            \
+    static ssize_t name##_show(struct device* dev, struct device_attribute* attr, char* buf) { \
+        struct sp_device* sp = dev_to_sp(dev);                          \
+        unsigned long flags;                                            \
+        u64 value;                                                      \
+        spin_lock_irqsave(&sp->lock, flags);                            \
+        value = sp->name;                                               \
+        spin_unlock_irqrestore(&sp->lock, flags);                       \
+        return scnprintf(buf, PAGE_SIZE, "%llu\n", (unsigned long long)value); \
+    }                                                                   \
+    static DEVICE_ATTR(name, S_IRUGO, name##_show, NULL);
+#define FUNC_ATTRIBUTE(name, func)                                      \
+    static ssize_t name##_show(struct device* dev, struct device_attribute* attr, char* buf) { \
+        return func(dev_to_sp(dev), buf);                               \
+    }                                                                   \
+    static DEVICE_ATTR(name, S_IRUGO, name##_show, NULL);
 #include "attributes.h"
 
 static irqreturn_t handle_interrupt(int irq, void* cookie) {
     struct sp_device* sp = cookie;
-    u8 csr = ioread8(sp->csr);
-    csr &= ~CSR_IRQ;
-    iowrite8(csr, sp->csr);
+    u64 latency = 0;
+    u8 csr;
+
+    spin_lock(&sp->lock);
+    // see osuql_sp_csr_update
+    csr = ioread8(sp->csr);
+    iowrite8(csr & ~CSR_IRQ, sp->csr);
     sp->interrupts++;
+    // the irq fires when a run finishes
+    if (sp->enabled_at) {
+        latency = ktime_get_ns() - sp->enabled_at;
+        sp->enabled_at = 0;
+        sp->runs++;
+        sp->run_ns += latency;
+        sp->run_ns_last = latency;
+        if (latency > sp->run_ns_max)
+            sp->run_ns_max = latency;
+    }
+    if (sp->eventfd)
+        eventfd_signal(sp->eventfd, 1);
+    spin_unlock(&sp->lock);
+
+    // a streaming player interrupts each time a half is played
+    wake_up_interruptible(&sp->stream_wait);
+
+    trace_osuql_sp_interrupt(sp, csr, latency);
     return IRQ_HANDLED;
 }
 
@@ -59,7 +113,9 @@ static int remove(struct platform_device* dev) {
 
     sp = dev_to_sp(&(dev->dev));
     if (sp) {
+        osuql_sp_remove_stream(sp);
         osuql_sp_remove_block(sp);
+        osuql_sp_remove_lease(sp);
 
         // this is safe to call on files that don't exist, thankfully
 #define ATTRIBUTE(name) device_remove_file(&dev->dev, &dev_attr_##name);
@@ -111,6 +167,9 @@ static int probe(struct platform_device* dev) {
     if (!sp)
         return -EINVAL;
     memset(sp, 0, sizeof(struct sp_device));
+    spin_lock_init(&sp->lock);
+    osuql_sp_init_lease(sp);
+    osuql_sp_init_stream(sp);
     dev_set_drvdata(&dev->dev, sp);
     sp->number = MAX_DEVICES;
     sp->dev = &dev->dev;
@@ -212,6 +271,13 @@ static int probe(struct platform_device* dev) {
         return ret;
     }
 
+    // and, for players with an irq, the stream device
+    ret = osuql_sp_register_stream(sp);
+    if (ret < 0) {
+        remove(dev);
+        return ret;
+    }
+
     printk(KERN_INFO "%s%i: Registered device.\n", BY_TYPE(sp->type, SAMPLER_DEV, PLAYER_DEV), sp->number);
     sp->registered = 1;
 
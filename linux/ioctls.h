@@ -4,6 +4,7 @@
  */
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 /* selected arbitrarily from those not taken in ioctl-number.txt */
 #define OSUQL_SP_IOC_MAGIC 0x9d
@@ -13,4 +14,70 @@
 
 #define OSUQL_SP_GET_DONE    _IO(OSUQL_SP_IOC_MAGIC, 2)
 
-#define OSUQL_SP_IOC_MAX 3
+/*
+ * leases: ACQUIRE sleeps until this process owns the device (or, with a
+ * nonzero argument, fails with EBUSY instead of sleeping). it returns 1
+ * if another process held the device since our last lease, so anything
+ * we remember about its contents is stale, and 0 otherwise. while a
+ * lease is held, SET_ENABLED from other processes fails with EBUSY.
+ * leases end with RELEASE, or when the owner closes the device for the
+ * last time (or exits).
+ * to run a pair, acquire the player before the sampler.
+ */
+#define OSUQL_SP_ACQUIRE     _IO(OSUQL_SP_IOC_MAGIC, 3)
+#define OSUQL_SP_RELEASE     _IO(OSUQL_SP_IOC_MAGIC, 4)
+
+/*
+ * everything sysfs says about a device, in one call. version only goes
+ * up when existing fields change meaning; new fields come out of
+ * reserved, and read as 0 from older drivers.
+ */
+#define OSUQL_SP_INFO_VERSION 1
+
+#define OSUQL_SP_TYPE_SAMPLER 0
+#define OSUQL_SP_TYPE_PLAYER  1
+
+/* the device has an interrupt, so run latency is measured */
+#define OSUQL_SP_CAP_IRQ   0x1
+/* the driver keeps statistics in sysfs */
+#define OSUQL_SP_CAP_STATS 0x2
+/* the driver supports ACQUIRE / RELEASE */
+#define OSUQL_SP_CAP_LEASE 0x4
+/* the driver supports SET_EVENTFD */
+#define OSUQL_SP_CAP_EVENTFD 0x8
+/* the player has a stream device, /dev/playerN-stream */
+#define OSUQL_SP_CAP_STREAM 0x10
+
+struct osuql_sp_info {
+    __u32 version;
+    /* sizeof(struct osuql_sp_info) in the driver */
+    __u32 size;
+    __u32 type;
+    __u32 number;
+    __u32 caps;
+
+    /* the same as the sysfs attributes of the same names */
+    __u32 sample_width;
+    __u32 sample_bits;
+    __u32 sample_length;
+    __u32 time_bits;
+    __u32 time_length;
+    __u32 bits;
+    __u32 length;
+
+    __u32 reserved[4];
+};
+
+#define OSUQL_SP_GET_INFO    _IOR(OSUQL_SP_IOC_MAGIC, 5, struct osuql_sp_info)
+
+/*
+ * binds an eventfd (the argument) that the driver signals every time
+ * the device raises its interrupt, so a poll/select loop can wait for
+ * runs to finish alongside everything else. a negative argument
+ * unbinds it. only one eventfd is bound at a time; it is unbound when
+ * the process that bound it exits. interrupts can be stray, so check
+ * GET_DONE after each wakeup. devices without an irq fail with ENOTTY.
+ */
+#define OSUQL_SP_SET_EVENTFD _IO(OSUQL_SP_IOC_MAGIC, 6)
+
+#define OSUQL_SP_IOC_MAX 7
@@ -0,0 +1,297 @@
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "sampler-player.h"
+
+// leases give one process at a time ownership of a device, so several
+// tools can share a board without a broker in userspace. processes
+// waiting for a lease queue up in order and sleep until their turn.
+// to run a pair, take the player's lease and then the sampler's; as
+// long as everyone uses the same order, nobody deadlocks.
+//
+// a lease ends with RELEASE, or with the owner's last close of the
+// device, which we find by counting opens per process. files shared
+// across a fork are only released once, by whoever closes them last,
+// so an owner that dies still holding the lease is also noticed by
+// anyone waiting for it.
+
+// how often waiters check on an owner that may have died
+#define LEASE_REAP_INTERVAL HZ
+
+// how many times one process has the device open
+struct sp_lease_opener {
+    struct list_head node;
+    pid_t tgid;
+    unsigned int opens;
+};
+
+// one process waiting in the queue. these live on the waiter's stack,
+// and are only touched with lease_mutex held.
+struct sp_lease_waiter {
+    struct list_head node;
+    struct pid* tgid;
+    bool granted;
+    int changed;
+};
+
+// finds (or makes room for) the accounting entry for a process, with
+// lease_mutex held
+static struct sp_lease_account* lease_account(struct sp_device* sp, pid_t tgid) {
+    struct sp_lease_account* acct;
+    struct sp_lease_account* oldest = &sp->accounts[0];
+    int i;
+
+    for (i = 0; i < SP_LEASE_ACCOUNTS; i++) {
+        acct = &sp->accounts[i];
+        if (acct->tgid == tgid)
+            return acct;
+        if (acct->last_used < oldest->last_used)
+            oldest = acct;
+    }
+
+    // forget whoever has been quiet the longest
+    memset(oldest, 0, sizeof(struct sp_lease_account));
+    oldest->tgid = tgid;
+    if (tgid == task_tgid_nr(current))
+        get_task_comm(oldest->comm, current);
+    return oldest;
+}
+
+// makes tgid the owner, returning 1 if someone else held it last
+static int lease_take(struct sp_device* sp, struct pid* tgid) {
+    int changed = sp->lease_last != pid_nr(tgid);
+    sp->lease_owner = get_pid(tgid);
+    sp->lease_last = pid_nr(tgid);
+    sp->lease_at = ktime_get_ns();
+    return changed;
+}
+
+// finds the current process's open count, with lease_mutex held
+static struct sp_lease_opener* lease_opener(struct sp_device* sp) {
+    struct sp_lease_opener* opener;
+    pid_t tgid = task_tgid_nr(current);
+
+    list_for_each_entry(opener, &sp->lease_openers, node) {
+        if (opener->tgid == tgid)
+            return opener;
+    }
+    return NULL;
+}
+
+// releases the current owner's lease, and hands it to the next waiter
+// in line, if any. called with lease_mutex held
+static void lease_drop(struct sp_device* sp) {
+    struct sp_lease_account* acct = lease_account(sp, pid_nr(sp->lease_owner));
+    struct sp_lease_waiter* next;
+    u64 now = ktime_get_ns();
+
+    acct->held_ns += now - sp->lease_at;
+    acct->last_used = now;
+    put_pid(sp->lease_owner);
+    sp->lease_owner = NULL;
+
+    if (list_empty(&sp->lease_queue))
+        return;
+    next = list_first_entry(&sp->lease_queue, struct sp_lease_waiter, node);
+    list_del_init(&next->node);
+    next->changed = lease_take(sp, next->tgid);
+    next->granted = true;
+    wake_up_all(&sp->lease_wait);
+}
+
+// whether the owner has exited without closing the device, with
+// lease_mutex held
+static bool lease_owner_gone(struct sp_device* sp) {
+    struct task_struct* task;
+    bool gone;
+
+    rcu_read_lock();
+    task = pid_task(sp->lease_owner, PIDTYPE_PID);
+    gone = !task || (task->exit_state && thread_group_empty(task));
+    rcu_read_unlock();
+    return gone;
+}
+
+// drops the lease if its owner is gone, with lease_mutex held
+static void lease_reap(struct sp_device* sp) {
+    if (sp->lease_owner && lease_owner_gone(sp))
+        lease_drop(sp);
+}
+
+int osuql_sp_lease_acquire(struct sp_device* sp, bool nonblock) {
+    struct sp_lease_waiter w;
+    struct sp_lease_account* acct;
+    u64 queued_at = ktime_get_ns();
+    int err;
+
+    w.tgid = task_tgid(current);
+    w.granted = false;
+    w.changed = 0;
+
+    mutex_lock(&sp->lease_mutex);
+    lease_reap(sp);
+    if (sp->lease_owner == w.tgid) {
+        mutex_unlock(&sp->lease_mutex);
+        return -EDEADLK;
+    }
+
+    if (!sp->lease_owner) {
+        // nobody queues while the lease is free, so this is fair
+        w.changed = lease_take(sp, w.tgid);
+    } else if (nonblock) {
+        mutex_unlock(&sp->lease_mutex);
+        return -EBUSY;
+    } else {
+        list_add_tail(&w.node, &sp->lease_queue);
+        sp->lease_waiters++;
+        mutex_unlock(&sp->lease_mutex);
+
+        for (;;) {
+            err = wait_event_interruptible_timeout(sp->lease_wait, READ_ONCE(w.granted), LEASE_REAP_INTERVAL);
+            if (err)
+                break;
+            mutex_lock(&sp->lease_mutex);
+            lease_reap(sp);
+            mutex_unlock(&sp->lease_mutex);
+        }
+
+        mutex_lock(&sp->lease_mutex);
+        sp->lease_waiters--;
+        if (!w.granted) {
+            // interrupted before our turn came, so leave the line
+            list_del(&w.node);
+            mutex_unlock(&sp->lease_mutex);
+            return err;
+        }
+    }
+
+    acct = lease_account(sp, pid_nr(w.tgid));
+    acct->leases++;
+    acct->wait_ns += ktime_get_ns() - queued_at;
+    acct->last_used = ktime_get_ns();
+    mutex_unlock(&sp->lease_mutex);
+    return w.changed;
+}
+
+int osuql_sp_lease_release(struct sp_device* sp) {
+    int err = 0;
+    mutex_lock(&sp->lease_mutex);
+    if (sp->lease_owner == task_tgid(current))
+        lease_drop(sp);
+    else
+        err = -EPERM;
+    mutex_unlock(&sp->lease_mutex);
+    return err;
+}
+
+// releases a lease taken on behalf of tgid, from whichever task ends
+// up closing the file it was taken for
+void osuql_sp_lease_put(struct sp_device* sp, struct pid* tgid) {
+    mutex_lock(&sp->lease_mutex);
+    if (sp->lease_owner == tgid)
+        lease_drop(sp);
+    mutex_unlock(&sp->lease_mutex);
+}
+
+// makes the next acquire report a change, even to whoever held the
+// lease last, for when the buffer was rewritten without a run
+void osuql_sp_lease_invalidate(struct sp_device* sp) {
+    mutex_lock(&sp->lease_mutex);
+    sp->lease_last = 0;
+    mutex_unlock(&sp->lease_mutex);
+}
+
+bool osuql_sp_lease_check(struct sp_device* sp) {
+    bool ok;
+    mutex_lock(&sp->lease_mutex);
+    lease_reap(sp);
+    ok = !sp->lease_owner || sp->lease_owner == task_tgid(current);
+    mutex_unlock(&sp->lease_mutex);
+    return ok;
+}
+
+int osuql_sp_lease_open(struct sp_device* sp) {
+    struct sp_lease_opener* opener;
+    int err = 0;
+
+    mutex_lock(&sp->lease_mutex);
+    opener = lease_opener(sp);
+    if (!opener) {
+        opener = kzalloc(sizeof(struct sp_lease_opener), GFP_KERNEL);
+        if (opener) {
+            opener->tgid = task_tgid_nr(current);
+            list_add(&opener->node, &sp->lease_openers);
+        }
+    }
+    if (opener)
+        opener->opens++;
+    else
+        err = -ENOMEM;
+    mutex_unlock(&sp->lease_mutex);
+    return err;
+}
+
+bool osuql_sp_lease_close(struct sp_device* sp) {
+    struct sp_lease_opener* opener;
+    bool last = false;
+
+    // processes routinely close and reopen the device while holding
+    // a lease, so only let go of it on the owner's last close
+    mutex_lock(&sp->lease_mutex);
+    opener = lease_opener(sp);
+    if (opener && !--opener->opens) {
+        list_del(&opener->node);
+        kfree(opener);
+        last = true;
+        if (sp->lease_owner == task_tgid(current))
+            lease_drop(sp);
+    }
+    lease_reap(sp);
+    mutex_unlock(&sp->lease_mutex);
+    return last;
+}
+
+ssize_t osuql_sp_leases_show(struct sp_device* sp, char* buf) {
+    struct sp_lease_account* acct;
+    ssize_t len;
+    int i;
+
+    mutex_lock(&sp->lease_mutex);
+    len = scnprintf(buf, PAGE_SIZE, "owner %i\nwaiting %u\n",
+                    sp->lease_owner ? pid_nr(sp->lease_owner) : 0, sp->lease_waiters);
+    // one line per process: tgid, name, leases, ns held, ns waited
+    for (i = 0; i < SP_LEASE_ACCOUNTS; i++) {
+        acct = &sp->accounts[i];
+        if (!acct->tgid)
+            continue;
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%i %s %llu %llu %llu\n",
+                         acct->tgid, acct->comm, acct->leases, acct->held_ns, acct->wait_ns);
+    }
+    mutex_unlock(&sp->lease_mutex);
+    return len;
+}
+
+void osuql_sp_init_lease(struct sp_device* sp) {
+    mutex_init(&sp->lease_mutex);
+    init_waitqueue_head(&sp->lease_wait);
+    INIT_LIST_HEAD(&sp->lease_queue);
+    INIT_LIST_HEAD(&sp->lease_openers);
+}
+
+void osuql_sp_remove_lease(struct sp_device* sp) {
+    struct sp_lease_opener* opener;
+    struct sp_lease_opener* next;
+
+    if (!sp)
+        return;
+    if (sp->lease_owner) {
+        put_pid(sp->lease_owner);
+        sp->lease_owner = NULL;
+    }
+    list_for_each_entry_safe(opener, next, &sp->lease_openers, node) {
+        list_del(&opener->node);
+        kfree(opener);
+    }
+}
@@ -4,22 +4,50 @@
 #include <linux/module.h>
 #include <linux/platform_device.h>
 #include <linux/genhd.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
 
 #define DRIVER_NAME "sampler-player"
 #define SAMPLER_DEV "sampler"
 #define PLAYER_DEV "player"
 
 struct sp_device;
+struct eventfd_ctx;
 
 extern struct platform_driver osuql_sp_platform_driver;
 extern int osuql_sp_major_num;
 
 extern int osuql_sp_init_block(struct sp_device*);
 extern void osuql_sp_remove_block(struct sp_device*);
+extern void osuql_sp_memcpy_toio_word(volatile void __iomem* to, const void* from, size_t count);
+extern u8 osuql_sp_csr_update(struct sp_device*, u8 clear, u8 set);
+
+extern void osuql_sp_init_lease(struct sp_device*);
+extern void osuql_sp_remove_lease(struct sp_device*);
+extern int osuql_sp_lease_acquire(struct sp_device*, bool nonblock);
+extern int osuql_sp_lease_release(struct sp_device*);
+extern void osuql_sp_lease_put(struct sp_device*, struct pid* tgid);
+extern void osuql_sp_lease_invalidate(struct sp_device*);
+extern bool osuql_sp_lease_check(struct sp_device*);
+extern int osuql_sp_lease_open(struct sp_device*);
+extern bool osuql_sp_lease_close(struct sp_device*);
+extern ssize_t osuql_sp_leases_show(struct sp_device*, char* buf);
+
+extern void osuql_sp_init_stream(struct sp_device*);
+extern int osuql_sp_register_stream(struct sp_device*);
+extern void osuql_sp_remove_stream(struct sp_device*);
 
 #define CSR_ENABLED 0x1
 #define CSR_DONE    0x2
 #define CSR_IRQ     0x4
+// players only, see stream.c
+#define CSR_STREAM   0x8
+#define CSR_COMMIT   0x10
+#define CSR_SPACE    0x20
+#define CSR_HALF     0x40
+#define CSR_UNDERRUN 0x80
 
 enum sp_type {
     TYPE_SAMPLER,
@@ -34,6 +62,18 @@ enum sp_type {
 // how many minor numbers each device can have (for partitions)
 #define MINORS 1
 
+// how many processes each device keeps lease accounting for
+#define SP_LEASE_ACCOUNTS 16
+
+struct sp_lease_account {
+    pid_t tgid;
+    char comm[TASK_COMM_LEN];
+    u64 leases;
+    u64 held_ns;
+    u64 wait_ns;
+    u64 last_used;
+};
+
 // getting between our three major representations
 // dev (struct device*), disk (struct gendisk*), and sp (struct sp_device*)
 #define dev_to_sp(device) ((struct sp_device*)dev_get_drvdata(device))
@@ -63,6 +103,36 @@ struct sp_device {
     unsigned int irq;
     unsigned int interrupts;
 
+    // guards the statistics below, and is the block queue lock
+    spinlock_t lock;
+
+    // statistics, see "attributes.h" for exposing these via sysfs
+
+    // bytes copied by block requests, and how many requests there were
+    u64 bytes_read;
+    u64 bytes_written;
+    u64 requests;
+    // ns spent copying to and from the device
+    u64 io_ns;
+
+    // when the device was last enabled, or 0 if no run is being timed
+    u64 enabled_at;
+    // runs timed from enable to interrupt, and their total / last /
+    // longest latency in ns
+    u64 runs;
+    u64 run_ns;
+    u64 run_ns_last;
+    u64 run_ns_max;
+
+    // halves streamed in, and how many times the player ran dry
+    u64 stream_halves;
+    u64 stream_underruns;
+
+    // signalled by handle_interrupt if set, see OSUQL_SP_SET_EVENTFD.
+    // set by block.c, and owned by the process that bound it
+    struct eventfd_ctx* eventfd;
+    pid_t eventfd_owner;
+
     // see "attributes.h" for exposing these via sysfs
 
     // how many bits count as 1 sample
@@ -83,13 +153,50 @@ struct sp_device {
     // how many bytes are contained in this memory
     u32 length;
 
+    //
+    // set by lease.c, guarded by lease_mutex:
+    //
+
+    struct mutex lease_mutex;
+    wait_queue_head_t lease_wait;
+    // processes waiting their turn, oldest first
+    struct list_head lease_queue;
+    unsigned int lease_waiters;
+    // how many times each process has the device open
+    struct list_head lease_openers;
+    // the process holding the lease, or NULL
+    struct pid* lease_owner;
+    // who held it last (even if released), and when it was taken
+    pid_t lease_last;
+    u64 lease_at;
+    struct sp_lease_account accounts[SP_LEASE_ACCOUNTS];
+
     //
     // set by block.c:
     //
 
-    spinlock_t lock;
     struct request_queue* queue;
     struct gendisk* gd;
+
+    //
+    // set by stream.c, guarded by stream_mutex:
+    //
+
+    struct mutex stream_mutex;
+    // woken by handle_interrupt
+    wait_queue_head_t stream_wait;
+    struct miscdevice stream_misc;
+    char stream_name[32];
+    u8 stream_registered;
+    // the half being filled (while the device is open), and how much
+    // of it is
+    void* stream_half;
+    size_t stream_fill;
+    // halves committed since the ring was last reset
+    unsigned int stream_committed;
+    // the process the lease was taken for on open, or NULL if the
+    // opener already held it
+    struct pid* stream_owner;
 };
 
 #endif /* __SAMPLER_PLAYER_H_INCLUDED__ */
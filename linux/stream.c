@@ -0,0 +1,287 @@
+#include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+#include "sampler-player.h"
+
+// streaming plays stimuli longer than a player's buffer, by treating
+// the buffer as a ring of two halves. /dev/playerN-stream takes the
+// stimulus through write(), a half at a time: each full half waits for
+// its place in the ring to be played out, is copied in, and is handed
+// to the player. playback starts once both halves are full (or on
+// fsync / close), and the player interrupts after every half, which is
+// what wakes writers up. if a writer falls behind, the player stops
+// with an underrun, and write() fails with EPIPE.
+//
+// data is in device bit order, like the block device. only players
+// with an irq get a stream device, since nothing else would wake us.
+
+// how long to wait for a reset to cross into the sample clock
+#define STREAM_RESET_US 1000
+
+#define file_to_sp(file) ((struct sp_device*)(file)->private_data)
+
+// empties the ring and puts the player back in stream mode, disabled.
+// called with stream_mutex held
+static int stream_reset(struct sp_device* sp) {
+    int us;
+
+    osuql_sp_csr_update(sp, 0xff, 0);
+    // done (or an old underrun) only drops once the reset crosses over,
+    // and the count of halves played resets along with it
+    for (us = 0; ioread8(sp->csr) & CSR_DONE; us++) {
+        if (us == STREAM_RESET_US)
+            return -EIO;
+        udelay(1);
+    }
+    osuql_sp_csr_update(sp, 0xff, CSR_STREAM);
+
+    sp->stream_fill = 0;
+    sp->stream_committed = 0;
+    return 0;
+}
+
+// the player stopped because we were too slow
+static int stream_underrun(struct sp_device* sp) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&sp->lock, flags);
+    sp->stream_underruns++;
+    spin_unlock_irqrestore(&sp->lock, flags);
+
+    stream_reset(sp);
+    return -EPIPE;
+}
+
+static bool stream_ready(struct sp_device* sp) {
+    return ioread8(sp->csr) & (CSR_SPACE | CSR_UNDERRUN);
+}
+
+// copies the staged half into the ring and commits it, waiting for
+// space first. called with stream_mutex held
+static int stream_commit(struct sp_device* sp, bool nonblock) {
+    unsigned long flags;
+    size_t half = sp->length / 2;
+    int err;
+    u8 csr;
+
+    if (nonblock && !stream_ready(sp))
+        return -EAGAIN;
+    err = wait_event_interruptible(sp->stream_wait, stream_ready(sp));
+    if (err)
+        return err;
+
+    csr = ioread8(sp->csr);
+    if (csr & CSR_UNDERRUN)
+        return stream_underrun(sp);
+
+    osuql_sp_memcpy_toio_word(sp->buffer + ((csr & CSR_HALF) ? half : 0), sp->stream_half, half / sizeof(u32));
+    osuql_sp_csr_update(sp, 0, CSR_COMMIT);
+    sp->stream_fill = 0;
+
+    spin_lock_irqsave(&sp->lock, flags);
+    sp->stream_halves++;
+    sp->bytes_written += half;
+    spin_unlock_irqrestore(&sp->lock, flags);
+
+    // start once the ring is full, so the first refill has a whole
+    // half's worth of time to arrive
+    if (++sp->stream_committed == 2)
+        osuql_sp_csr_update(sp, 0, CSR_ENABLED);
+    return 0;
+}
+
+// commits whatever is staged, padded with zeros, and starts playback
+// if it hasn't started yet. called with stream_mutex held
+static int stream_flush(struct sp_device* sp) {
+    size_t half = sp->length / 2;
+    int err;
+
+    if (sp->stream_fill) {
+        memset(sp->stream_half + sp->stream_fill, 0, half - sp->stream_fill);
+        sp->stream_fill = half;
+        err = stream_commit(sp, false);
+        if (err)
+            return err;
+    }
+    if (sp->stream_committed == 1)
+        osuql_sp_csr_update(sp, 0, CSR_ENABLED);
+    return 0;
+}
+
+static int stream_open(struct inode* inode, struct file* file) {
+    struct sp_device* sp = container_of(file->private_data, struct sp_device, stream_misc);
+    struct pid* owner = NULL;
+    int err;
+
+    if ((file->f_flags & O_ACCMODE) != O_WRONLY)
+        return -EINVAL;
+    // counts as an open of the device, see lease.c
+    err = osuql_sp_lease_open(sp);
+    if (err)
+        return err;
+    // the stream rewrites the whole buffer, so hold the lease until
+    // close, unless we already do
+    err = osuql_sp_lease_acquire(sp, file->f_flags & O_NONBLOCK);
+    if (err >= 0) {
+        owner = get_pid(task_tgid(current));
+    } else if (err != -EDEADLK) {
+        osuql_sp_lease_close(sp);
+        return err;
+    }
+
+    mutex_lock(&sp->stream_mutex);
+    if (sp->stream_half) {
+        err = -EBUSY;
+        goto out;
+    }
+    sp->stream_half = vmalloc(sp->length / 2);
+    if (!sp->stream_half) {
+        err = -ENOMEM;
+        goto out;
+    }
+    err = stream_reset(sp);
+    if (err) {
+        vfree(sp->stream_half);
+        sp->stream_half = NULL;
+        goto out;
+    }
+    sp->stream_owner = owner;
+    owner = NULL;
+
+out:
+    mutex_unlock(&sp->stream_mutex);
+    if (owner) {
+        osuql_sp_lease_put(sp, owner);
+        put_pid(owner);
+    }
+    if (err)
+        osuql_sp_lease_close(sp);
+    else
+        file->private_data = sp;
+    return err;
+}
+
+static ssize_t stream_write(struct file* file, const char __user* buf, size_t count, loff_t* pos) {
+    struct sp_device* sp = file_to_sp(file);
+    bool nonblock = file->f_flags & O_NONBLOCK;
+    size_t half = sp->length / 2;
+    size_t done = 0;
+    size_t n;
+    int err = 0;
+
+    if (!osuql_sp_lease_check(sp))
+        return -EBUSY;
+    if (mutex_lock_interruptible(&sp->stream_mutex))
+        return -ERESTARTSYS;
+
+    for (;;) {
+        // hand over full halves as soon as they fit
+        if (sp->stream_fill == half) {
+            err = stream_commit(sp, nonblock);
+            if (err)
+                break;
+        }
+        if (done == count)
+            break;
+
+        n = min(count - done, half - sp->stream_fill);
+        if (copy_from_user(sp->stream_half + sp->stream_fill, buf + done, n)) {
+            err = -EFAULT;
+            break;
+        }
+        sp->stream_fill += n;
+        done += n;
+    }
+
+    mutex_unlock(&sp->stream_mutex);
+    // an underrun throws away what was staged, so always report it
+    if (err == -EPIPE || !done)
+        return err;
+    return done;
+}
+
+// plays out everything written so far, and waits for it to finish
+static int stream_fsync(struct file* file, loff_t start, loff_t end, int datasync) {
+    struct sp_device* sp = file_to_sp(file);
+    int err;
+
+    if (mutex_lock_interruptible(&sp->stream_mutex))
+        return -ERESTARTSYS;
+    err = stream_flush(sp);
+    if (!err && sp->stream_committed) {
+        // running out of halves is how a stream finishes
+        err = wait_event_interruptible(sp->stream_wait, ioread8(sp->csr) & CSR_DONE);
+        if (!err)
+            err = stream_reset(sp);
+    }
+    mutex_unlock(&sp->stream_mutex);
+    return err;
+}
+
+static int stream_release(struct inode* inode, struct file* file) {
+    struct sp_device* sp = file_to_sp(file);
+    struct pid* owner;
+
+    mutex_lock(&sp->stream_mutex);
+    // let the tail play out after a close, but not after a crash
+    if (current->flags & PF_EXITING)
+        osuql_sp_csr_update(sp, 0xff, 0);
+    else
+        stream_flush(sp);
+    vfree(sp->stream_half);
+    sp->stream_half = NULL;
+    owner = sp->stream_owner;
+    sp->stream_owner = NULL;
+    mutex_unlock(&sp->stream_mutex);
+
+    // whoever runs next finds the buffer holding the end of the stream
+    osuql_sp_lease_invalidate(sp);
+    if (owner) {
+        osuql_sp_lease_put(sp, owner);
+        put_pid(owner);
+    }
+    osuql_sp_lease_close(sp);
+    return 0;
+}
+
+static const struct file_operations stream_fops = {
+    .owner = THIS_MODULE,
+    .open = stream_open,
+    .write = stream_write,
+    .fsync = stream_fsync,
+    .release = stream_release,
+    .llseek = no_llseek,
+};
+
+void osuql_sp_init_stream(struct sp_device* sp) {
+    mutex_init(&sp->stream_mutex);
+    init_waitqueue_head(&sp->stream_wait);
+}
+
+int osuql_sp_register_stream(struct sp_device* sp) {
+    int err;
+
+    if (sp->type != TYPE_PLAYER || !sp->irq)
+        return 0;
+
+    snprintf(sp->stream_name, sizeof(sp->stream_name), "%s%i-stream", PLAYER_DEV, sp->number);
+    sp->stream_misc.minor = MISC_DYNAMIC_MINOR;
+    sp->stream_misc.name = sp->stream_name;
+    sp->stream_misc.fops = &stream_fops;
+    sp->stream_misc.parent = sp->dev;
+    err = misc_register(&sp->stream_misc);
+    if (err < 0)
+        return err;
+    sp->stream_registered = 1;
+    return 0;
+}
+
+void osuql_sp_remove_stream(struct sp_device* sp) {
+    if (sp && sp->stream_registered) {
+        misc_deregister(&sp->stream_misc);
+        sp->stream_registered = 0;
+    }
+}
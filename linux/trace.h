@@ -0,0 +1,102 @@
+// this file defines our tracepoints, for use with perf or ftrace
+// exactly one file (block.c) defines CREATE_TRACE_POINTS before
+// including it. the events show up under
+// /sys/kernel/debug/tracing/events/sampler_player/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sampler_player
+
+#if !defined(__SAMPLER_PLAYER_TRACE_H_INCLUDED__) || defined(TRACE_HEADER_MULTI_READ)
+#define __SAMPLER_PLAYER_TRACE_H_INCLUDED__
+
+#include <linux/tracepoint.h>
+
+#include "sampler-player.h"
+
+// one chunk of a block request, copied to or from the device
+TRACE_EVENT(osuql_sp_request,
+    TP_PROTO(struct sp_device* sp, int write, size_t start, size_t size, u64 ns),
+    TP_ARGS(sp, write, start, size, ns),
+
+    TP_STRUCT__entry(
+        __field(u8, type)
+        __field(u8, number)
+        __field(int, write)
+        __field(size_t, start)
+        __field(size_t, size)
+        __field(u64, ns)
+    ),
+
+    TP_fast_assign(
+        __entry->type = sp->type;
+        __entry->number = sp->number;
+        __entry->write = write;
+        __entry->start = start;
+        __entry->size = size;
+        __entry->ns = ns;
+    ),
+
+    TP_printk("%s%u %s start=%zu size=%zu ns=%llu",
+              BY_TYPE(__entry->type, SAMPLER_DEV, PLAYER_DEV), __entry->number,
+              __entry->write ? "write" : "read", __entry->start, __entry->size,
+              (unsigned long long)__entry->ns)
+);
+
+// an ioctl, and what it returned
+TRACE_EVENT(osuql_sp_ioctl,
+    TP_PROTO(struct sp_device* sp, unsigned int cmd, unsigned long arg, int ret),
+    TP_ARGS(sp, cmd, arg, ret),
+
+    TP_STRUCT__entry(
+        __field(u8, type)
+        __field(u8, number)
+        __field(unsigned int, cmd)
+        __field(unsigned long, arg)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->type = sp->type;
+        __entry->number = sp->number;
+        __entry->cmd = cmd;
+        __entry->arg = arg;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("%s%u nr=%u arg=%lu ret=%d",
+              BY_TYPE(__entry->type, SAMPLER_DEV, PLAYER_DEV), __entry->number,
+              _IOC_NR(__entry->cmd), __entry->arg, __entry->ret)
+);
+
+// the device finished, latency is ns since it was enabled (or 0)
+TRACE_EVENT(osuql_sp_interrupt,
+    TP_PROTO(struct sp_device* sp, u8 csr, u64 latency),
+    TP_ARGS(sp, csr, latency),
+
+    TP_STRUCT__entry(
+        __field(u8, type)
+        __field(u8, number)
+        __field(u8, csr)
+        __field(u64, latency)
+    ),
+
+    TP_fast_assign(
+        __entry->type = sp->type;
+        __entry->number = sp->number;
+        __entry->csr = csr;
+        __entry->latency = latency;
+    ),
+
+    TP_printk("%s%u csr=0x%02x latency=%llu",
+              BY_TYPE(__entry->type, SAMPLER_DEV, PLAYER_DEV), __entry->number,
+              __entry->csr, (unsigned long long)__entry->latency)
+);
+
+#endif /* __SAMPLER_PLAYER_TRACE_H_INCLUDED__ */
+
+// this part must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
@@ -9,16 +9,62 @@ import struct
 import io
 import traceback
 import mmap
+import socket
+import threading
+import time
+import collections
+import numbers
+import contextlib
+import errno
 
 if sys.version_info >= (3, 0):
     import urllib.request as urllib_request
     import http.server as http_server
+    import socketserver
 else:
     import urllib2 as urllib_request
     import BaseHTTPServer as http_server
+    import SocketServer as socketserver
 
 import numpy
 
+# the optional native extension, see _osuqlsp.c and setup.py
+try:
+    import _osuqlsp
+except ImportError:
+    _osuqlsp = None
+
+try:
+    from concurrent.futures import Future
+except ImportError:
+    # python 2 without the futures backport
+    class Future(object):
+        def __init__(self):
+            self._event = threading.Event()
+            self._result = None
+            self._exception = None
+
+        def done(self):
+            return self._event.is_set()
+
+        def set_result(self, result):
+            self._result = result
+            self._event.set()
+
+        def set_exception(self, exception):
+            self._exception = exception
+            self._event.set()
+
+        def exception(self, timeout=None):
+            if not self._event.wait(timeout):
+                raise RuntimeError('timed out')
+            return self._exception
+
+        def result(self, timeout=None):
+            if self.exception(timeout) is not None:
+                raise self._exception
+            return self._result
+
 # some base addresses for AXI bridges
 H2F_LW_AXI_MASTER = 0xff200000
 H2F_AXI_MASTER = 0xc0000000
@@ -82,11 +128,50 @@ SET_ENABLED = _IO(IOC_MAGIC, 1)
 
 GET_DONE = _IO(IOC_MAGIC, 2)
 
+# see linux/ioctls.h
+ACQUIRE = _IO(IOC_MAGIC, 3)
+RELEASE = _IO(IOC_MAGIC, 4)
+
+# struct osuql_sp_info, see linux/ioctls.h
+INFO_STRUCT = struct.Struct('=16I')
+INFO_FIELDS = ['version', 'size', 'type', 'number', 'caps',
+               'sample_width', 'sample_bits', 'sample_length',
+               'time_bits', 'time_length', 'bits', 'length']
+INFO_TYPES = ['sampler', 'player']
+GET_INFO = _IOR(IOC_MAGIC, 5, INFO_STRUCT.size)
+
+# takes an eventfd, or -1 to unbind. see linux/ioctls.h
+SET_EVENTFD = _IO(IOC_MAGIC, 6)
+
+CAP_IRQ = 0x1
+CAP_STATS = 0x2
+CAP_LEASE = 0x4
+CAP_EVENTFD = 0x8
+CAP_STREAM = 0x10
+
 # to use numpy.packbits, we need a way to quickly swap LSB with MSB in a byte
 # so, use a table.
 # this is horrible, but (hilariously) faster than other methods
 swaptable = numpy.array([int('{:08b}'.format(n)[::-1], 2) for n in range(256)], dtype=numpy.uint8)
 
+# smallest unit a device write can be, with O_DIRECT
+IO_ALIGN = 512
+
+def dirty_ranges(new, old, row_length, align=IO_ALIGN):
+    """Byte ranges where new and old (flat uint8 arrays) differ, compared
+    in rows of row_length and rounded out to multiples of align. Runs that
+    would share an aligned block are merged."""
+    align = max(align, row_length)
+    rows = len(new) // row_length
+    dirty = (new.reshape(rows, row_length) != old.reshape(rows, row_length)).any(axis=1)
+    # mark the aligned blocks holding dirty rows, then find runs of them
+    per_block = align // row_length
+    blocks = -(-rows // per_block)
+    dirty = numpy.pad(dirty, (0, blocks * per_block - rows), 'constant')
+    dirty = numpy.concatenate(([False], dirty.reshape(blocks, per_block).any(axis=1), [False]))
+    edges = numpy.flatnonzero(dirty[1:] != dirty[:-1])
+    return [(int(a) * align, min(int(b) * align, len(new))) for a, b in zip(edges[::2], edges[1::2])]
+
 def sysfs_property(name, type=int):
     def getter(self):
         v = getattr(self, '_' + name, None)
@@ -115,6 +200,11 @@ class SamplerPlayerBase(object):
         outputs = numpy.unpackbits(outputs, axis=1)
         return outputs[:,:self.sample_width]
 
+    def read_packed(self):
+        # like read, but leaves the capture packed, see PackedCapture
+        outputs = numpy.reshape(self.read_raw(), (self.time_length, self.sample_length))
+        return PackedCapture(outputs, self.sample_width)
+
     def write(self, inputs):
         time, samps = inputs.shape
         if time > self.time_length or samps > self.sample_width:
@@ -127,39 +217,165 @@ class SamplerPlayerBase(object):
 
         self.write_raw(inputs)
 
+    @contextlib.contextmanager
+    def lease(self):
+        # devices without leases are never shared
+        yield False
+
 class DriverSamplerPlayer(SamplerPlayerBase):
     def __init__(self, path):
         if not path.startswith('/dev/'):
             raise ValueError('not a valid device')
         self.name = path[len('/dev/'):]
         self.device = None
+        # what we last wrote, if we're a player
+        self.shadow = None
+        # page-aligned copy of it, for O_DIRECT writes
+        self.staging = None
+        # an _osuqlsp.Device, if we have the extension
+        self.native = None
 
         if not os.path.exists('/dev/' + self.name):
             raise RuntimeError('device /dev/' + self.name + ' does not exist')
         if not os.path.exists('/sys/block/' + self.name + '/device/sample_width'):
             raise RuntimeError('device /dev/' + self.name + ' is not a sampler or player.')
 
+        self.info = self.get_info()
+        if _osuqlsp is not None:
+            try:
+                self.native = _osuqlsp.Device(self.name)
+            except (RuntimeError, IOError):
+                self.native = None
         self.reload()
 
+    def get_info(self):
+        # everything sysfs_property reads, in one ioctl. drivers without
+        # GET_INFO return None, and the properties fall back to sysfs.
+        buf = bytearray(INFO_STRUCT.size)
+        with open('/dev/' + self.name, 'rb', buffering=0) as f:
+            try:
+                fcntl.ioctl(f, GET_INFO, buf, True)
+            except IOError as e:
+                if e.errno == errno.ENOTTY:
+                    return None
+                raise
+        info = dict(zip(INFO_FIELDS, INFO_STRUCT.unpack(bytes(buf))))
+        info['type'] = INFO_TYPES[info['type']]
+        for name in INFO_FIELDS[5:] + ['type']:
+            setattr(self, '_' + name, info[name])
+        return info
+
     def reload(self):
-        if self.device:
-            self.device.close()
+        if self.native:
+            # one fd for good, and O_DIRECT means no stale cache to drop
+            self.device = self.native
+            return
+        # open before closing, as a lease ends with our last close
+        old = self.device
         if self.type == 'player':
-            self.device = open('/dev/' + self.name, 'wb', buffering=0)
+            # O_DIRECT, as a buffered write smaller than a page would
+            # read the rest of the page in first, and players can't be
+            # read back. this also leaves no cache to drop
+            fd = os.open('/dev/' + self.name, os.O_WRONLY | os.O_DIRECT)
+            self.device = os.fdopen(fd, 'wb', 0)
         elif self.type == 'sampler':
             self.device = open('/dev/' + self.name, 'rb', buffering=0)
         else:
             raise RuntimeError('unknown type ' + self.type)
+        if old:
+            old.close()
+
+    def read(self, out=None):
+        # with the extension, read straight into out (time_length x
+        # sample_width uint8s), unpacking in one pass
+        if not self.native:
+            outputs = super(DriverSamplerPlayer, self).read()
+            if out is None:
+                return outputs
+            out[...] = outputs
+            return out
+        if out is None:
+            out = numpy.empty((self.time_length, self.sample_width), dtype=numpy.uint8)
+        return self.native.read_into(out)
 
-    def read_raw(self):
+    def write(self, inputs):
+        if not self.native:
+            return super(DriverSamplerPlayer, self).write(inputs)
+        time, samps = inputs.shape
+        if time > self.time_length or samps > self.sample_width:
+            raise ValueError('too much data to write')
+        if inputs.dtype == numpy.bool_:
+            inputs = inputs.view(numpy.uint8)
+        inputs = numpy.ascontiguousarray(inputs, dtype=numpy.uint8)
+        self.native.write_from(inputs, time, samps)
+
+    def read_raw(self, out=None):
+        if self.native:
+            if out is None:
+                out = numpy.empty(self.length, dtype=numpy.uint8)
+            return self.native.read_raw(out)
         self.reload()
         self.device.seek(0)
         return numpy.fromfile(self.device, dtype=numpy.uint8, count=self.length)
 
     def write_raw(self, inputs):
-        self.device.seek(0)
-        inputs.tofile(self.device)
-        self.reload()
+        if self.native:
+            # the extension keeps its own shadow
+            self.native.write_raw(numpy.ascontiguousarray(inputs, dtype=numpy.uint8))
+            return
+        # only send the rows that changed since last time
+        inputs = numpy.ascontiguousarray(inputs, dtype=numpy.uint8).reshape(-1)
+        if self.shadow is None:
+            ranges = [(0, len(inputs))]
+        else:
+            ranges = dirty_ranges(inputs, self.shadow, self.sample_length)
+        if self.staging is None or len(self.staging) != len(inputs):
+            # anonymous maps are page-aligned, as O_DIRECT needs
+            self.staging = mmap.mmap(-1, len(inputs))
+        numpy.frombuffer(self.staging, dtype=numpy.uint8)[:] = inputs
+        staging = memoryview(self.staging)
+        try:
+            for start, end in ranges:
+                self.device.seek(start)
+                self.device.write(staging[start:end])
+        except Exception:
+            self.shadow = None
+            raise
+        self.shadow = inputs.copy()
+
+    def acquire(self, wait=True):
+        # sleeps until this process holds the device's lease. returns
+        # True if another process held it since our last lease, so
+        # whatever we wrote there may be gone. drivers without leases
+        # count as never changing hands.
+        if self.native:
+            return self.native.acquire(not wait)
+        try:
+            changed = fcntl.ioctl(self.device, ACQUIRE, 0 if wait else 1) > 0
+        except IOError as e:
+            if e.errno == errno.ENOTTY:
+                return False
+            raise
+        if changed:
+            self.shadow = None
+        return changed
+
+    def release(self):
+        if self.native:
+            return self.native.release()
+        try:
+            fcntl.ioctl(self.device, RELEASE)
+        except IOError as e:
+            if e.errno != errno.ENOTTY:
+                raise
+
+    @contextlib.contextmanager
+    def lease(self, wait=True):
+        changed = self.acquire(wait)
+        try:
+            yield changed
+        finally:
+            self.release()
 
     def get_sysfs(self, attr, type=int):
         with open('/sys/block/' + self.name + '/device/' + attr) as f:
@@ -181,40 +397,119 @@ class DriverSamplerPlayer(SamplerPlayerBase):
     enabled = ioctl_property(GET_ENABLED, SET_ENABLED)
     done = ioctl_property(GET_DONE)
 
+def discover_devices():
+    # every sampler and player on the system, as {name: info}, with
+    # info as from DriverSamplerPlayer.get_info (or None)
+    devices = {}
+    if not os.path.isdir('/sys/block'):
+        return devices
+    for name in sorted(os.listdir('/sys/block')):
+        if not name.startswith(('sampler', 'player')):
+            continue
+        try:
+            devices[name] = DriverSamplerPlayer('/dev/' + name).info
+        except (RuntimeError, IOError):
+            continue
+    return devices
+
+def sample_bits_for(sample_width):
+    # each sample takes a power of two 32-bit words, as in sampler_hw.tcl
+    words = (sample_width + 31) // 32
+    return (words - 1).bit_length() + 2
+
 class MemSamplerPlayer(SamplerPlayerBase):
-    def __init__(self, typ, csr_addr, base_addr, sample_width, time_bits):
+    # talks to the hardware through /dev/mem (or mem), bypassing the
+    # driver. the buffer and csr stay mapped, with numpy views over
+    # them made once, so runs don't allocate.
+    def __init__(self, typ, csr_addr, base_addr, sample_width, time_bits, mem='/dev/mem'):
         self.type = typ
         self.sample_width = sample_width
         self.time_bits = time_bits
 
         # calculated
-        self.sample_bits = int(numpy.ceil(numpy.log(sample_width / 32.0) / numpy.log(2))) + 2
+        self.sample_bits = sample_bits_for(sample_width)
         self.sample_length = 1 << self.sample_bits
         self.time_length = 1 << self.time_bits
         self.bits = self.time_bits + self.sample_bits
         self.length = self.time_length * self.sample_length
-
-        with open('/dev/mem', 'r+b') as f:
-            self.csr, self.csr_start = kludgy_mmap(f.fileno(), 4, offset=csr_addr)
-            self.data, self.data_start = kludgy_mmap(f.fileno(), self.length, offset=base_addr)
-
-    def read_raw(self):
-        return numpy.frombuffer(self.data[self.data_start:self.data_start + self.length], dtype=numpy.uint8, count=self.length)
+        # bytes of each row that hold real bits
+        self.row_bytes = (sample_width + 7) // 8
+
+        # O_SYNC keeps the mapping uncached
+        fd = os.open(mem, os.O_RDWR | os.O_SYNC)
+        try:
+            self.csr, self.csr_start = kludgy_mmap(fd, 4, offset=csr_addr)
+            self.data, self.data_start = kludgy_mmap(fd, self.length, offset=base_addr)
+        finally:
+            os.close(fd)
+
+        self.csr_view = numpy.frombuffer(self.csr, dtype=numpy.uint8, count=4, offset=self.csr_start)
+        # (time_length, sample_length), straight onto the device
+        self.buffer = numpy.frombuffer(self.data, dtype=numpy.uint8, count=self.length, offset=self.data_start)
+        self.buffer = self.buffer.reshape(self.time_length, self.sample_length)
+
+        # a local copy of the buffer, so unpacking never reads
+        # uncached memory a byte at a time
+        self.local = numpy.empty((self.time_length, self.sample_length), dtype=numpy.uint8)
+        self.scratch = numpy.empty((self.time_length, self.row_bytes, 8), dtype=numpy.uint8)
+
+    def fence(self):
+        # reading back from the buffer makes sure posted writes to it
+        # have landed before we go on to touch the csr
+        return int(self.buffer[-1, 0])
+
+    def read_raw(self, out=None):
+        # without out, this is a live view of device memory
+        if out is None:
+            return self.buffer.reshape(-1)
+        out = out.reshape(-1)
+        out[:self.length] = self.buffer.reshape(-1)
+        return out
 
     def write_raw(self, inputs):
-        self.data[self.data_start:self.data_start + self.length] = inputs
+        inputs = numpy.asarray(inputs, dtype=numpy.uint8).reshape(-1)
+        flat = self.buffer.reshape(-1)
+        flat[:len(inputs)] = inputs
+        flat[len(inputs):] = 0
+        self.fence()
+
+    def read(self, out=None):
+        # one bulk copy off the device, then unpack into out
+        # (time_length x sample_width uint8s, allocated if None)
+        numpy.copyto(self.local, self.buffer)
+        numpy.take(unpack_table_little, self.local[:, :self.row_bytes], axis=0, out=self.scratch)
+        unpacked = self.scratch.reshape(self.time_length, -1)[:, :self.sample_width]
+        if out is None:
+            return unpacked.copy()
+        out[...] = unpacked
+        return out
+
+    def read_packed(self):
+        numpy.copyto(self.local, self.buffer)
+        return PackedCapture(self.local.copy(), self.sample_width)
+
+    def write(self, inputs):
+        # pack straight into device memory
+        time, samps = inputs.shape
+        if time > self.time_length or samps > self.sample_width:
+            raise ValueError('too much data to write')
+        packed = pack_rows_little(inputs)
+        self.buffer[:time, :packed.shape[1]] = packed
+        self.buffer[:time, packed.shape[1]:] = 0
+        self.buffer[time:] = 0
+        self.fence()
 
     def get_enabled(self):
-        return bool(self.csr[self.csr_start] & 0x1)
+        return bool(self.csr_view[0] & 0x1)
 
     def set_enabled(self, enabled):
-        self.csr[self.csr_start] = (self.csr[self.csr_start] & (~0x1)) | (0x1 if enabled else 0)
+        self.csr_view[0] = (int(self.csr_view[0]) & ~0x1) | (0x1 if enabled else 0)
 
     enabled = property(get_enabled, set_enabled)
 
     @property
     def done(self):
-        return bool(self.csr[self.csr_start] & 0x2)
+        return bool(self.csr_view[0] & 0x2)
 
 class Sampler(DriverSamplerPlayer):
     def __init__(self, device):
@@ -248,6 +543,11 @@ class SPPair(object):
             self.play = player
 
     def run(self, inputs):
+        # player first, the same order every other user takes them in
+        with self.play.lease(), self.samp.lease():
+            return self.run_leased(inputs)
+
+    def run_leased(self, inputs):
         self.samp.enabled = 0
         self.play.enabled = 0
 
@@ -268,6 +568,25 @@ class SPPair(object):
 
         return self.samp.read()
 
+class ModelPair(object):
+    # stands in for an SPPair with no hardware attached: the player is
+    # wired straight into the sampler, through model (identity if None)
+    def __init__(self, sample_width=32, time_bits=10, model=None):
+        self.sample_width = sample_width
+        self.time_length = 1 << time_bits
+        self.model = model
+
+    def run(self, inputs):
+        inputs = numpy.asarray(inputs)
+        time, samps = inputs.shape
+        if time > self.time_length or samps > self.sample_width:
+            raise ValueError('too much data to write')
+        outputs = numpy.zeros((self.time_length, self.sample_width), dtype=numpy.uint8)
+        outputs[:time, :samps] = inputs
+        if self.model is not None:
+            outputs = numpy.asarray(self.model(outputs), dtype=numpy.uint8)
+        return outputs
+
 server_size_field = struct.Struct('>I')
 
 def server_pack(arr):
@@ -279,6 +598,114 @@ def server_pack(arr):
         f.write(memoryview(arr))
         return f.getvalue()
 
+# bits of every byte, most significant first, for unpacking with numpy.take
+unpack_table = numpy.unpackbits(numpy.arange(256, dtype=numpy.uint8)[:, None], axis=1)
+
+def server_pack_into(arr, buf, offset=0):
+    # like server_pack, but writes into the bytearray buf at offset,
+    # growing it if needed. returns the number of bytes written.
+    arr = numpy.asarray(arr)
+    packed = numpy.packbits(arr, axis=1)
+    total = 2 * server_size_field.size + packed.nbytes
+    if len(buf) < offset + total:
+        buf.extend(bytearray(offset + total - len(buf)))
+    server_size_field.pack_into(buf, offset, arr.shape[0])
+    server_size_field.pack_into(buf, offset + server_size_field.size, arr.shape[1])
+    view = numpy.frombuffer(buf, dtype=numpy.uint8, count=packed.nbytes, offset=offset + 2 * server_size_field.size)
+    view[:] = packed.ravel()
+    return total
+
+# response encodings sp-server can use for captures, in the order of
+# their numbers in binary protocol flags
+SERVER_ENCODINGS = ['identity', 'x-sp-rle', 'x-sp-xor-rle', 'x-sp-lz4']
+
+def lz4_decode(src, size):
+    # decodes one lz4 block of size bytes
+    out = bytearray(size)
+    src = memoryview(src)
+    ip = op = 0
+    end = len(src)
+    while ip < end:
+        token = src[ip]
+        ip += 1
+        literals = token >> 4
+        if literals == 15:
+            while True:
+                b = src[ip]
+                ip += 1
+                literals += b
+                if b != 255:
+                    break
+        out[op:op + literals] = src[ip:ip + literals]
+        ip += literals
+        op += literals
+        if ip >= end:
+            break
+
+        offset = src[ip] | (src[ip + 1] << 8)
+        ip += 2
+        match = token & 15
+        if match == 15:
+            while True:
+                b = src[ip]
+                ip += 1
+                match += b
+                if b != 255:
+                    break
+        match += 4
+        # matches may overlap what they copy, so copy in growing steps
+        start = op - offset
+        while match:
+            chunk = min(match, op - start)
+            out[op:op + chunk] = out[start:start + chunk]
+            op += chunk
+            match -= chunk
+    return out
+
+def server_decode(data, encoding):
+    # undoes a response encoding, returning rows, columns, and the
+    # packed rows as a 2d uint8 array
+    size1, size2 = struct.unpack_from('>II', data)
+    if encoding in (None, 'identity'):
+        packed = numpy.frombuffer(data, dtype=numpy.uint8, offset=2 * server_size_field.size)
+        if size1:
+            return size1, size2, packed[:len(packed) - len(packed) % size1].reshape(size1, -1)
+        return size1, size2, packed[:0].reshape(0, 0)
+
+    row_length = struct.unpack_from('>I', data, 8)[0]
+    stream = numpy.frombuffer(data, dtype=numpy.uint8, offset=12)
+    if encoding in ('x-sp-rle', 'x-sp-xor-rle'):
+        runs = stream.reshape(-1, 4 + row_length)
+        counts = runs[:, :4].copy().view('>u4').ravel()
+        packed = numpy.repeat(runs[:, 4:], counts, axis=0)
+        if encoding == 'x-sp-xor-rle':
+            packed = numpy.bitwise_xor.accumulate(packed, axis=0)
+    elif encoding == 'x-sp-lz4':
+        packed = numpy.frombuffer(lz4_decode(stream, size1 * row_length), dtype=numpy.uint8)
+        packed = packed.reshape(size1, row_length)
+    else:
+        raise ValueError('unknown encoding ' + str(encoding))
+    return size1, size2, packed
+
+def server_unpack_into(data, out=None, scratch=None, encoding=None):
+    # like server_unpack, but unpacks into out (allocated if None)
+    # scratch is an optional reusable uint8 array, of at least the
+    # padded size of the data, to unpack into before trimming
+    # encoding is the response encoding used, if any
+    size1, size2, packed = server_decode(data, encoding)
+    padded = packed.shape[1] * 8
+
+    if scratch is None or scratch.size < size1 * padded:
+        scratch = numpy.empty(size1 * padded, dtype=numpy.uint8)
+    unpacked = scratch.ravel()[:size1 * padded].reshape(size1, packed.shape[1], 8)
+    numpy.take(unpack_table, packed, axis=0, out=unpacked)
+    unpacked = unpacked.reshape(size1, padded)
+
+    if out is None:
+        out = numpy.empty((size1, size2), dtype=numpy.uint8)
+    out[...] = unpacked[:, :size2]
+    return out
+
 def server_unpack(arr):
     with io.BytesIO(arr) as f:
         size1 = server_size_field.unpack(f.read(server_size_field.size))[0]
@@ -293,18 +720,765 @@ def server_unpack(arr):
         arr = arr[:,:size2]
     return arr
 
+def server_capture(data, encoding=None):
+    # like server_unpack_into, but leaves the capture packed
+    size1, size2, packed = server_decode(data, encoding)
+    return PackedCapture(packed, size2, bitorder='big')
+
+# the same as unpack_table, but least significant bit first
+unpack_table_little = numpy.ascontiguousarray(unpack_table[:, ::-1])
+
+def pack_rows_little(arr):
+    # packs rows of bits least significant bit first, as the device
+    # stores them
+    arr = numpy.asarray(arr)
+    if arr.dtype != numpy.bool_ and arr.dtype != numpy.uint8:
+        arr = arr != 0
+    try:
+        return numpy.packbits(arr, axis=1, bitorder='little')
+    except TypeError:
+        # numpy before 1.17
+        return swaptable[numpy.packbits(arr, axis=1)]
+
+# how many bits are set in every byte
+popcount_table = unpack_table.sum(axis=1).astype(numpy.uint8)
+
+class PackedCapture(object):
+    # a capture left packed, 8 bits to a byte, wrapping its buffer
+    # without a copy. it indexes like a (time, width) uint8 array, but
+    # only unpacks what you ask for. bitorder is 'little' for device
+    # memory (see read_packed) or 'big' for server replies (see
+    # server_capture).
+
+    # rows per block when reducing over the whole capture
+    block_rows = 4096
+
+    def __init__(self, packed, width, bitorder='little'):
+        packed = numpy.asarray(packed, dtype=numpy.uint8)
+        if packed.ndim != 2:
+            raise ValueError('packed data must be 2d')
+        if width > packed.shape[1] * 8:
+            raise ValueError('rows too short for width')
+        if bitorder not in ('little', 'big'):
+            raise ValueError('bitorder must be little or big')
+        self.packed = packed
+        self.width = width
+        self.bitorder = bitorder
+        self.shape = (packed.shape[0], width)
+        self.dtype = numpy.dtype(numpy.uint8)
+        self.table = unpack_table_little if bitorder == 'little' else unpack_table
+
+        # which bits of each row are real, and not padding
+        self.mask = numpy.zeros(packed.shape[1], dtype=numpy.uint8)
+        self.mask[:width // 8] = 0xff
+        if width % 8:
+            ones = (1 << (width % 8)) - 1
+            self.mask[width // 8] = ones if bitorder == 'little' else ones << (8 - width % 8)
+
+    def __len__(self):
+        return self.shape[0]
+
+    @property
+    def nbytes(self):
+        return self.packed.nbytes
+
+    def __array__(self, dtype=None, copy=None):
+        out = self.unpack()
+        if dtype is not None:
+            out = out.astype(dtype)
+        return out
+
+    def __getitem__(self, key):
+        if not isinstance(key, tuple):
+            key = (key,)
+        if len(key) > 2:
+            raise IndexError('too many indices')
+        rows = key[0]
+        bits = key[1] if len(key) > 1 else slice(None)
+
+        # single rows come back as 1d
+        one_row = isinstance(rows, numbers.Integral)
+        if one_row:
+            if not -len(self) <= rows < len(self):
+                raise IndexError('time index out of range')
+            rows = rows % len(self)
+            rows = slice(rows, rows + 1)
+
+        if isinstance(bits, numbers.Integral):
+            out = self.column(bits, rows)
+        elif isinstance(bits, slice):
+            out = self.unpack(rows, bits)
+        else:
+            out = self.columns(bits, rows)
+        return out[0] if one_row else out
+
+    def window(self, start=None, stop=None):
+        # the rows in [start, stop) as another PackedCapture, no copy
+        return PackedCapture(self.packed[start:stop], self.width, self.bitorder)
+
+    def _bits(self, bits):
+        bits = numpy.asarray(bits, dtype=numpy.intp)
+        bits = numpy.where(bits < 0, bits + self.width, bits)
+        if bits.size and (bits.min() < 0 or bits.max() >= self.width):
+            raise IndexError('bit index out of range')
+        return bits
+
+    def columns(self, bits, rows=slice(None)):
+        # the given bit columns, as a (time, len(bits)) array
+        bits = self._bits(bits)
+        shift = bits & 7
+        if self.bitorder == 'big':
+            shift = 7 - shift
+        packed = self.packed[rows]
+        return ((packed[:, bits >> 3] >> shift.astype(numpy.uint8)) & 1).astype(numpy.uint8)
+
+    def column(self, bit, rows=slice(None)):
+        return self.columns([bit], rows)[:, 0]
+
+    def unpack(self, rows=slice(None), bits=slice(None)):
+        # the region given by the slices rows and bits, unpacked
+        start, stop, step = bits.indices(self.width)
+        if step != 1:
+            return self.columns(numpy.arange(start, stop, step), rows)
+        packed = self.packed[rows]
+        if stop <= start:
+            return numpy.zeros((packed.shape[0], 0), dtype=numpy.uint8)
+        first, last = start // 8, (stop + 7) // 8
+        unpacked = self.table[packed[:, first:last]].reshape(packed.shape[0], -1)
+        return unpacked[:, start - 8 * first:stop - 8 * first]
+
+    def popcount(self, axis=None):
+        # how many bits are set: in total, per bit (axis=0), or per
+        # time step (axis=1)
+        if axis is None:
+            return int(popcount_table[self.packed & self.mask].sum(dtype=numpy.int64))
+        if axis == 1:
+            return popcount_table[self.packed & self.mask].sum(axis=1, dtype=numpy.int64)
+        if axis != 0:
+            raise ValueError('axis must be None, 0, or 1')
+        # unpacking a block at a time keeps memory bounded
+        counts = numpy.zeros(self.packed.shape[1] * 8, dtype=numpy.int64)
+        for i in range(0, len(self), self.block_rows):
+            block = self.table[self.packed[i:i + self.block_rows]]
+            counts += block.sum(axis=0, dtype=numpy.int64).reshape(-1)
+        return counts[:self.width]
+
+    def any(self, axis=None):
+        # whether any bit is set: at all, per bit, or per time step
+        masked = self.packed & self.mask
+        if axis is None:
+            return bool(masked.any())
+        if axis == 1:
+            return masked.any(axis=1)
+        if axis != 0:
+            raise ValueError('axis must be None, 0, or 1')
+        seen = numpy.bitwise_or.reduce(masked, axis=0) if len(self) else self.mask & 0
+        return self.table[seen].reshape(-1)[:self.width].astype(bool)
+
+    def edges(self, bit, rising=None):
+        # time steps where a bit changes (rising or falling only, if
+        # rising is True or False), as the index after the change
+        col = self.column(bit).astype(numpy.int8)
+        diff = numpy.diff(col)
+        if rising is None:
+            changed = diff != 0
+        elif rising:
+            changed = diff > 0
+        else:
+            changed = diff < 0
+        return numpy.flatnonzero(changed) + 1
+
+    def first_edge(self, bit, rising=None):
+        # the first of edges(), or None
+        found = self.edges(bit, rising)
+        return int(found[0]) if len(found) else None
+
+# sp-server's run archive (see -a, and sp_archive_open in
+# sp-server.c). each segment file has a header page, a fixed-stride
+# index, and the captures, all little-endian
+ARCHIVE_MAGIC = b'SPARCHV1'
+ARCHIVE_VERSION = 1
+ARCHIVE_HEADER_SIZE = 4096
+ARCHIVE_HEADER = struct.Struct('<8sIIQQQQQI')
+ARCHIVE_COMMITTED = struct.Struct('<Q')
+ARCHIVE_COMMITTED_OFFSET = 48
+ARCHIVE_ENTRY = numpy.dtype([
+    ('run', '<u8'), ('stimulus', '<u8'), ('time_ns', '<u8'), ('run_ns', '<u8'),
+    ('offset', '<u8'), ('length', '<u4'), ('rows', '<u4'), ('row_length', '<u4'),
+    ('columns', '<u4'), ('pair', '<u4'), ('reserved', '<u4'),
+])
+
+ArchiveRun = collections.namedtuple('ArchiveRun', ['run', 'pair', 'stimulus', 'time_ns', 'run_ns', 'capture'])
+
+class SPArchive(object):
+    # reads an archive written by sp-server -a, even while it is still
+    # being written. runs are looked up by number without searching,
+    # and their captures are PackedCaptures viewing the mapped segment
+    # files directly, without copies. only committed runs are visible,
+    # and run numbers may skip where the server was restarted.
+
+    def __init__(self, path):
+        self.path = path
+        self.segments = {}
+        numbers = self.segment_numbers()
+        if not numbers:
+            raise ValueError('no archive segments in ' + path)
+        # the same for every segment
+        self.capacity = self.segment(numbers[-1])['capacity']
+
+    def close(self):
+        segments, self.segments = self.segments, {}
+        for seg in segments.values():
+            try:
+                seg['map'].close()
+            except BufferError:
+                # captures still point into it, so let them keep it
+                pass
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def segment_numbers(self):
+        numbers = []
+        for name in os.listdir(self.path):
+            if name.startswith('segment-') and name.endswith('.spa'):
+                try:
+                    numbers.append(int(name[len('segment-'):-len('.spa')]))
+                except ValueError:
+                    pass
+        return sorted(numbers)
+
+    def segment(self, number):
+        # the mapped segment, or None if it doesn't exist
+        seg = self.segments.get(number)
+        if seg is not None:
+            return seg
+        path = os.path.join(self.path, 'segment-{:08d}.spa'.format(number))
+        try:
+            f = open(path, 'rb')
+        except IOError as e:
+            if e.errno == errno.ENOENT:
+                return None
+            raise
+        with f:
+            m = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        (magic, version, entry_size, first_run, capacity, data_offset,
+         size, committed, pairs_length) = ARCHIVE_HEADER.unpack_from(m)
+        if magic != ARCHIVE_MAGIC or version != ARCHIVE_VERSION or entry_size != ARCHIVE_ENTRY.itemsize:
+            m.close()
+            raise ValueError(path + ' is not an archive segment')
+        pairs = m[ARCHIVE_HEADER.size:ARCHIVE_HEADER.size + pairs_length].decode('utf-8')
+        seg = {
+            'map': m,
+            'first_run': first_run,
+            'capacity': capacity,
+            'pairs': pairs.split('\n')[:-1],
+            'index': numpy.frombuffer(m, dtype=ARCHIVE_ENTRY, count=capacity, offset=ARCHIVE_HEADER_SIZE),
+        }
+        self.segments[number] = seg
+        return seg
+
+    def committed(self, seg):
+        # re-read every time, as the server moves it along
+        return ARCHIVE_COMMITTED.unpack_from(seg['map'], ARCHIVE_COMMITTED_OFFSET)[0]
+
+    def index(self, start=None, stop=None):
+        # the index entries of committed runs numbered in [start,
+        # stop), as a structured array (see ARCHIVE_ENTRY), for
+        # searching by stimulus, pair or time
+        parts = []
+        for number in self.segment_numbers():
+            seg = self.segment(number)
+            entries = seg['index'][:self.committed(seg)]
+            if start is not None:
+                entries = entries[entries['run'] >= start]
+            if stop is not None:
+                entries = entries[entries['run'] < stop]
+            parts.append(entries)
+        if not parts:
+            return numpy.zeros(0, dtype=ARCHIVE_ENTRY)
+        return numpy.concatenate(parts)
+
+    def __contains__(self, run):
+        try:
+            self[run]
+        except KeyError:
+            return False
+        return True
+
+    def __getitem__(self, run):
+        seg = self.segment(run // self.capacity)
+        slot = run % self.capacity
+        if run < 0 or seg is None or slot >= self.committed(seg):
+            raise KeyError(run)
+        e = seg['index'][slot]
+        packed = numpy.frombuffer(seg['map'], dtype=numpy.uint8, count=int(e['rows']) * int(e['row_length']), offset=int(e['offset']))
+        capture = PackedCapture(packed.reshape(int(e['rows']), int(e['row_length'])), int(e['columns']), bitorder='big')
+        pairs = seg['pairs']
+        pair = pairs[e['pair']] if e['pair'] < len(pairs) else int(e['pair'])
+        return ArchiveRun(int(e['run']), pair, int(e['stimulus']), int(e['time_ns']), int(e['run_ns']), capture)
+
+    def __iter__(self):
+        # every committed run, oldest first
+        for number in self.segment_numbers():
+            seg = self.segment(number)
+            for slot in range(self.committed(seg)):
+                yield self[seg['first_run'] + slot]
+
 class SPClient:
-    def __init__(self, host, port=8000):
+    # encoding, if given, is one of SERVER_ENCODINGS to ask for captures in
+    def __init__(self, host, port=8000, pair=None, timeout=None, encoding=None):
         self.host = host
         self.port = port
-
-    def run(self, inputs):
-        url = 'http://{}:{}/run'.format(self.host, self.port)
-
-        with urllib_request.urlopen(url, server_pack(inputs)) as resp:
-            outputs = server_unpack(resp.read())
-        
-        return outputs
+        self.pair = pair
+        self.timeout = timeout
+        self.encoding = encoding
+
+    def request(self, path, body, headers={}, **args):
+        # returns the response body and its Content-Encoding
+        url = 'http://{}:{}{}'.format(self.host, self.port, path)
+        args = [(k, v) for k, v in sorted(args.items()) if v is not None]
+        if args:
+            url += '?' + '&'.join('{}={}'.format(k, v) for k, v in args)
+
+        req = urllib_request.Request(url, body, headers)
+        if self.timeout is None:
+            resp = urllib_request.urlopen(req)
+        else:
+            resp = urllib_request.urlopen(req, timeout=self.timeout)
+        with resp:
+            return resp.read(), resp.headers.get('Content-Encoding')
+
+    def post(self, path, body, **args):
+        return self.request(path, body, **args)[0]
+
+    def post_capture(self, path, body, **args):
+        headers = {}
+        if self.encoding:
+            headers['Accept-Encoding'] = self.encoding
+        data, encoding = self.request(path, body, headers, **args)
+        return server_unpack_into(data, encoding=encoding)
+
+    def run(self, inputs=None, pair=None, stimulus=None, packed=False):
+        # either upload inputs, or run a stimulus id returned by store()
+        # packed returns a PackedCapture instead of unpacking
+        if pair is None:
+            pair = self.pair
+        if stimulus is not None:
+            body = b''
+        else:
+            body = server_pack(inputs)
+        if packed:
+            headers = {}
+            if self.encoding:
+                headers['Accept-Encoding'] = self.encoding
+            data, encoding = self.request('/run', body, headers, pair=pair, stimulus=stimulus)
+            return server_capture(data, encoding)
+        return self.post_capture('/run', body, pair=pair, stimulus=stimulus)
+
+    def run_repeated(self, repeat, inputs=None, majority=False, pair=None, stimulus=None):
+        # runs repeat times on the server. returns how many runs set
+        # each bit, as a (time, width) array, or if majority is set, a
+        # capture of the bits set in more than half the runs
+        if pair is None:
+            pair = self.pair
+        if stimulus is not None:
+            body = b''
+        else:
+            body = server_pack(inputs)
+        if majority:
+            return self.post_capture('/run', body, pair=pair, stimulus=stimulus, repeat=repeat, result='majority')
+        data = self.post('/run', body, pair=pair, stimulus=stimulus, repeat=repeat, result='counts')
+        rows, cols, runs = struct.unpack_from('>III', data)
+        counts = numpy.frombuffer(data, dtype='>u2', count=rows * cols, offset=12)
+        return counts.reshape(rows, cols).astype(numpy.uint16)
+
+    def check(self, inputs=None, expected=None, mask=None, limit=None, pair=None, stimulus=None):
+        # runs like run(), but compares the capture against expected on
+        # the server, ignoring bits set in mask. returns the number of
+        # mismatched bits, and an (N, 2) array of the first few
+        # mismatches as (timestep, bit), at most limit of them
+        if pair is None:
+            pair = self.pair
+        body = b''
+        if stimulus is None:
+            body += server_pack(inputs)
+        body += server_pack(expected)
+        if mask is not None:
+            body += server_pack(mask)
+        data = self.post('/check', body, pair=pair, stimulus=stimulus, limit=limit)
+        total, listed = struct.unpack_from('>II', data)
+        mismatches = numpy.frombuffer(data, dtype='>u4', count=2 * listed, offset=8)
+        return total, mismatches.reshape(listed, 2).astype(numpy.uint32)
+
+    def store(self, inputs, name=None):
+        # keeps inputs on the server for later runs, returning its id
+        return self.post('/stimulus', server_pack(inputs), name=name).decode('ascii')
+
+# the binary protocol spoken by sp-server -b / -u
+# every frame starts with: payload length, request id, op or status,
+# flags, and pair index (or SERVER_ANY_PAIR)
+server_frame_header = struct.Struct('>IIBBH')
+
+SERVER_ANY_PAIR = 0xffff
+
+SERVER_OP_RUN = 1
+SERVER_OP_STORE = 2
+SERVER_OP_RUN_STORED = 3
+
+SERVER_STATUS_OK = 0
+SERVER_STATUS_MESSAGES = {
+    1: 'bad request',
+    2: 'not found',
+    3: 'internal server error',
+}
+
+def recv_exactly(sock, size):
+    buf = bytearray(size)
+    view = memoryview(buf)
+    got = 0
+    while got < size:
+        amount = sock.recv_into(view[got:])
+        if not amount:
+            raise EOFError('server closed the connection')
+        got += amount
+    return buf
+
+class SPBinaryClient(object):
+    # encoding, if given, is one of SERVER_ENCODINGS to ask for captures in
+    # timeout, if given, bounds each send and receive, in seconds
+    def __init__(self, host=None, port=8001, path=None, pair=None, encoding=None, timeout=None):
+        if path is not None:
+            self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self.sock.settimeout(timeout)
+            self.sock.connect(path)
+        else:
+            self.sock = socket.create_connection((host, port), timeout)
+            self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.timeout = timeout
+        self.pair = pair
+        self.next_id = 0
+        self.send_buf = bytearray()
+        self.flags = SERVER_ENCODINGS.index(encoding) if encoding else 0
+
+    def close(self):
+        self.sock.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def send_frame(self, op, payload, pair=None, flags=0):
+        # payload is either bytes, or an array to server_pack
+        if pair is None:
+            pair = self.pair
+        if pair is None:
+            pair = SERVER_ANY_PAIR
+        request_id = self.next_id
+        self.next_id = (self.next_id + 1) & 0xffffffff
+
+        header_size = server_frame_header.size
+        if isinstance(payload, (bytes, bytearray)):
+            length = len(payload)
+            if len(self.send_buf) < header_size + length:
+                self.send_buf.extend(bytearray(header_size + length - len(self.send_buf)))
+            self.send_buf[header_size:header_size + length] = payload
+        else:
+            length = server_pack_into(payload, self.send_buf, header_size)
+        server_frame_header.pack_into(self.send_buf, 0, length, request_id, op, flags, pair)
+        self.sock.sendall(memoryview(self.send_buf)[:header_size + length])
+        return request_id
+
+    def recv_frame(self):
+        header = recv_exactly(self.sock, server_frame_header.size)
+        length, request_id, status, flags, pair = server_frame_header.unpack(bytes(header))
+        payload = recv_exactly(self.sock, length)
+        if status != SERVER_STATUS_OK:
+            raise RuntimeError('server error: ' + SERVER_STATUS_MESSAGES.get(status, str(status)))
+        return request_id, pair, flags, payload
+
+    def request(self, op, payload, pair=None, flags=0):
+        # returns the response payload and flags
+        request_id = self.send_frame(op, payload, pair=pair, flags=flags)
+        response_id, _, flags, payload = self.recv_frame()
+        if response_id != request_id:
+            raise RuntimeError('mismatched response from server')
+        return payload, flags
+
+    def run(self, inputs=None, pair=None, stimulus=None, packed=False):
+        # either upload inputs, or run a stimulus id returned by store()
+        # packed returns a PackedCapture instead of unpacking
+        if stimulus is not None:
+            data, flags = self.request(SERVER_OP_RUN_STORED, stimulus.encode('ascii'), pair=pair, flags=self.flags)
+        else:
+            data, flags = self.request(SERVER_OP_RUN, inputs, pair=pair, flags=self.flags)
+        if packed:
+            return server_capture(data, SERVER_ENCODINGS[flags])
+        return server_unpack_into(data, encoding=SERVER_ENCODINGS[flags])
+
+    def store(self, inputs, name=None):
+        # keeps inputs on the server for later runs, returning its id
+        name = (name or '').encode('ascii')
+        payload = struct.pack('>H', len(name)) + name + server_pack(inputs)
+        return bytes(self.request(SERVER_OP_STORE, payload)[0]).decode('ascii')
+
+class SPAsyncClient(SPBinaryClient):
+    # keeps up to max_in_flight runs queued on the server at once.
+    # submit() returns a Future for each run; a reader thread fills
+    # them in as responses arrive, in whatever order they arrive.
+    # timeout bounds how long run() and store() wait for a response.
+    def __init__(self, host=None, port=8001, path=None, pair=None, max_in_flight=16, encoding=None, timeout=None):
+        super(SPAsyncClient, self).__init__(host=host, port=port, path=path, pair=pair, encoding=encoding, timeout=timeout)
+        # the reader sits in recv between responses, however long that is
+        self.sock.settimeout(None)
+        self.pending = {}
+        self.pending_lock = threading.Lock()
+        self.send_lock = threading.Lock()
+        self.slots = threading.Semaphore(max_in_flight)
+        self.error = None
+
+        # only touched by the reader thread
+        self.recv_buf = bytearray()
+        self.scratch = None
+
+        self.reader = threading.Thread(target=self.read_loop)
+        self.reader.daemon = True
+        self.reader.start()
+
+    def close(self):
+        try:
+            self.sock.shutdown(socket.SHUT_RDWR)
+        except socket.error:
+            pass
+        self.reader.join()
+        super(SPAsyncClient, self).close()
+
+    def submit(self, inputs=None, pair=None, out=None, stimulus=None):
+        # out, if given, is a preallocated array to unpack the result into
+        # stimulus, if given, is an id returned by store() to run instead
+        self.slots.acquire()
+        future = Future()
+        with self.send_lock:
+            with self.pending_lock:
+                if self.error is not None:
+                    self.slots.release()
+                    raise self.error
+                request_id = self.next_id
+                self.pending[request_id] = (future, out, False)
+            try:
+                if stimulus is not None:
+                    self.send_frame(SERVER_OP_RUN_STORED, stimulus.encode('ascii'), pair=pair, flags=self.flags)
+                else:
+                    self.send_frame(SERVER_OP_RUN, inputs, pair=pair, flags=self.flags)
+            except Exception:
+                with self.pending_lock:
+                    self.pending.pop(request_id, None)
+                self.slots.release()
+                raise
+        return future
+
+    def run(self, inputs=None, pair=None, out=None, stimulus=None):
+        return self.submit(inputs, pair=pair, out=out, stimulus=stimulus).result(self.timeout)
+
+    def store(self, inputs, name=None):
+        # stores go through the same reader thread as runs
+        name = (name or '').encode('ascii')
+        payload = struct.pack('>H', len(name)) + name + server_pack(inputs)
+        self.slots.acquire()
+        future = Future()
+        with self.send_lock:
+            with self.pending_lock:
+                if self.error is not None:
+                    self.slots.release()
+                    raise self.error
+                request_id = self.next_id
+                self.pending[request_id] = (future, None, True)
+            self.send_frame(SERVER_OP_STORE, payload)
+        return future.result(self.timeout).decode('ascii')
+
+    def map(self, stack, pair=None, out=None):
+        # runs every element of stack, returning results in order
+        # out, if given, is a preallocated (len(stack), time, width) array
+        futures = []
+        for i, inputs in enumerate(stack):
+            futures.append(self.submit(inputs, pair=pair, out=None if out is None else out[i]))
+        return [f.result() for f in futures]
+
+    def recv_into_buf(self, size):
+        if len(self.recv_buf) < size:
+            self.recv_buf = bytearray(size)
+        view = memoryview(self.recv_buf)[:size]
+        got = 0
+        while got < size:
+            amount = self.sock.recv_into(view[got:])
+            if not amount:
+                raise EOFError('server closed the connection')
+            got += amount
+        return view
+
+    def read_loop(self):
+        try:
+            while True:
+                header = self.recv_into_buf(server_frame_header.size)
+                length, request_id, status, flags, pair = server_frame_header.unpack(header.tobytes())
+                payload = self.recv_into_buf(length)
+
+                with self.pending_lock:
+                    future, out, raw = self.pending.pop(request_id, (None, None, False))
+                if future is None:
+                    continue
+                self.slots.release()
+
+                if status != SERVER_STATUS_OK:
+                    future.set_exception(RuntimeError('server error: ' + SERVER_STATUS_MESSAGES.get(status, str(status))))
+                    continue
+                if raw:
+                    # payload lives in the reused receive buffer
+                    future.set_result(payload.tobytes())
+                    continue
+                try:
+                    if self.scratch is None or self.scratch.size < length * 8:
+                        self.scratch = numpy.empty(length * 8, dtype=numpy.uint8)
+                    future.set_result(server_unpack_into(payload, out=out, scratch=self.scratch, encoding=SERVER_ENCODINGS[flags]))
+                except Exception as e:
+                    future.set_exception(e)
+        except Exception as e:
+            with self.pending_lock:
+                self.error = e
+                pending = list(self.pending.values())
+                self.pending.clear()
+            for future, _, _ in pending:
+                future.set_exception(e)
+                self.slots.release()
+
+class SPCluster(object):
+    # runs a stack of stimuli across many servers, returning results in
+    # order. servers are 'host:port' strings, (host, port) tuples, or
+    # anything with a run(inputs) method.
+    #
+    # each server starts with a contiguous share of the stack, and
+    # steals from the back of the biggest remaining share when it runs
+    # dry. once nothing is left to steal, idle servers duplicate runs
+    # that have taken straggler_factor times longer than average. a
+    # server that raises is dropped, and its run goes back to be stolen.
+    def __init__(self, servers, client=SPClient, timeout=30, straggler_factor=3.0):
+        self.clients = []
+        for server in servers:
+            if hasattr(server, 'run'):
+                self.clients.append(server)
+                continue
+            if isinstance(server, str):
+                host, port = server.rsplit(':', 1)
+                server = (host, int(port))
+            self.clients.append(client(server[0], server[1], timeout=timeout))
+        if not self.clients:
+            raise ValueError('no servers given')
+        self.straggler_factor = straggler_factor
+        self.dead = set()
+
+    def map(self, stack):
+        count = len(stack)
+        results = [None] * count
+        if not count:
+            return results
+
+        cond = threading.Condition()
+        clients = [c for i, c in enumerate(self.clients) if i not in self.dead]
+        if not clients:
+            raise RuntimeError('every server is dead')
+        shares = []
+        for i in range(len(clients)):
+            start = i * count // len(clients)
+            end = (i + 1) * count // len(clients)
+            shares.append(collections.deque(range(start, end)))
+        # index -> (start time, set of workers running it)
+        running = {}
+        state = {'remaining': count, 'alive': len(clients), 'time': 0.0, 'finished': 0}
+
+        def next_index(me):
+            # called with cond held. returns an index, or None to quit.
+            while state['remaining'] and state['alive']:
+                if shares[me]:
+                    return shares[me].popleft()
+                victim = max(range(len(shares)), key=lambda i: len(shares[i]))
+                if shares[victim]:
+                    return shares[victim].pop()
+
+                if state['finished']:
+                    now = time.time()
+                    limit = self.straggler_factor * state['time'] / state['finished']
+                    slow = [(started, i) for i, (started, who) in running.items()
+                            if me not in who and len(who) == 1 and now - started > limit]
+                    if slow:
+                        return min(slow)[1]
+                cond.wait(0.1)
+            return None
+
+        def work(me):
+            client = clients[me]
+            while True:
+                with cond:
+                    index = next_index(me)
+                    if index is None:
+                        return
+                    started, who = running.setdefault(index, (time.time(), set()))
+                    who.add(me)
+
+                try:
+                    outputs = client.run(stack[index])
+                except Exception:
+                    with cond:
+                        self.dead.add(self.clients.index(client))
+                        state['alive'] -= 1
+                        who.discard(me)
+                        if results[index] is None and not who:
+                            del running[index]
+                            shares[me].appendleft(index)
+                        # the dead share is left for others to steal
+                        cond.notify_all()
+                    return
+
+                with cond:
+                    who.discard(me)
+                    if results[index] is None:
+                        results[index] = outputs
+                        state['remaining'] -= 1
+                        state['finished'] += 1
+                        state['time'] += time.time() - started
+                        running.pop(index, None)
+                    cond.notify_all()
+
+        threads = [threading.Thread(target=work, args=(i,)) for i in range(len(clients))]
+        for t in threads:
+            t.daemon = True
+            t.start()
+        for t in threads:
+            t.join()
+
+        if state['remaining']:
+            raise RuntimeError('every server died with {} runs left'.format(state['remaining']))
+        return results
+
+def local_cluster(count, sample_width=32, time_bits=10, model=None, host='127.0.0.1'):
+    # starts count SPServers on ephemeral ports, each backed by a
+    # ModelPair, for trying out SPCluster without any boards.
+    # returns a list of 'host:port' strings, and the servers themselves
+    # (call shutdown() on each when done)
+    addresses = []
+    servers = []
+    for _ in range(count):
+        server = SPServer(ModelPair(sample_width, time_bits, model), host=host, port=0, quiet=True)
+        thread = threading.Thread(target=server.serve_forever)
+        thread.daemon = True
+        thread.start()
+        addresses.append('{}:{}'.format(host, server.server_address[1]))
+        servers.append(server)
+    return addresses, servers
 
 class SPServer(http_server.HTTPServer):
     class RequestHandler(http_server.BaseHTTPRequestHandler):
@@ -328,24 +1502,126 @@ class SPServer(http_server.HTTPServer):
             self.send_header('Content-Type', 'application/octet-stream')
             self.end_headers()
             self.wfile.write(outputs)
+
+        def log_message(self, *args):
+            if not self.server.quiet:
+                http_server.BaseHTTPRequestHandler.log_message(self, *args)
     
-    def __init__(self, pair, host='', port=8000):
+    def __init__(self, pair, host='', port=8000, quiet=False):
         self.pair = pair
+        self.quiet = quiet
         super(SPServer, self).__init__((host, port), self.RequestHandler)
 
+class ThreadedSPServer(socketserver.ThreadingMixIn, SPServer):
+    # like SPServer, but every connection gets its own thread and is
+    # kept alive between requests. only the run itself is serialized,
+    # so reading uploads and sending replies overlap with other runs.
+    daemon_threads = True
+
+    class RequestHandler(SPServer.RequestHandler):
+        protocol_version = 'HTTP/1.1'
+
+        def setup(self):
+            SPServer.RequestHandler.setup(self)
+            # reused for every request on this connection
+            self.body = bytearray(0)
+            self.reply = bytearray(0)
+            self.inputs = None
+            self.scratch = None
+
+        def do_POST(self):
+            try:
+                if self.path == '/run':
+                    self.handle_run()
+                else:
+                    # the body is still unread, so the connection can't
+                    # be reused
+                    self.close_connection = True
+                    self.send_text(404, 'not found')
+            except Exception as e:
+                # likewise, as we don't know how much of it was read
+                self.close_connection = True
+                self.send_text(500, str(e))
+
+        def send_text(self, code, text):
+            # keep-alive needs a Content-Length on everything
+            body = text.encode('utf-8')
+            self.send_response(code)
+            self.send_header('Content-Type', 'text/plain; charset=utf-8')
+            self.send_header('Content-Length', str(len(body)))
+            if self.close_connection:
+                self.send_header('Connection', 'close')
+            self.end_headers()
+            self.wfile.write(body)
+
+        def read_body(self):
+            length = int(self.headers['Content-Length'])
+            if len(self.body) < length:
+                self.body = bytearray(length)
+            view = memoryview(self.body)[:length]
+            got = 0
+            while got < length:
+                n = self.rfile.readinto(view[got:])
+                if not n:
+                    raise IOError('connection closed mid-upload')
+                got += n
+            return view
+
+        def handle_run(self):
+            body = self.read_body()
+            rows, cols = struct.unpack_from('>II', body)
+            if self.inputs is None or self.inputs.shape != (rows, cols):
+                self.inputs = numpy.empty((rows, cols), dtype=numpy.uint8)
+            padded = rows * 8 * ((cols + 7) // 8)
+            if self.scratch is None or self.scratch.size < padded:
+                self.scratch = numpy.empty(padded, dtype=numpy.uint8)
+            inputs = server_unpack_into(body, out=self.inputs, scratch=self.scratch)
+
+            with self.server.hardware:
+                outputs = self.server.pair.run(inputs)
+
+            length = server_pack_into(outputs, self.reply)
+            self.send_response(200)
+            self.send_header('Content-Type', 'application/octet-stream')
+            self.send_header('Content-Length', str(length))
+            self.end_headers()
+            self.wfile.write(memoryview(self.reply)[:length])
+
+    def __init__(self, pair, host='', port=8000, quiet=False):
+        self.hardware = threading.Lock()
+        super(ThreadedSPServer, self).__init__(pair, host=host, port=port, quiet=quiet)
+
 if __name__ == '__main__':
     parser = argparse.ArgumentParser()
-    parser.add_argument('sampler')
-    parser.add_argument('player')
+    parser.add_argument('sampler', nargs='?')
+    parser.add_argument('player', nargs='?')
     parser.add_argument('--server', action='store_true', default=False, help='run a sampler/player server, instead of feeding a pulse')
+    parser.add_argument('--threaded', action='store_true', default=False, help='with --server, serve each connection on its own thread, with keep-alive')
     parser.add_argument('--port', type=int, default=8000)
     parser.add_argument('--host', type=str, default='')
+    parser.add_argument('--cluster-test', type=int, metavar='N', help='run random stimuli across N local model servers, instead of using hardware')
 
     args = parser.parse_args()
+
+    if args.cluster_test:
+        addresses, servers = local_cluster(args.cluster_test)
+        stack = [numpy.random.randint(0, 2, size=(1024, 32)).astype(numpy.uint8) for _ in range(16 * args.cluster_test)]
+        start = time.time()
+        results = SPCluster(addresses).map(stack)
+        elapsed = time.time() - start
+        for server in servers:
+            server.shutdown()
+        ok = all((r == s).all() for r, s in zip(results, stack))
+        print('{} runs across {} servers in {:.3f} seconds: {}'.format(len(stack), len(addresses), elapsed, 'ok' if ok else 'MISMATCH'))
+        sys.exit(0 if ok else 1)
+
+    if not args.sampler or not args.player:
+        parser.error('sampler and player are required')
     pair = SPPair(args.sampler, args.player)
 
     if args.server:
-        server = SPServer(pair, host=args.host, port=args.port)
+        server_class = ThreadedSPServer if args.threaded else SPServer
+        server = server_class(pair, host=args.host, port=args.port)
         server.serve_forever()
 
     inputs = numpy.array([[0], [1], [0]])
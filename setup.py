@@ -0,0 +1,20 @@
+# builds osuqlsp, and the optional _osuqlsp extension it uses when present
+#   python setup.py build_ext --inplace
+
+try:
+    from setuptools import setup, Extension
+except ImportError:
+    from distutils.core import setup, Extension
+
+setup(
+    name='osuqlsp',
+    version='1.0',
+    description='Sampler/Player interface',
+    py_modules=['osuqlsp'],
+    ext_modules=[
+        Extension('_osuqlsp',
+                  sources=['_osuqlsp.c', 'libosuqlsp.c'],
+                  depends=['libosuqlsp.h', 'linux/ioctls.h'],
+                  extra_compile_args=['-O3']),
+    ],
+)
@@ -4,501 +4,4263 @@
 #include <sys/ioctl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/timeb.h>
 
 #include <microhttpd.h>
 
-#include "linux/ioctls.h"
+#include "libosuqlsp.h"
 
-#define STRBUFSIZE 512
+/*
+ * timing, latency histograms, and building up text responses
+ */
+
+/* bucket i counts durations under 2^i nanoseconds (and over the last) */
+#define SP_HISTOGRAM_BUCKETS 40
+
+typedef struct {
+    uint64_t buckets[SP_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} SPHistogram;
+
+void sp_histogram_record(SPHistogram* self, uint64_t ns) {
+    unsigned int i = 0;
+    while (i < SP_HISTOGRAM_BUCKETS - 1 && (ns >> i))
+        i++;
+    self->buckets[i]++;
+
+    if (!self->count || ns < self->min)
+        self->min = ns;
+    if (ns > self->max)
+        self->max = ns;
+    self->count++;
+    self->sum += ns;
+}
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} SPText;
+
+void sp_text_printf(SPText* self, const char* fmt, ...) {
+    va_list args;
+    int needed;
+
+    va_start(args, fmt);
+    needed = vsnprintf(self->data + self->length, self->capacity - self->length, fmt, args);
+    va_end(args);
+    if (needed < 0)
+        return;
+
+    if (self->length + needed + 1 > self->capacity) {
+        size_t capacity = self->capacity ? self->capacity : STRBUFSIZE;
+        char* data;
+        while (capacity < self->length + needed + 1)
+            capacity *= 2;
+        data = realloc(self->data, capacity);
+        if (!data)
+            return;
+        self->data = data;
+        self->capacity = capacity;
+
+        va_start(args, fmt);
+        vsnprintf(self->data + self->length, self->capacity - self->length, fmt, args);
+        va_end(args);
+    }
+    self->length += needed;
+}
+
+void sp_histogram_print(SPHistogram* self, SPText* out) {
+    unsigned int i;
+    if (!self->count) {
+        sp_text_printf(out, "  no runs yet\n");
+        return;
+    }
+
+    sp_text_printf(out, "  %llu runs, min %.1f us, mean %.1f us, max %.1f us\n",
+                   (unsigned long long)self->count, self->min / 1000.0,
+                   (double)self->sum / self->count / 1000.0, self->max / 1000.0);
+    for (i = 0; i < SP_HISTOGRAM_BUCKETS; i++) {
+        if (!self->buckets[i])
+            continue;
+        if (i == SP_HISTOGRAM_BUCKETS - 1)
+            sp_text_printf(out, "  %12s us: %llu\n", "more", (unsigned long long)self->buckets[i]);
+        else
+            sp_text_printf(out, "  < %10.1f us: %llu\n", (1ull << i) / 1000.0, (unsigned long long)self->buckets[i]);
+    }
+}
+
+/*
+ * lock-free histograms for /metrics
+ */
+
+/* log-linear buckets, like HdrHistogram: every power of two is split
+ * into 2^SP_METRIC_SUB_BITS linear buckets, so any value is within
+ * about 12% of its bucket's bounds
+ */
+#define SP_METRIC_SUB_BITS 3
+#define SP_METRIC_SUB (1 << SP_METRIC_SUB_BITS)
+
+/* values at or above 2^SP_METRIC_MAX_BITS ns (about 18 minutes) all
+ * land in the last bucket
+ */
+#define SP_METRIC_MAX_BITS 40
+#define SP_METRIC_BUCKETS ((SP_METRIC_MAX_BITS - SP_METRIC_SUB_BITS + 1) * SP_METRIC_SUB)
+
+/* the power-of-two bucket bounds /metrics reports, in ns */
+#define SP_METRIC_REPORT_MIN_BITS 10
+#define SP_METRIC_REPORT_MAX_BITS 36
+
+/* where the time goes in a run, see sp_worker_run */
+enum {
+    SP_STAGE_UPLOAD,
+    SP_STAGE_LEASE,
+    SP_STAGE_WRITE,
+    SP_STAGE_WAIT,
+    SP_STAGE_READ,
+    SP_STAGE_SWAP,
+    SP_STAGE_RESPONSE,
+    SP_STAGES
+};
+
+static const char* sp_stage_names[SP_STAGES] = {
+    "upload",
+    "lease",
+    "write",
+    "wait",
+    "read",
+    "swap",
+    "response",
+};
+
+/* every field is updated with sp_counter_add, so any thread may record */
+typedef struct {
+    uint64_t buckets[SP_METRIC_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+} SPMetricHistogram;
+
+static unsigned int sp_metric_bucket(uint64_t ns) {
+    unsigned int exponent;
+    if (ns < SP_METRIC_SUB)
+        return ns;
+    exponent = 63 - __builtin_clzll(ns);
+    if (exponent >= SP_METRIC_MAX_BITS)
+        return SP_METRIC_BUCKETS - 1;
+    return (exponent - SP_METRIC_SUB_BITS + 1) * SP_METRIC_SUB + ((ns >> (exponent - SP_METRIC_SUB_BITS)) & (SP_METRIC_SUB - 1));
+}
+
+/* the smallest value too big for bucket i */
+static uint64_t sp_metric_bucket_limit(unsigned int i) {
+    unsigned int shift;
+    if (i < SP_METRIC_SUB)
+        return i + 1;
+    shift = i / SP_METRIC_SUB - 1;
+    return (uint64_t)(SP_METRIC_SUB + i % SP_METRIC_SUB + 1) << shift;
+}
+
+void sp_metric_record(SPMetricHistogram* self, uint64_t ns) {
+    sp_counter_add(&self->buckets[sp_metric_bucket(ns)], 1);
+    sp_counter_add(&self->count, 1);
+    sp_counter_add(&self->sum, ns);
+}
+
+/* prints the histogram in Prometheus text format as name, in seconds,
+ * with the given labels (which may be empty)
+ */
+void sp_metric_print(SPMetricHistogram* self, SPText* out, const char* name, const char* labels) {
+    uint64_t buckets[SP_METRIC_BUCKETS];
+    uint64_t count, cumulative = 0;
+    unsigned int i, bits;
+    const char* sep = *labels ? "," : "";
+
+    for (i = 0; i < SP_METRIC_BUCKETS; i++)
+        buckets[i] = sp_counter_get(&self->buckets[i]);
+    count = sp_counter_get(&self->count);
+
+    /* power-of-two bounds fall on bucket boundaries */
+    i = 0;
+    for (bits = SP_METRIC_REPORT_MIN_BITS; bits <= SP_METRIC_REPORT_MAX_BITS; bits++) {
+        for (; i < SP_METRIC_BUCKETS && sp_metric_bucket_limit(i) <= (1ull << bits); i++)
+            cumulative += buckets[i];
+        sp_text_printf(out, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels, sep,
+                       (1ull << bits) / 1e9, (unsigned long long)cumulative);
+    }
+    sp_text_printf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, (unsigned long long)count);
+    sp_text_printf(out, "%s_sum{%s} %.9g\n", name, labels, sp_counter_get(&self->sum) / 1e9);
+    sp_text_printf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long)count);
+}
+
+/* estimates quantile q from the histogram, in ns, using bucket limits */
+uint64_t sp_metric_quantile(SPMetricHistogram* self, double q) {
+    uint64_t count = sp_counter_get(&self->count);
+    uint64_t target, seen = 0;
+    unsigned int i;
+
+    if (!count)
+        return 0;
+    target = q * count;
+    if (target < 1)
+        target = 1;
+    for (i = 0; i < SP_METRIC_BUCKETS; i++) {
+        seen += sp_counter_get(&self->buckets[i]);
+        if (seen >= target)
+            return sp_metric_bucket_limit(i) - 1;
+    }
+    return sp_metric_bucket_limit(SP_METRIC_BUCKETS - 1);
+}
+
+/*
+ * hashing, and a small LRU cache keyed by hash
+ */
+
+static inline uint64_t sp_hash_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+/* a quick, non-cryptographic 64-bit hash. never returns 0, so 0 can
+ * mean "no hash" */
+uint64_t sp_hash(const uint8_t* data, size_t length) {
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ length;
+    uint64_t v;
+
+    while (length >= 8) {
+        memcpy(&v, data, 8);
+        h ^= sp_hash_mix(v);
+        h = (h << 27 | h >> 37) * 0x9e3779b97f4a7c15ull;
+        data += 8;
+        length -= 8;
+    }
+    v = 0;
+    memcpy(&v, data, length);
+    h ^= sp_hash_mix(v);
+
+    h = sp_hash_mix(h);
+    return h ? h : 1;
+}
+
+/* a second 64-bit hash, unrelated to sp_hash, so that a cache hit on
+ * the sp_hash of one input can be told apart from a collision with
+ * another. see sp_cache_get */
+uint64_t sp_hash_check(const uint8_t* data, size_t length) {
+    uint64_t h = 0xc2b2ae3d27d4eb4full ^ length;
+    uint64_t v;
+
+    while (length >= 8) {
+        memcpy(&v, data, 8);
+        h = (h ^ v) * 0x94d049bb133111ebull;
+        h = h << 31 | h >> 33;
+        data += 8;
+        length -= 8;
+    }
+    v = 0;
+    memcpy(&v, data, length);
+    h = (h ^ v) * 0x94d049bb133111ebull;
+
+    return sp_hash_mix(h ^ 0x5851f42d4c957f2dull);
+}
+
+#define SP_CACHE_BUCKETS 4096
+
+typedef struct _SPCacheEntry SPCacheEntry;
+
+struct _SPCacheEntry {
+    uint64_t key;
+    /* sp_hash_check of whatever key was hashed from, and its length */
+    uint64_t check;
+    size_t key_length;
+    SPCacheEntry* chain;
+    SPCacheEntry* newer;
+    SPCacheEntry* older;
+
+    /* held by the cache while linked in, and by each sp_cache_get */
+    unsigned int refs;
+
+    uint8_t* data;
+    size_t length;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    SPCacheEntry* buckets[SP_CACHE_BUCKETS];
+    SPCacheEntry* newest;
+    SPCacheEntry* oldest;
+
+    size_t used;
+    size_t budget;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} SPCache;
+
+static void sp_cache_entry_unref(SPCacheEntry* entry) {
+    if (--entry->refs == 0) {
+        free(entry->data);
+        free(entry);
+    }
+}
+
+/* unlinks an entry, with the lock held */
+static void sp_cache_remove(SPCache* self, SPCacheEntry* entry) {
+    SPCacheEntry** link = &self->buckets[entry->key % SP_CACHE_BUCKETS];
+    while (*link != entry)
+        link = &(*link)->chain;
+    *link = entry->chain;
+
+    if (entry->newer)
+        entry->newer->older = entry->older;
+    else
+        self->newest = entry->older;
+    if (entry->older)
+        entry->older->newer = entry->newer;
+    else
+        self->oldest = entry->newer;
+
+    self->used -= entry->length;
+    sp_cache_entry_unref(entry);
+}
+
+SPCache* sp_cache_new(size_t budget) {
+    SPCache* self = calloc(1, sizeof(SPCache));
+    if (!self)
+        return NULL;
+    pthread_mutex_init(&self->lock, NULL);
+    self->budget = budget;
+    return self;
+}
+
+void sp_cache_free(SPCache* self) {
+    if (!self)
+        return;
+    while (self->oldest)
+        sp_cache_remove(self, self->oldest);
+    pthread_mutex_destroy(&self->lock);
+    free(self);
+}
+
+/* an entry only matches if its check and key_length do too, so
+ * inputs whose keys happen to collide don't get each other's data
+ */
+static int sp_cache_entry_matches(SPCacheEntry* entry, uint64_t key, uint64_t check, size_t key_length) {
+    return entry->key == key && entry->check == check && entry->key_length == key_length;
+}
+
+/* looks up key, and marks it as recently used
+ * the entry stays valid until handed to sp_cache_unref, even if evicted
+ */
+SPCacheEntry* sp_cache_get(SPCache* self, uint64_t key, uint64_t check, size_t key_length) {
+    SPCacheEntry* entry;
+
+    pthread_mutex_lock(&self->lock);
+    for (entry = self->buckets[key % SP_CACHE_BUCKETS]; entry; entry = entry->chain) {
+        if (sp_cache_entry_matches(entry, key, check, key_length))
+            break;
+    }
+    if (entry) {
+        self->hits++;
+        entry->refs++;
+        if (entry != self->newest) {
+            /* move to the front */
+            entry->newer->older = entry->older;
+            if (entry->older)
+                entry->older->newer = entry->newer;
+            else
+                self->oldest = entry->newer;
+            entry->older = self->newest;
+            entry->newer = NULL;
+            self->newest->newer = entry;
+            self->newest = entry;
+        }
+    } else {
+        self->misses++;
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    return entry;
+}
+
+void sp_cache_unref(SPCache* self, SPCacheEntry* entry) {
+    pthread_mutex_lock(&self->lock);
+    sp_cache_entry_unref(entry);
+    pthread_mutex_unlock(&self->lock);
+}
+
+/* stores data (which must be malloc'd) under key, check and
+ * key_length, as matched by sp_cache_get, replacing anything
+ * already there and evicting old entries to stay under budget. the
+ * cache takes ownership of data either way.
+ * returns 0 if it could not be stored
+ */
+int sp_cache_put(SPCache* self, uint64_t key, uint64_t check, size_t key_length, uint8_t* data, size_t length) {
+    SPCacheEntry* entry;
+    SPCacheEntry** bucket = &self->buckets[key % SP_CACHE_BUCKETS];
+
+    if (length > self->budget) {
+        free(data);
+        return 0;
+    }
+    entry = calloc(1, sizeof(SPCacheEntry));
+    if (!entry) {
+        free(data);
+        return 0;
+    }
+    entry->key = key;
+    entry->check = check;
+    entry->key_length = key_length;
+    entry->refs = 1;
+    entry->data = data;
+    entry->length = length;
+
+    pthread_mutex_lock(&self->lock);
+    {
+        SPCacheEntry* old;
+        for (old = *bucket; old; old = old->chain) {
+            if (sp_cache_entry_matches(old, key, check, key_length)) {
+                sp_cache_remove(self, old);
+                break;
+            }
+        }
+    }
+    while (self->oldest && self->used + length > self->budget) {
+        sp_cache_remove(self, self->oldest);
+        self->evictions++;
+    }
+
+    entry->chain = *bucket;
+    *bucket = entry;
+    entry->older = self->newest;
+    if (self->newest)
+        self->newest->newer = entry;
+    else
+        self->oldest = entry;
+    self->newest = entry;
+    self->used += length;
+    pthread_mutex_unlock(&self->lock);
+
+    return 1;
+}
+
+/*
+ * comparing captures against expected outputs
+ */
+
+/* how many mismatches a check lists, by default and at most */
+#define SP_CHECK_DEFAULT_LIMIT 64
+#define SP_CHECK_MAX_LIMIT (1024 * 1024)
+
+/* bytes compared per step of sp_check_compare */
+#define SP_CHECK_BLOCK 64
+
+static inline uint32_t sp_get_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void sp_put_be32(uint8_t* p, uint32_t v) {
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >>  8) & 0xff;
+    p[3] = (v >>  0) & 0xff;
+}
+
+/* turns a don't-care mask in care (or garbage, if has_mask is 0) into
+ * a mask of the bits to compare: those in the first rows rows and bits
+ * columns that the don't-care mask does not cover
+ */
+void sp_check_care(SPDevice* dev, uint8_t* care, uint32_t rows, uint32_t bits, int has_mask) {
+    uint32_t row, column, full = bits / 8;
+    uint8_t partial = (0xff00 >> (bits % 8)) & 0xff;
+
+    for (row = 0; row < dev->time_length; row++) {
+        uint8_t* c = care + row * dev->sample_length;
+        for (column = 0; column < dev->sample_length; column++) {
+            uint8_t region = 0;
+            if (row < rows)
+                region = column < full ? 0xff : (column == full ? partial : 0);
+            c[column] = has_mask ? (region & ~c[column]) : region;
+        }
+    }
+}
+
+static void sp_check_list(SPDevice* dev, size_t offset, uint8_t diff, uint32_t* list, uint32_t limit, uint32_t* listed) {
+    unsigned int k;
+    for (k = 0; k < 8 && *listed < limit; k++) {
+        if (diff & (0x80 >> k)) {
+            list[2 * *listed] = offset / dev->sample_length;
+            list[2 * *listed + 1] = (offset % dev->sample_length) * 8 + k;
+            (*listed)++;
+        }
+    }
+}
+
+/* compares got against expected over the bits set in care, listing the
+ * first limit mismatches as (timestep, bit) pairs
+ * returns the total number of mismatched bits
+ */
+uint64_t sp_check_compare(SPDevice* dev, const uint8_t* got, const uint8_t* expected, const uint8_t* care, uint32_t* list, uint32_t limit, uint32_t* listed) {
+    uint64_t total = 0;
+    size_t i = 0, j;
+
+    *listed = 0;
+
+    /* whole blocks a word at a time, so a passing block costs only a
+     * few xors and ands
+     */
+    for (; i + SP_CHECK_BLOCK <= dev->length; i += SP_CHECK_BLOCK) {
+        uint64_t diff[SP_CHECK_BLOCK / 8];
+        uint64_t any = 0;
+
+        for (j = 0; j < SP_CHECK_BLOCK / 8; j++) {
+            uint64_t a, b, c;
+            memcpy(&a, got + i + 8 * j, 8);
+            memcpy(&b, expected + i + 8 * j, 8);
+            memcpy(&c, care + i + 8 * j, 8);
+            diff[j] = (a ^ b) & c;
+            any |= diff[j];
+        }
+        if (!any)
+            continue;
+
+        for (j = 0; j < SP_CHECK_BLOCK / 8; j++)
+            total += __builtin_popcountll(diff[j]);
+        for (j = i; j < i + SP_CHECK_BLOCK && *listed < limit; j++)
+            sp_check_list(dev, j, (got[j] ^ expected[j]) & care[j], list, limit, listed);
+    }
+
+    /* and whatever is left a byte at a time */
+    for (; i < dev->length; i++) {
+        uint8_t diff = (got[i] ^ expected[i]) & care[i];
+        if (!diff)
+            continue;
+        total += __builtin_popcount(diff);
+        sp_check_list(dev, i, diff, list, limit, listed);
+    }
+
+    return total;
+}
+
+/* builds the reply to a check, all big-endian u32s: the number of
+ * mismatched bits (saturated), the number listed, then each listed
+ * (timestep, bit) pair. returns NULL if out of memory.
+ */
+uint8_t* sp_check_report(SPDevice* dev, const uint8_t* got, const uint8_t* expected, const uint8_t* care, uint32_t limit, size_t* length) {
+    uint32_t* list = NULL;
+    uint32_t listed, i;
+    uint64_t total;
+    uint8_t* report;
+
+    if (limit) {
+        list = malloc(2 * sizeof(uint32_t) * limit);
+        if (!list)
+            return NULL;
+    }
+    total = sp_check_compare(dev, got, expected, care, list, limit, &listed);
+
+    *length = 8 + 8 * (size_t)listed;
+    report = malloc(*length);
+    if (report) {
+        sp_put_be32(report, total > 0xffffffff ? 0xffffffff : total);
+        sp_put_be32(report + 4, listed);
+        for (i = 0; i < 2 * listed; i++)
+            sp_put_be32(report + 8 + 4 * i, list[i]);
+    }
+    free(list);
+    return report;
+}
+
+/*
+ * counting ones in every bit over repeated runs
+ */
+
+/* most runs one request may ask for, so counts fit in a u16 */
+#define SP_REPEAT_MAX 65535
+
+/* words added per step of sp_counts_add */
+#define SP_COUNTS_BLOCK 8
+
+/* bit-sliced counters: bit p of the count for every bit of capture
+ * word w lives in planes[p * words + w], so adding a capture is a
+ * ripple-carry add done 64 bits at a time
+ */
+typedef struct {
+    size_t length;
+    size_t words;
+    unsigned int planes_length;
+    uint64_t* planes;
+    unsigned int runs;
+} SPCounts;
+
+/* counters for captures of length bytes, that can count to max */
+SPCounts* sp_counts_new(size_t length, unsigned int max) {
+    SPCounts* self = calloc(1, sizeof(SPCounts));
+    if (!self)
+        return NULL;
+
+    self->length = length;
+    self->words = (length + 7) / 8;
+    while (self->planes_length < 32 && (1u << self->planes_length) <= max)
+        self->planes_length++;
+    self->planes = calloc(self->planes_length * self->words, sizeof(uint64_t));
+    if (!self->planes) {
+        free(self);
+        return NULL;
+    }
+    return self;
+}
+
+void sp_counts_free(SPCounts* self) {
+    if (self) {
+        free(self->planes);
+        free(self);
+    }
+}
+
+void sp_counts_add(SPCounts* self, const uint8_t* capture) {
+    size_t w, j;
+    unsigned int p;
+
+    for (w = 0; w < self->words; w += SP_COUNTS_BLOCK) {
+        uint64_t carry[SP_COUNTS_BLOCK] = {0};
+        size_t block = self->words - w < SP_COUNTS_BLOCK ? self->words - w : SP_COUNTS_BLOCK;
+        size_t bytes = self->length - 8 * w < 8 * block ? self->length - 8 * w : 8 * block;
+
+        memcpy(carry, capture + 8 * w, bytes);
+        for (p = 0; p < self->planes_length; p++) {
+            uint64_t* plane = self->planes + p * self->words + w;
+            uint64_t any = 0;
+            for (j = 0; j < block; j++) {
+                uint64_t t = plane[j] & carry[j];
+                plane[j] ^= carry[j];
+                carry[j] = t;
+                any |= t;
+            }
+            if (!any)
+                break;
+        }
+    }
+    self->runs++;
+}
+
+/* how many runs had bit k (msb first) of byte offset set */
+static inline uint32_t sp_counts_get(SPCounts* self, size_t offset, unsigned int k) {
+    uint32_t count = 0;
+    unsigned int p;
+    for (p = 0; p < self->planes_length; p++) {
+        const uint8_t* plane = (const uint8_t*)(self->planes + p * self->words);
+        count |= (uint32_t)((plane[offset] >> (7 - k)) & 1) << p;
+    }
+    return count;
+}
+
+/* the counts for dev's bits, as u32 rows, columns and runs followed by
+ * a big-endian u16 for every bit, row by row
+ */
+uint8_t* sp_counts_report(SPCounts* self, SPDevice* dev, size_t* length) {
+    uint8_t* report;
+    uint8_t* c;
+    uint32_t row, bit;
+
+    *length = 12 + 2 * (size_t)dev->time_length * dev->sample_width;
+    report = malloc(*length);
+    if (!report)
+        return NULL;
+
+    sp_put_be32(report, dev->time_length);
+    sp_put_be32(report + 4, dev->sample_width);
+    sp_put_be32(report + 8, self->runs);
+    c = report + 12;
+    for (row = 0; row < dev->time_length; row++) {
+        for (bit = 0; bit < dev->sample_width; bit++) {
+            uint32_t count = sp_counts_get(self, row * dev->sample_length + bit / 8, bit % 8);
+            *c++ = (count >> 8) & 0xff;
+            *c++ = count & 0xff;
+        }
+    }
+    return report;
+}
+
+/* writes a capture to dest with each bit set if it was set in more
+ * than half the runs
+ */
+void sp_counts_majority(SPCounts* self, uint8_t* dest) {
+    size_t i;
+    unsigned int k;
+    for (i = 0; i < self->length; i++) {
+        uint8_t byte = 0;
+        for (k = 0; k < 8; k++) {
+            if (2 * sp_counts_get(self, i, k) > self->runs)
+                byte |= 0x80 >> k;
+        }
+        dest[i] = byte;
+    }
+}
+
+/*
+ * compressing captures for the trip back
+ *
+ * an encoded capture reply has the usual u32 rows and columns, then a
+ * u32 row length in bytes, then the rows encoded one of these ways:
+ *   rle      runs of identical rows, as (u32 count, row) pairs
+ *   xor-rle  the same, but of each row xor'd with the row before it
+ *   lz4      an lz4 block holding all the rows
+ */
+
+enum {
+    SP_ENCODING_IDENTITY = 0,
+    SP_ENCODING_RLE = 1,
+    SP_ENCODING_XOR_RLE = 2,
+    SP_ENCODING_LZ4 = 3,
+    SP_ENCODINGS
+};
+
+/* as used in Accept-Encoding and Content-Encoding */
+static const char* sp_encoding_names[SP_ENCODINGS] = {
+    "identity",
+    "x-sp-rle",
+    "x-sp-xor-rle",
+    "x-sp-lz4",
+};
+
+#define SP_LZ4_HASH_BITS 12
+#define SP_LZ4_MIN_MATCH 4
+#define SP_LZ4_MAX_OFFSET 65535
+/* the format wants the last few bytes as literals, and no match to
+ * start too close to the end
+ */
+#define SP_LZ4_LAST_LITERALS 5
+#define SP_LZ4_MATCH_LIMIT 12
+
+/* picks the first encoding we know from an Accept-Encoding header,
+ * skipping any with q=0
+ */
+int sp_encoding_parse(const char* accept) {
+    while (accept && *accept) {
+        const char* end = strchr(accept, ',');
+        const char* params;
+        size_t length;
+        int i;
+
+        while (*accept == ' ' || *accept == '\t')
+            accept++;
+        length = strcspn(accept, ",; \t");
+        params = accept + length;
+
+        for (i = 1; i < SP_ENCODINGS; i++) {
+            const char* q;
+            if (strlen(sp_encoding_names[i]) != length || strncasecmp(accept, sp_encoding_names[i], length) != 0)
+                continue;
+            q = strstr(params, "q=");
+            if (q && (!end || q < end) && strtod(q + 2, NULL) == 0.0)
+                break;
+            return i;
+        }
+        accept = end ? end + 1 : NULL;
+    }
+    return SP_ENCODING_IDENTITY;
+}
+
+/* run-length encodes rows of row_length bytes into dest. with xor, each
+ * row is xor'd with the one before it first, so rows that change the
+ * same way every step (like clocks) also become runs.
+ * returns the encoded length, or 0 if it would not fit in capacity
+ */
+size_t sp_encode_rle(const uint8_t* data, uint32_t rows, uint32_t row_length, int xor, uint8_t* dest, size_t capacity) {
+    size_t out = 0;
+    uint32_t row = 0, j;
+
+    while (row < rows) {
+        const uint8_t* cur = data + (size_t)row * row_length;
+        uint8_t* value = dest + out + 4;
+        uint32_t count = 1;
+
+        if (out + 4 + row_length > capacity)
+            return 0;
+        if (xor && row)
+            for (j = 0; j < row_length; j++)
+                value[j] = cur[j] ^ (cur - row_length)[j];
+        else
+            memcpy(value, cur, row_length);
+
+        for (row++; row < rows; row++, count++) {
+            cur = data + (size_t)row * row_length;
+            if (!xor) {
+                if (memcmp(cur, value, row_length) != 0)
+                    break;
+            } else {
+                for (j = 0; j < row_length; j++)
+                    if ((cur[j] ^ (cur - row_length)[j]) != value[j])
+                        break;
+                if (j < row_length)
+                    break;
+            }
+        }
+
+        sp_put_be32(dest + out, count);
+        out += 4 + row_length;
+    }
+    return out;
+}
+
+static uint8_t* sp_lz4_length(uint8_t* op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+/* writes one lz4 sequence: literals, then a match unless match is 0
+ * returns the new end of output, or NULL if it would not fit
+ */
+static uint8_t* sp_lz4_sequence(uint8_t* op, const uint8_t* oend, const uint8_t* literals, size_t literals_length, size_t offset, size_t match) {
+    size_t needed = 1 + literals_length / 255 + 1 + literals_length;
+    uint8_t* token;
+
+    if (match)
+        needed += 2 + match / 255 + 1;
+    if ((size_t)(oend - op) < needed)
+        return NULL;
+    token = op++;
+
+    *token = (literals_length >= 15 ? 15 : literals_length) << 4;
+    if (literals_length >= 15)
+        op = sp_lz4_length(op, literals_length - 15);
+    memcpy(op, literals, literals_length);
+    op += literals_length;
+
+    if (match) {
+        match -= SP_LZ4_MIN_MATCH;
+        *op++ = offset & 0xff;
+        *op++ = (offset >> 8) & 0xff;
+        *token |= match >= 15 ? 15 : match;
+        if (match >= 15)
+            op = sp_lz4_length(op, match - 15);
+    }
+    return op;
+}
+
+/* compresses data into dest as a single lz4 block
+ * returns the compressed length, or 0 if it would not fit in capacity
+ */
+size_t sp_encode_lz4(const uint8_t* data, size_t length, uint8_t* dest, size_t capacity) {
+    uint32_t table[1 << SP_LZ4_HASH_BITS];
+    const uint8_t* oend = dest + capacity;
+    uint8_t* op = dest;
+    size_t ip = 0, anchor = 0;
+
+    memset(table, 0, sizeof(table));
+
+    while (length >= SP_LZ4_MATCH_LIMIT && ip <= length - SP_LZ4_MATCH_LIMIT) {
+        uint32_t sequence, hash;
+        size_t ref, match;
+
+        memcpy(&sequence, data + ip, 4);
+        hash = (sequence * 2654435761u) >> (32 - SP_LZ4_HASH_BITS);
+        ref = table[hash];
+        table[hash] = ip;
+
+        if (ref >= ip || ip - ref > SP_LZ4_MAX_OFFSET || memcmp(data + ref, data + ip, 4) != 0) {
+            /* move faster through data that isn't matching */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        match = SP_LZ4_MIN_MATCH;
+        while (ip + match < length - SP_LZ4_LAST_LITERALS && data[ref + match] == data[ip + match])
+            match++;
+
+        op = sp_lz4_sequence(op, oend, data + anchor, ip - anchor, ip - ref, match);
+        if (!op)
+            return 0;
+        ip += match;
+        anchor = ip;
+    }
+
+    op = sp_lz4_sequence(op, oend, data + anchor, length - anchor, 0, 0);
+    if (!op)
+        return 0;
+    return op - dest;
+}
+
+/* encodes a whole capture reply, or returns NULL if the encoding would
+ * not make it any smaller
+ */
+uint8_t* sp_encode_capture(SPDevice* dev, const uint8_t* capture, int encoding, size_t* length) {
+    size_t capacity = dev->length > 5 ? dev->length - 5 : 0;
+    size_t used = 0;
+    uint8_t* reply = malloc(12 + capacity);
+    uint8_t* shrunk;
+
+    if (!reply)
+        return NULL;
+
+    switch (encoding) {
+    case SP_ENCODING_RLE:
+    case SP_ENCODING_XOR_RLE:
+        used = sp_encode_rle(capture, dev->time_length, dev->sample_length, encoding == SP_ENCODING_XOR_RLE, reply + 12, capacity);
+        break;
+    case SP_ENCODING_LZ4:
+        used = sp_encode_lz4(capture, dev->length, reply + 12, capacity);
+        break;
+    }
+    if (!used) {
+        free(reply);
+        return NULL;
+    }
+
+    sp_put_be32(reply, dev->time_length);
+    sp_put_be32(reply + 4, dev->sample_width);
+    sp_put_be32(reply + 8, dev->sample_length);
+    *length = 12 + used;
+
+    shrunk = realloc(reply, *length);
+    return shrunk ? shrunk : reply;
+}
+
+/*
+ * captures streamed to HTTP clients while the sampler is still being
+ * read out, shared between a worker and a connection
+ */
+
+/* how much of the sampler to read before handing it to the client */
+#define SP_STREAM_CHUNK (64 * 1024)
+
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned int refs;
+
+    /* size header and capture, filled in by the worker */
+    uint8_t header[8];
+    uint8_t* data;
+    size_t length;
+    /* how much of data is ready, and whether the rest is coming */
+    size_t ready;
+    int failed;
+
+    /* the connection, until it goes away. if waiting is set, it is
+     * suspended until more of data is ready
+     */
+    struct MHD_Connection* conn;
+    int waiting;
+} SPStream;
+
+SPStream* sp_stream_new(struct MHD_Connection* conn) {
+    SPStream* self = calloc(1, sizeof(SPStream));
+    if (!self)
+        return NULL;
+    pthread_mutex_init(&self->lock, NULL);
+    self->refs = 1;
+    self->conn = conn;
+    return self;
+}
+
+void sp_stream_ref(SPStream* self) {
+    pthread_mutex_lock(&self->lock);
+    self->refs++;
+    pthread_mutex_unlock(&self->lock);
+}
+
+void sp_stream_unref(SPStream* self) {
+    unsigned int refs;
+
+    pthread_mutex_lock(&self->lock);
+    refs = --self->refs;
+    pthread_mutex_unlock(&self->lock);
+
+    if (!refs) {
+        pthread_mutex_destroy(&self->lock);
+        free(self->data);
+        free(self);
+    }
+}
+
+/* gets ready for a capture from samp. returns 0 on failure */
+int sp_stream_begin(SPStream* self, SPDevice* samp) {
+    void* data;
+    if (posix_memalign(&data, SP_IO_ALIGN, samp->length) != 0)
+        return 0;
+    sp_put_be32(self->header, samp->time_length);
+    sp_put_be32(self->header + 4, samp->sample_width);
+    self->data = data;
+    self->length = samp->length;
+    return 1;
+}
+
+/* marks the first ready bytes of data as ready to send, or the rest as
+ * never coming if failed is set, and wakes the connection for them
+ */
+void sp_stream_publish(SPStream* self, size_t ready, int failed) {
+    pthread_mutex_lock(&self->lock);
+    self->ready = ready;
+    self->failed = failed;
+    if (self->waiting && self->conn) {
+        self->waiting = 0;
+        MHD_resume_connection(self->conn);
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+/* forgets the connection, once it is gone */
+void sp_stream_detach(SPStream* self) {
+    pthread_mutex_lock(&self->lock);
+    self->conn = NULL;
+    self->waiting = 0;
+    pthread_mutex_unlock(&self->lock);
+}
+
+/* a MHD_ContentReaderCallback, for the header and then data as it
+ * becomes ready. parks the connection when it catches up.
+ */
+static ssize_t sp_stream_read(void* cls, uint64_t pos, char* buf, size_t max) {
+    SPStream* self = cls;
+    size_t amount;
+
+    pthread_mutex_lock(&self->lock);
+    if (pos < 8) {
+        amount = 8 - pos;
+        if (amount > max)
+            amount = max;
+        memcpy(buf, self->header + pos, amount);
+    } else if (pos - 8 < self->ready) {
+        amount = self->ready - (pos - 8);
+        if (amount > max)
+            amount = max;
+        memcpy(buf, self->data + (pos - 8), amount);
+    } else if (self->failed) {
+        pthread_mutex_unlock(&self->lock);
+        return MHD_CONTENT_READER_END_WITH_ERROR;
+    } else {
+        self->waiting = 1;
+        MHD_suspend_connection(self->conn);
+        amount = 0;
+    }
+    pthread_mutex_unlock(&self->lock);
+    return amount;
+}
+
+static void sp_stream_response_free(void* cls) {
+    SPStream* self = cls;
+    sp_stream_detach(self);
+    sp_stream_unref(self);
+}
+
+/*
+ * an append-only archive of every run, in memory-mapped segment files
+ *
+ * each segment is preallocated, and holds a header page, an index of
+ * fixed-size entries, and then the captures. every segment in an
+ * archive has the same capacity, so run r is always in segment
+ * r / capacity, in slot r % capacity. numbers are in host order, which
+ * is little-endian on everything we run on. captures are packed rows
+ * in wire bit order, like a /run reply without its size header, and
+ * each starts on an SP_ARCHIVE_ALIGN boundary.
+ *
+ * workers copy runs in as they finish, and a committer thread flushes
+ * them in batches: captures and index entries first, then the header's
+ * committed count, which is all readers trust (see SPArchive in
+ * osuqlsp.py). the committer also makes each segment ahead of time,
+ * once the one before it is half full, so workers never wait on the
+ * filesystem. a restarted server starts a fresh segment, so run
+ * numbers skip whatever was left of the last one.
+ */
+
+#define SP_ARCHIVE_MAGIC "SPARCHV1"
+#define SP_ARCHIVE_VERSION 1
+#define SP_ARCHIVE_HEADER 4096
+#define SP_ARCHIVE_ENTRY 64
+#define SP_ARCHIVE_ALIGN 64
+
+/* default segment size, in bytes */
+#define SP_ARCHIVE_SEGMENT (256 * 1024 * 1024)
+
+/* commit once this many runs are waiting, or the oldest has waited
+ * this long, whichever comes first
+ */
+#define SP_ARCHIVE_COMMIT_RUNS 256
+#define SP_ARCHIVE_COMMIT_NS (50 * 1000 * 1000)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    /* run number of slot 0, and how many slots there are */
+    uint64_t first_run;
+    uint64_t capacity;
+    /* where the captures start, and the size of the whole file */
+    uint64_t data_offset;
+    uint64_t size;
+    /* slots safely on disk, updated last by every commit */
+    uint64_t committed;
+    /* the pool's pair names, in order, each ending in a newline */
+    uint32_t pairs_length;
+    char pairs[];
+} SPArchiveHeader;
+
+typedef struct {
+    uint64_t run;
+    /* sp_hash of the player contents, see sp_job_tag */
+    uint64_t stimulus;
+    /* CLOCK_REALTIME when the run started, and how long it took */
+    uint64_t time_ns;
+    uint64_t run_ns;
+    /* where the capture is, from the start of the segment */
+    uint64_t offset;
+    uint32_t length;
+    uint32_t rows;
+    uint32_t row_length;
+    uint32_t columns;
+    /* index of the pair in the header's list */
+    uint32_t pair;
+    uint32_t reserved;
+} SPArchiveEntry;
+
+_Static_assert(sizeof(SPArchiveEntry) == SP_ARCHIVE_ENTRY, "archive entries must be SP_ARCHIVE_ENTRY bytes");
+
+typedef struct _SPArchiveSegment SPArchiveSegment;
+
+struct _SPArchiveSegment {
+    SPArchiveSegment* next;
+    uint8_t* base;
+    SPArchiveHeader* header;
+    SPArchiveEntry* index;
+
+    /* slots and capture bytes filled, guarded by the archive's lock */
+    uint64_t used;
+    size_t data_used;
+    /* copies of those for the commit in progress, and how far the
+     * last one got. only touched by the committer
+     */
+    uint64_t commit_used;
+    size_t commit_data;
+    uint64_t committed;
+    size_t data_committed;
+};
+
+typedef struct {
+    char* path;
+    char* pairs;
+    size_t pairs_length;
+
+    /* the same for every segment */
+    uint64_t capacity;
+    size_t capture_max;
+    size_t data_offset;
+    size_t size;
+    /* the server locks its memory, see sp_archive_segment_new */
+    int realtime;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int started;
+    int stopping;
+    /* segments not yet fully committed, oldest first. appends go to
+     * the last one. the committer unmaps the others as it finishes them
+     */
+    SPArchiveSegment* head;
+    SPArchiveSegment* tail;
+    uint64_t tail_number;
+    /* the segment after the tail, made ahead of time by the committer */
+    SPArchiveSegment* spare;
+    /* could not make a new segment, so new runs are dropped */
+    int full;
+    /* runs appended since the last commit began, and when the first
+     * of them was
+     */
+    uint64_t pending;
+    uint64_t pending_since;
+
+    /* for /metrics, see sp_counter_add */
+    uint64_t runs;
+    uint64_t dropped;
+    uint64_t commits;
+    SPMetricHistogram commit_ns;
+} SPArchive;
+
+static size_t sp_round_up(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+static void sp_archive_segment_path(SPArchive* self, uint64_t number, char* path) {
+    snprintf(path, STRBUFSIZE, "%s/segment-%08llu.spa", self->path, (unsigned long long)number);
+}
+
+static void sp_archive_segment_free(SPArchive* self, SPArchiveSegment* seg) {
+    if (seg->base)
+        munmap(seg->base, self->size);
+    free(seg);
+}
+
+/* creates, preallocates and maps a new, empty segment
+ * returns NULL on failure, with errno set
+ */
+static SPArchiveSegment* sp_archive_segment_new(SPArchive* self, uint64_t number) {
+    char path[STRBUFSIZE];
+    SPArchiveSegment* seg;
+    void* base;
+    int prot = PROT_READ | PROT_WRITE;
+    int fd, err;
+
+    seg = calloc(1, sizeof(SPArchiveSegment));
+    if (!seg)
+        return NULL;
+
+    sp_archive_segment_path(self, number, path);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        free(seg);
+        return NULL;
+    }
+    /* so running out of disk fails here, and not as a SIGBUS later */
+    err = posix_fallocate(fd, 0, self->size);
+    if (err) {
+        close(fd);
+        unlink(path);
+        free(seg);
+        errno = err;
+        return NULL;
+    }
+    /* under mlockall(MCL_FUTURE), new mappings are faulted in and
+     * locked whole, which would pin every segment in memory. a mapping
+     * with no access can't be faulted in, so realtime servers unlock
+     * it before opening it up
+     */
+    if (self->realtime)
+        prot = PROT_NONE;
+    base = mmap(NULL, self->size, prot, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base != MAP_FAILED && self->realtime &&
+        (munlock(base, self->size) != 0 || mprotect(base, self->size, PROT_READ | PROT_WRITE) != 0)) {
+        munmap(base, self->size);
+        base = MAP_FAILED;
+    }
+    if (base == MAP_FAILED) {
+        unlink(path);
+        free(seg);
+        return NULL;
+    }
+
+    seg->base = base;
+    seg->header = base;
+    seg->index = (SPArchiveEntry*)(seg->base + SP_ARCHIVE_HEADER);
+
+    memcpy(seg->header->magic, SP_ARCHIVE_MAGIC, sizeof(seg->header->magic));
+    seg->header->version = SP_ARCHIVE_VERSION;
+    seg->header->entry_size = SP_ARCHIVE_ENTRY;
+    seg->header->first_run = number * self->capacity;
+    seg->header->capacity = self->capacity;
+    seg->header->data_offset = self->data_offset;
+    seg->header->size = self->size;
+    seg->header->committed = 0;
+    seg->header->pairs_length = self->pairs_length;
+    memcpy(seg->header->pairs, self->pairs, self->pairs_length);
+    return seg;
+}
+
+/* finds the newest segment already in the archive, if any, and takes
+ * its capacity. returns the number the next segment should have, or
+ * -1 if the archive can't be continued
+ */
+static int64_t sp_archive_resume(SPArchive* self) {
+    SPArchiveHeader header;
+    char path[STRBUFSIZE];
+    struct dirent* ent;
+    int64_t newest = -1;
+    DIR* dir;
+    int fd;
+
+    dir = opendir(self->path);
+    if (!dir)
+        return -1;
+    while ((ent = readdir(dir)) != NULL) {
+        unsigned long long number;
+        int end = 0;
+        if (sscanf(ent->d_name, "segment-%llu.spa%n", &number, &end) == 1 && end && !ent->d_name[end] && (int64_t)number > newest)
+            newest = number;
+    }
+    closedir(dir);
+    if (newest < 0)
+        return 0;
+
+    sp_archive_segment_path(self, newest, path);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, SP_ARCHIVE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SP_ARCHIVE_VERSION || header.entry_size != SP_ARCHIVE_ENTRY || !header.capacity) {
+        fprintf(stderr, "archive: %s is not a segment we can continue from\n", path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    self->capacity = header.capacity;
+    return newest + 1;
+}
+
+static void sp_archive_sync(uint8_t* base, size_t start, size_t end) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    start = start / page * page;
+    if (end > start && msync(base + start, end - start, MS_SYNC) != 0)
+        fprintf(stderr, "archive: msync failed: %s\n", strerror(errno));
+}
+
+/* flushes everything appended so far. only called by the committer */
+static void sp_archive_commit(SPArchive* self) {
+    SPArchiveSegment* seg;
+    SPArchiveSegment* last;
+    uint64_t start = sp_now_ns();
+
+    /* appends carry on while we flush, but only ever past what we
+     * noted here
+     */
+    pthread_mutex_lock(&self->lock);
+    last = self->tail;
+    for (seg = self->head; seg; seg = seg->next) {
+        seg->commit_used = seg->used;
+        seg->commit_data = seg->data_used;
+        if (seg == last)
+            break;
+    }
+    self->pending = 0;
+    pthread_mutex_unlock(&self->lock);
+
+    for (seg = self->head; seg; seg = seg->next) {
+        if (seg->commit_used != seg->committed) {
+            sp_archive_sync(seg->base, self->data_offset + seg->data_committed, self->data_offset + seg->commit_data);
+            sp_archive_sync(seg->base, SP_ARCHIVE_HEADER + seg->committed * SP_ARCHIVE_ENTRY,
+                            SP_ARCHIVE_HEADER + seg->commit_used * SP_ARCHIVE_ENTRY);
+            /* only now can readers see them */
+            __atomic_store_n(&seg->header->committed, seg->commit_used, __ATOMIC_RELEASE);
+            sp_archive_sync(seg->base, 0, SP_ARCHIVE_HEADER);
+            seg->committed = seg->commit_used;
+            seg->data_committed = seg->commit_data;
+        }
+        if (seg == last)
+            break;
+    }
+
+    /* appends only go to the last segment, so the rest can go once
+     * they are done
+     */
+    while (self->head != last && self->head->committed == self->capacity) {
+        seg = self->head;
+        pthread_mutex_lock(&self->lock);
+        self->head = seg->next;
+        pthread_mutex_unlock(&self->lock);
+        sp_archive_segment_free(self, seg);
+    }
+
+    sp_counter_add(&self->commits, 1);
+    sp_metric_record(&self->commit_ns, sp_now_ns() - start);
+}
+
+/* whether the committer should make the next segment, with the lock
+ * held
+ */
+static int sp_archive_wants_spare(SPArchive* self) {
+    return !self->spare && !self->full && !self->stopping && self->tail->used * 2 >= self->capacity;
+}
+
+/* makes the segment after the tail. only called by the committer */
+static void sp_archive_prepare(SPArchive* self) {
+    SPArchiveSegment* spare;
+    uint64_t number;
+
+    /* only the committer changes tail_number while there's no spare */
+    pthread_mutex_lock(&self->lock);
+    number = self->tail_number + 1;
+    pthread_mutex_unlock(&self->lock);
+
+    spare = sp_archive_segment_new(self, number);
+    if (!spare)
+        fprintf(stderr, "archive: could not create a new segment, not archiving any more: %s\n", strerror(errno));
+
+    pthread_mutex_lock(&self->lock);
+    self->spare = spare;
+    if (!spare)
+        self->full = 1;
+    pthread_mutex_unlock(&self->lock);
+}
+
+static void* sp_archive_main(void* data) {
+    SPArchive* self = data;
+
+    pthread_mutex_lock(&self->lock);
+    for (;;) {
+        while (!self->pending && !self->stopping && !sp_archive_wants_spare(self))
+            pthread_cond_wait(&self->cond, &self->lock);
+        if (sp_archive_wants_spare(self)) {
+            pthread_mutex_unlock(&self->lock);
+            sp_archive_prepare(self);
+            pthread_mutex_lock(&self->lock);
+            continue;
+        }
+        if (!self->pending)
+            break;
+
+        /* group commit: wait for a full batch, or for the oldest run
+         * to have waited long enough
+         */
+        while (self->pending < SP_ARCHIVE_COMMIT_RUNS && !self->stopping && !sp_archive_wants_spare(self)) {
+            uint64_t deadline = self->pending_since + SP_ARCHIVE_COMMIT_NS;
+            struct timespec ts;
+            if (sp_now_ns() >= deadline)
+                break;
+            ts.tv_sec = deadline / 1000000000ull;
+            ts.tv_nsec = deadline % 1000000000ull;
+            pthread_cond_timedwait(&self->cond, &self->lock, &ts);
+        }
+
+        pthread_mutex_unlock(&self->lock);
+        sp_archive_commit(self);
+        pthread_mutex_lock(&self->lock);
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    return NULL;
+}
+
+/* commits whatever is left, and closes the archive */
+void sp_archive_close(SPArchive* self) {
+    SPArchiveSegment* seg;
+    if (!self)
+        return;
+
+    if (self->started) {
+        pthread_mutex_lock(&self->lock);
+        self->stopping = 1;
+        pthread_cond_signal(&self->cond);
+        pthread_mutex_unlock(&self->lock);
+        pthread_join(self->thread, NULL);
+    }
+
+    while (self->head) {
+        seg = self->head;
+        self->head = seg->next;
+        sp_archive_segment_free(self, seg);
+    }
+    /* an unused spare would only make the next start skip a segment */
+    if (self->spare) {
+        char path[STRBUFSIZE];
+        sp_archive_segment_path(self, self->tail_number + 1, path);
+        unlink(path);
+        sp_archive_segment_free(self, self->spare);
+    }
+    pthread_mutex_destroy(&self->lock);
+    pthread_cond_destroy(&self->cond);
+    free(self->path);
+    free(self->pairs);
+    free(self);
+}
+
+/* opens (creating if needed) the archive in the directory path, for
+ * captures of up to capture_max bytes, from the pairs named in pairs
+ * (each ending in a newline). new archives get segments of about
+ * segment_size bytes. realtime is set if the server has locked its
+ * memory. returns NULL on failure
+ */
+SPArchive* sp_archive_open(const char* path, size_t segment_size, size_t capture_max, const char* pairs, int realtime) {
+    SPArchive* self;
+    pthread_condattr_t attr;
+    int64_t number;
+
+    self = calloc(1, sizeof(SPArchive));
+    if (!self)
+        return NULL;
+    pthread_mutex_init(&self->lock, NULL);
+    /* sp_archive_main's deadlines are on the same clock as sp_now_ns */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&self->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    self->path = strdup(path);
+    self->pairs = strdup(pairs);
+    self->pairs_length = strlen(pairs);
+    self->capture_max = sp_round_up(capture_max, SP_ARCHIVE_ALIGN);
+    self->realtime = realtime;
+    if (!self->path || !self->pairs) {
+        sp_archive_close(self);
+        return NULL;
+    }
+    if (offsetof(SPArchiveHeader, pairs) + self->pairs_length > SP_ARCHIVE_HEADER) {
+        fprintf(stderr, "archive: too many pair names to fit in a segment header\n");
+        sp_archive_close(self);
+        return NULL;
+    }
+
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "archive: could not create %s: %s\n", path, strerror(errno));
+        sp_archive_close(self);
+        return NULL;
+    }
+    number = sp_archive_resume(self);
+    if (number < 0) {
+        sp_archive_close(self);
+        return NULL;
+    }
+    if (!self->capacity) {
+        self->capacity = 1;
+        if (segment_size > SP_ARCHIVE_HEADER + SP_ARCHIVE_ENTRY + self->capture_max)
+            self->capacity = (segment_size - SP_ARCHIVE_HEADER) / (SP_ARCHIVE_ENTRY + self->capture_max);
+    }
+    /* the index ends on a page, so captures start on one */
+    self->data_offset = SP_ARCHIVE_HEADER + sp_round_up(self->capacity * SP_ARCHIVE_ENTRY, SP_ARCHIVE_HEADER);
+    self->size = self->data_offset + self->capacity * self->capture_max;
+
+    self->head = self->tail = sp_archive_segment_new(self, number);
+    if (!self->head) {
+        fprintf(stderr, "archive: could not create segment %lli in %s: %s\n", (long long)number, path, strerror(errno));
+        sp_archive_close(self);
+        return NULL;
+    }
+    self->tail_number = number;
+
+    if (pthread_create(&self->thread, NULL, sp_archive_main, self) != 0) {
+        sp_archive_close(self);
+        return NULL;
+    }
+    self->started = 1;
+    return self;
+}
+
+/* copies a finished run's capture into the archive. start is when it
+ * began, by sp_now_ns, and pair is its worker's index
+ */
+void sp_archive_append(SPArchive* self, unsigned int pair, uint64_t stimulus, uint64_t start, SPDevice* samp, const uint8_t* capture) {
+    uint64_t now = sp_now_ns();
+    SPArchiveSegment* seg;
+    SPArchiveEntry* entry;
+    struct timespec ts;
+    uint64_t wall;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    wall = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec - (now - start);
+
+    pthread_mutex_lock(&self->lock);
+    seg = self->tail;
+    /* if the committer hasn't made the next segment yet, the run is
+     * dropped rather than waiting for it
+     */
+    if (seg->used == self->capacity && self->spare) {
+        seg->next = self->spare;
+        self->tail = seg = self->spare;
+        self->spare = NULL;
+        self->tail_number++;
+    }
+    if (seg->used == self->capacity) {
+        pthread_mutex_unlock(&self->lock);
+        sp_counter_add(&self->dropped, 1);
+        return;
+    }
+
+    entry = &seg->index[seg->used];
+    entry->run = seg->header->first_run + seg->used;
+    entry->stimulus = stimulus;
+    entry->time_ns = wall;
+    entry->run_ns = now - start;
+    entry->offset = self->data_offset + seg->data_used;
+    entry->length = samp->length;
+    entry->rows = samp->time_length;
+    entry->row_length = samp->sample_length;
+    entry->columns = samp->sample_width;
+    entry->pair = pair;
+    entry->reserved = 0;
+    /* copying with the lock held keeps slots filled in order, and is
+     * quick next to the run itself
+     */
+    memcpy(seg->base + entry->offset, capture, samp->length);
+
+    seg->used++;
+    seg->data_used += sp_round_up(samp->length, SP_ARCHIVE_ALIGN);
+    if (!self->pending++)
+        self->pending_since = now;
+    if (self->pending == 1 || self->pending == SP_ARCHIVE_COMMIT_RUNS || (seg->used * 2 >= self->capacity && (seg->used - 1) * 2 < self->capacity))
+        pthread_cond_signal(&self->cond);
+    pthread_mutex_unlock(&self->lock);
+
+    sp_counter_add(&self->runs, 1);
+}
+
+/*
+ * a pool of pairs, each with a worker thread that runs queued jobs
+ */
+
+/* SCHED_FIFO priority for realtime workers */
+#define SP_REALTIME_PRIORITY 80
+
+/* how many times a realtime worker polls for completion before sleeping */
+#define SP_REALTIME_SPINS 100000
+
+/* how much worker stack to fault in ahead of time */
+#define SP_STACK_PREFAULT (64 * 1024)
+
+/* in event loop mode, how long to trust interrupts before checking
+ * running pairs anyway, in case one went missing
+ */
+#define SP_EVENT_CHECK_NS (10 * 1000 * 1000)
+
+typedef struct _SPJob SPJob;
+typedef struct _SPWorker SPWorker;
+typedef struct _SPPool SPPool;
+
+typedef void (*SPJobFunc)(SPJob*);
+
+struct _SPJob {
+    SPJob* next;
+
+    /* padded player contents, filled in before submission */
+    uint8_t* inputs;
+    /* sp_hash of inputs, see sp_job_tag */
+    uint64_t stimulus;
+    /* sp_hash_check of inputs, and how many bytes both cover */
+    uint64_t stimulus_check;
+    size_t stimulus_length;
+
+    /* a cached capture the run is expected to match, when verifying
+     * the result cache. see sp_worker_submit
+     */
+    SPCacheEntry* cached;
+
+    /* if set, reply with sp_check_report against these instead of
+     * returning the capture
+     */
+    uint8_t* expected;
+    uint8_t* care;
+    uint32_t limit;
+
+    /* if nonzero, run this many times and reply with per-bit counts,
+     * or with a majority vote if majority is set
+     */
+    uint32_t repeat;
+    int majority;
+
+    /* how to encode a capture reply. if encoding would not help, the
+     * worker sets this back to SP_ENCODING_IDENTITY
+     */
+    int encoding;
+
+    /* if set, and the job is a single run wanting the plain capture,
+     * the worker may stream the capture here instead of into outputs,
+     * see sp_worker_stream. the job completes before the stream does,
+     * with stream->data set if it was used.
+     */
+    SPStream* stream;
+
+    /* size header followed by sampler contents, filled in by the worker */
+    uint8_t* outputs;
+    size_t outputs_length;
+    int ok;
+
+    /* called from the worker thread once the job is finished */
+    SPJobFunc complete;
+    void* complete_data;
+};
+
+struct _SPWorker {
+    SPPool* pool;
+    SPPair* pair;
+    char* name;
+    int realtime;
+
+    pthread_t thread;
+    int started;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    SPJob* head;
+    SPJob* tail;
+    int stopping;
+
+    /* jobs assigned here but not yet finished, guarded by pool->lock */
+    unsigned int load;
+
+    /* how long sp_pair_run takes, guarded by lock */
+    SPHistogram latency;
+
+    /* for /metrics, see sp_counter_add */
+    SPMetricHistogram stages[SP_STAGES];
+    uint64_t runs;
+    uint64_t run_errors;
+
+    /* mixed into the keys of this pair's captures in pool->results */
+    uint64_t result_key;
+    /* result cache hits, for picking which to verify */
+    uint64_t result_hits;
+    /* verified hits, by whether the hardware agreed */
+    uint64_t result_matches;
+    uint64_t result_drifts;
+
+    /* event loop mode only, see sp_worker_step: the job on the pair,
+     * its counts if repeated, how many runs it has left, and when the
+     * current one started
+     */
+    SPJob* running;
+    SPCounts* running_counts;
+    uint32_t running_left;
+    uint64_t running_start;
+};
+
+typedef struct {
+    /* if not -1, pin worker i to CPU realtime_cpu + i and run it
+     * SCHED_FIFO with prefaulted buffers and bounded polling
+     */
+    int realtime_cpu;
+
+    /* if nonzero, remember captures by stimulus in up to this many
+     * bytes, and answer repeats without running the hardware. only
+     * safe for DUTs that always give the same capture for a stimulus.
+     */
+    size_t result_budget;
+    /* run one in this many result cache hits anyway, and compare, to
+     * catch a DUT that is not as deterministic as promised. 0 never
+     */
+    unsigned int result_verify_every;
+
+    /* if set, start no worker threads, and run every pair from one
+     * loop instead, see sp_event_loop
+     */
+    int event_loop;
+
+    /* if set, keep every run in an archive in this directory, in
+     * segments of about archive_segment bytes, see sp_archive_open
+     */
+    const char* archive_path;
+    size_t archive_segment;
+} SPPoolOptions;
+
+struct _SPPool {
+    SPWorker* workers;
+    unsigned int workers_length;
+    pthread_mutex_t lock;
+    SPPoolOptions options;
+
+    /* captures keyed by sp_worker_result_key, if result_budget is set */
+    SPCache* results;
+
+    /* every run, if archive_path is set */
+    SPArchive* archive;
+
+    /* event loop mode only: written by sp_worker_submit to wake the
+     * loop, or -1. the loop also holds every pair's leases for good
+     */
+    int wake_fd;
+    int leased;
+};
+
+/* replies with a capture, after a header with its size */
+static int sp_job_reply(SPJob* job, SPDevice* samp, const uint8_t* capture) {
+    if (job->encoding != SP_ENCODING_IDENTITY) {
+        job->outputs = sp_encode_capture(samp, capture, job->encoding, &job->outputs_length);
+        if (job->outputs)
+            return 1;
+        job->encoding = SP_ENCODING_IDENTITY;
+    }
+
+    job->outputs_length = samp->length + 8;
+    job->outputs = malloc(job->outputs_length);
+    if (!job->outputs)
+        return 0;
+
+    sp_put_be32(job->outputs, samp->time_length);
+    sp_put_be32(job->outputs + 4, samp->sample_width);
+
+    /* technically we should exclude the extra 0's, but I'm ok
+     * with this for now
+     */
+    memcpy(job->outputs + 8, capture, samp->length);
+    return 1;
+}
+
+/* builds the reply to a job, from its capture, or from counts for
+ * repeated runs
+ */
+static void sp_job_finish(SPJob* job, SPDevice* samp, const uint8_t* capture, SPCounts* counts) {
+    /* only captures get encoded */
+    if (job->expected || (counts && !job->majority))
+        job->encoding = SP_ENCODING_IDENTITY;
+
+    if (job->expected) {
+        job->outputs = sp_check_report(samp, capture, job->expected, job->care, job->limit, &job->outputs_length);
+        job->ok = job->outputs != NULL;
+    } else if (counts && job->majority) {
+        /* the sampler buffer is ours until the next run */
+        sp_counts_majority(counts, samp->data);
+        job->ok = sp_job_reply(job, samp, samp->data);
+    } else if (counts) {
+        job->outputs = sp_counts_report(counts, samp, &job->outputs_length);
+        job->ok = job->outputs != NULL;
+    } else {
+        job->ok = sp_job_reply(job, samp, capture);
+    }
+}
+
+/* where a job's capture lives in pool->results. captures are only
+ * reused for the same stimulus, on the same pair and geometry. lookups
+ * also match the job's stimulus_check and stimulus_length, so a
+ * colliding key is a miss rather than someone else's capture
+ */
+static uint64_t sp_worker_result_key(SPWorker* self, SPJob* job) {
+    return sp_hash_mix(job->stimulus ^ self->result_key);
+}
+
+/* repeats are for measuring noise, so they never use the cache */
+static int sp_worker_result_cacheable(SPWorker* self, SPJob* job) {
+    return self->pool->results && job->stimulus && !job->repeat;
+}
+
+/* stores a fresh capture in pool->results under key, check and
+ * key_length, see sp_worker_result_key. if the run was
+ * verifying a cached capture, compares the two instead, and lets go
+ * of cached
+ */
+static void sp_worker_result_store(SPWorker* self, uint64_t key, uint64_t check, size_t key_length, SPCacheEntry* cached, const uint8_t* capture) {
+    SPCache* results = self->pool->results;
+    size_t length = self->pair->samp->length;
+    uint8_t* copy;
+
+    if (cached) {
+        int same = cached->length == length && memcmp(cached->data, capture, length) == 0;
+        sp_cache_unref(results, cached);
+        if (same) {
+            sp_counter_add(&self->result_matches, 1);
+            return;
+        }
+        if (sp_counter_get(&self->result_drifts) == 0)
+            fprintf(stderr, "pair %s: capture differs from the cached one; is the DUT deterministic?\n", self->name);
+        sp_counter_add(&self->result_drifts, 1);
+    }
+
+    copy = malloc(length);
+    if (!copy)
+        return;
+    memcpy(copy, capture, length);
+    sp_cache_put(results, key, check, key_length, copy, length);
+}
+
+/* holds the pair for the whole job, repeats included, and puts the
+ * job's inputs in place. returns 0 on failure
+ */
+static int sp_worker_begin(SPWorker* self, SPJob* job) {
+    SPPair* pair = self->pair;
+    uint64_t start = sp_now_ns();
+
+    if (!self->pool->leased) {
+        if (!sp_pair_acquire(pair)) {
+            sp_counter_add(&self->run_errors, 1);
+            return 0;
+        }
+        sp_metric_record(&self->stages[SP_STAGE_LEASE], sp_now_ns() - start);
+    }
+
+    if (!job->stimulus || job->stimulus != pair->resident) {
+        /* the job's buffer becomes the player's, if it can */
+        uint8_t* old = sp_pair_exchange_inputs(pair, job->inputs);
+        if (old)
+            job->inputs = old;
+        else
+            memcpy(pair->inputs, job->inputs, pair->inputs_length);
+    }
+    return 1;
+}
+
+/* gives up on a job after a failed run */
+static void sp_worker_abort(SPWorker* self) {
+    if (!self->pool->leased)
+        sp_pair_release(self->pair);
+    sp_counter_add(&self->run_errors, 1);
+}
+
+/* accounts for one finished run of stimulus, started at start, and
+ * archives its capture
+ */
+static void sp_worker_record(SPWorker* self, uint64_t start, uint64_t stimulus, const uint8_t* capture) {
+    SPPair* pair = self->pair;
+
+    if (self->pool->archive)
+        sp_archive_append(self->pool->archive, self - self->pool->workers, stimulus, start, pair->samp, capture);
+
+    pthread_mutex_lock(&self->lock);
+    sp_histogram_record(&self->latency, sp_now_ns() - start);
+    pthread_mutex_unlock(&self->lock);
+
+    sp_counter_add(&self->runs, 1);
+    if (pair->write_ns)
+        sp_metric_record(&self->stages[SP_STAGE_WRITE], pair->write_ns);
+    sp_metric_record(&self->stages[SP_STAGE_WAIT], pair->wait_ns);
+    sp_metric_record(&self->stages[SP_STAGE_READ], pair->read_ns);
+    sp_metric_record(&self->stages[SP_STAGE_SWAP], pair->swap_ns);
+}
+
+/* lets go of the pair after the last run, and builds the reply */
+static void sp_worker_end(SPWorker* self, SPJob* job, const uint8_t* outputs, SPCounts* counts) {
+    uint64_t start;
+
+    /* the capture is in our own buffer now */
+    if (!self->pool->leased)
+        sp_pair_release(self->pair);
+    start = sp_now_ns();
+
+    if (sp_worker_result_cacheable(self, job)) {
+        sp_worker_result_store(self, sp_worker_result_key(self, job), job->stimulus_check, job->stimulus_length, job->cached, outputs);
+        job->cached = NULL;
+    }
+
+    sp_job_finish(job, self->pair->samp, outputs, counts);
+    sp_metric_record(&self->stages[SP_STAGE_RESPONSE], sp_now_ns() - start);
+}
+
+/* hands a finished job back. the job may be freed by this, so don't
+ * touch it after
+ */
+static void sp_worker_complete(SPWorker* self, SPJob* job) {
+    if (job->cached) {
+        /* the run failed before it could be compared */
+        sp_cache_unref(self->pool->results, job->cached);
+        job->cached = NULL;
+    }
+
+    pthread_mutex_lock(&self->pool->lock);
+    self->load--;
+    pthread_mutex_unlock(&self->pool->lock);
+
+    job->complete(job);
+}
+
+/* finishes a run whose capture is streamed. the job completes as soon
+ * as the pair stops, so the reply can start going out while we read
+ * the sampler into the stream, a chunk at a time
+ */
+static void sp_worker_stream(SPWorker* self, SPJob* job, uint64_t start) {
+    SPPair* pair = self->pair;
+    SPDevice* samp = pair->samp;
+    SPStream* stream = job->stream;
+    int cacheable = sp_worker_result_cacheable(self, job);
+    uint64_t key = sp_worker_result_key(self, job);
+    uint64_t stimulus = job->stimulus;
+    uint64_t check = job->stimulus_check;
+    size_t key_length = job->stimulus_length;
+    SPCacheEntry* cached = job->cached;
+    size_t offset = 0;
+    uint64_t read_start;
+
+    if (!sp_stream_begin(stream, samp)) {
+        sp_worker_abort(self);
+        sp_worker_complete(self, job);
+        return;
+    }
+
+    /* the stream outlives the job, which is gone after this */
+    sp_stream_ref(stream);
+    job->cached = NULL;
+    job->ok = 1;
+    sp_worker_complete(self, job);
+
+    read_start = sp_now_ns();
+    while (offset < samp->length) {
+        size_t amount = samp->length - offset;
+        if (amount > SP_STREAM_CHUNK)
+            amount = SP_STREAM_CHUNK;
+        if (!sp_device_read_range(samp, stream->data + offset, offset, amount))
+            break;
+        sp_swap_bit_order(stream->data + offset, amount);
+        offset += amount;
+        sp_stream_publish(stream, offset, 0);
+    }
+    /* this counts the swap as reading, since they are interleaved */
+    pair->read_ns = sp_now_ns() - read_start;
+
+    if (offset < samp->length) {
+        sp_stream_publish(stream, offset, 1);
+        sp_worker_abort(self);
+        if (cached)
+            sp_cache_unref(self->pool->results, cached);
+    } else {
+        sp_worker_record(self, start, stimulus, stream->data);
+        if (!self->pool->leased)
+            sp_pair_release(pair);
+        if (cacheable)
+            sp_worker_result_store(self, key, check, key_length, cached, stream->data);
+    }
+    sp_stream_unref(stream);
+}
+
+/* runs a job, and completes it */
+static void sp_worker_run(SPWorker* self, SPJob* job) {
+    SPPair* pair = self->pair;
+    const uint8_t* outputs = NULL;
+    SPCounts* counts = NULL;
+    uint32_t runs = job->repeat ? job->repeat : 1;
+    uint32_t i;
+    uint64_t start;
+
+    if (job->repeat) {
+        counts = sp_counts_new(pair->outputs_length, runs);
+        if (!counts) {
+            sp_worker_complete(self, job);
+            return;
+        }
+    }
+
+    if (!sp_worker_begin(self, job)) {
+        sp_counts_free(counts);
+        sp_worker_complete(self, job);
+        return;
+    }
+
+    if (job->stream && !job->repeat && !job->expected && job->encoding == SP_ENCODING_IDENTITY) {
+        start = sp_now_ns();
+        if (!sp_pair_start(pair, job->stimulus)) {
+            sp_worker_abort(self);
+            sp_worker_complete(self, job);
+            return;
+        }
+        sp_device_wait_done(pair->samp, pair->spins);
+        sp_device_wait_done(pair->play, pair->spins);
+        sp_pair_stop(pair);
+        sp_worker_stream(self, job, start);
+        return;
+    }
+
+    /* after the first run the stimulus is resident, so repeats only
+     * cost the run itself
+     */
+    for (i = 0; i < runs; i++) {
+        start = sp_now_ns();
+        outputs = sp_pair_run_stimulus(pair, job->stimulus);
+        if (!outputs) {
+            sp_worker_abort(self);
+            sp_counts_free(counts);
+            sp_worker_complete(self, job);
+            return;
+        }
+        sp_worker_record(self, start, job->stimulus, outputs);
+
+        if (counts)
+            sp_counts_add(counts, outputs);
+    }
+
+    sp_worker_end(self, job, outputs, counts);
+    sp_counts_free(counts);
+    sp_worker_complete(self, job);
+}
+
+static void sp_worker_prefault_stack(void) {
+    uint8_t stack[SP_STACK_PREFAULT];
+    size_t i;
+    for (i = 0; i < SP_STACK_PREFAULT; i += 4096)
+        stack[i] = 0;
+    /* so the stores aren't optimized away */
+    __asm__ volatile("" :: "r"(stack) : "memory");
+}
+
+/* pins this worker to its own CPU, and gets everything the hot path
+ * touches faulted in. failures here are not fatal, just slower.
+ */
+static void sp_worker_setup_realtime(SPWorker* self) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int cpu = self->pool->options.realtime_cpu + (self - self->pool->workers);
+    struct sched_param param;
+    cpu_set_t set;
+
+    if (cpus > 0)
+        cpu %= cpus;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        fprintf(stderr, "pair %s: could not pin to cpu %i\n", self->name, cpu);
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = SP_REALTIME_PRIORITY;
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+        fprintf(stderr, "pair %s: could not switch to SCHED_FIFO\n", self->name);
+
+    if (!sp_pair_prefault(self->pair))
+        fprintf(stderr, "pair %s: could not prefault buffers\n", self->name);
+    sp_worker_prefault_stack();
+
+    self->pair->spins = SP_REALTIME_SPINS;
+    self->realtime = 1;
+}
+
+/* takes the next queued job off the list, with lock held */
+static SPJob* sp_worker_pop(SPWorker* self) {
+    SPJob* job = self->head;
+    if (job) {
+        self->head = job->next;
+        if (!self->head)
+            self->tail = NULL;
+    }
+    return job;
+}
+
+static void* sp_worker_main(void* data) {
+    SPWorker* self = data;
+
+    if (self->pool->options.realtime_cpu >= 0)
+        sp_worker_setup_realtime(self);
+
+    for (;;) {
+        SPJob* job;
+
+        pthread_mutex_lock(&self->lock);
+        while (!self->head && !self->stopping)
+            pthread_cond_wait(&self->cond, &self->lock);
+        job = sp_worker_pop(self);
+        pthread_mutex_unlock(&self->lock);
+
+        if (!job)
+            break;
+
+        sp_worker_run(self, job);
+    }
+
+    return NULL;
+}
+
+/* event loop mode: sp_worker_run in steps that never block, so one
+ * thread can keep every pair busy. finishes the current run if check
+ * is set and the pair is done, then starts the next run, or the next
+ * job, if there is one.
+ */
+static void sp_worker_step(SPWorker* self, int check) {
+    SPPair* pair = self->pair;
+
+    for (;;) {
+        SPJob* job = self->running;
+        const uint8_t* outputs;
+
+        if (job) {
+            if (!check || !sp_pair_done(pair))
+                return;
+            check = 0;
+
+            outputs = sp_pair_finish(pair);
+            if (!outputs) {
+                sp_worker_abort(self);
+            } else {
+                sp_worker_record(self, self->running_start, job->stimulus, outputs);
+                if (self->running_counts)
+                    sp_counts_add(self->running_counts, outputs);
+
+                if (--self->running_left) {
+                    self->running_start = sp_now_ns();
+                    if (sp_pair_start(pair, job->stimulus))
+                        return;
+                    sp_worker_abort(self);
+                } else {
+                    sp_worker_end(self, job, outputs, self->running_counts);
+                }
+            }
+
+            sp_counts_free(self->running_counts);
+            self->running_counts = NULL;
+            self->running = NULL;
+            sp_worker_complete(self, job);
+            continue;
+        }
+
+        pthread_mutex_lock(&self->lock);
+        job = sp_worker_pop(self);
+        pthread_mutex_unlock(&self->lock);
+        if (!job)
+            return;
+
+        self->running_left = job->repeat ? job->repeat : 1;
+        if (job->repeat) {
+            self->running_counts = sp_counts_new(pair->outputs_length, job->repeat);
+            if (!self->running_counts) {
+                sp_worker_complete(self, job);
+                continue;
+            }
+        }
+        if (!sp_worker_begin(self, job)) {
+            sp_counts_free(self->running_counts);
+            self->running_counts = NULL;
+            sp_worker_complete(self, job);
+            continue;
+        }
+
+        self->running_start = sp_now_ns();
+        if (!sp_pair_start(pair, job->stimulus)) {
+            sp_worker_abort(self);
+            sp_counts_free(self->running_counts);
+            self->running_counts = NULL;
+            sp_worker_complete(self, job);
+            continue;
+        }
+        self->running = job;
+        return;
+    }
+}
+
+/* allocates inputs for a job on this worker, aligned so that they can
+ * be handed to the player as they are, see sp_pair_exchange_inputs
+ */
+uint8_t* sp_worker_alloc_inputs(SPWorker* self) {
+    void* inputs;
+    if (posix_memalign(&inputs, SP_IO_ALIGN, self->pair->inputs_length) != 0)
+        return NULL;
+    return inputs;
+}
+
+/* identifies a job's inputs, so the worker can skip rewriting a player
+ * that already holds them
+ */
+void sp_job_tag(SPJob* job, size_t length) {
+    job->stimulus = sp_hash(job->inputs, length);
+    job->stimulus_check = sp_hash_check(job->inputs, length);
+    job->stimulus_length = length;
+}
+
+/* answers a job from its cached capture, right away and without
+ * touching the pair. the job may be freed by this.
+ */
+static void sp_worker_answer_cached(SPWorker* self, SPJob* job) {
+    uint64_t start = sp_now_ns();
+
+    sp_job_finish(job, self->pair->samp, job->cached->data, NULL);
+    sp_cache_unref(self->pool->results, job->cached);
+    job->cached = NULL;
+    sp_metric_record(&self->stages[SP_STAGE_RESPONSE], sp_now_ns() - start);
+
+    sp_worker_complete(self, job);
+}
+
+/* queues a job on this worker. with the result cache on, a job whose
+ * capture is already known may instead complete before this returns.
+ */
+void sp_worker_submit(SPWorker* self, SPJob* job) {
+    job->next = NULL;
+    job->ok = 0;
+    job->cached = NULL;
+
+    if (sp_worker_result_cacheable(self, job)) {
+        job->cached = sp_cache_get(self->pool->results, sp_worker_result_key(self, job), job->stimulus_check, job->stimulus_length);
+        if (job->cached) {
+            unsigned int every = self->pool->options.result_verify_every;
+            uint64_t hits = __atomic_add_fetch(&self->result_hits, 1, __ATOMIC_RELAXED);
+            if (!every || hits % every) {
+                sp_worker_answer_cached(self, job);
+                return;
+            }
+            /* otherwise run it for real, and compare when done */
+        }
+    }
+
+    pthread_mutex_lock(&self->lock);
+    if (self->tail)
+        self->tail->next = job;
+    else
+        self->head = job;
+    self->tail = job;
+    pthread_cond_signal(&self->cond);
+    pthread_mutex_unlock(&self->lock);
+
+    /* jobs from the binary listeners come from other threads */
+    if (self->pool->wake_fd >= 0)
+        eventfd_write(self->pool->wake_fd, 1);
+}
+
+/* event loop mode: fails the running job and everything queued, when
+ * shutting down
+ */
+static void sp_worker_drain(SPWorker* self) {
+    SPJob* job = self->running;
+
+    if (job) {
+        sp_device_set_enabled(self->pair->samp, 0);
+        sp_device_set_enabled(self->pair->play, 0);
+        sp_counts_free(self->running_counts);
+        self->running_counts = NULL;
+        self->running = NULL;
+        sp_worker_complete(self, job);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&self->lock);
+        job = sp_worker_pop(self);
+        pthread_mutex_unlock(&self->lock);
+        if (!job)
+            break;
+        sp_worker_complete(self, job);
+    }
+}
+
+/* picks the least loaded worker, or the one named by selector
+ * (by name, then by index), and reserves a slot on it
+ * returns NULL if the selector does not match anything
+ */
+SPWorker* sp_pool_acquire(SPPool* self, const char* selector) {
+    SPWorker* best = NULL;
+    unsigned int i;
+
+    pthread_mutex_lock(&self->lock);
+    if (selector) {
+        char* end;
+        unsigned long index = strtoul(selector, &end, 10);
+        for (i = 0; i < self->workers_length && !best; i++) {
+            if (strcmp(self->workers[i].name, selector) == 0)
+                best = &self->workers[i];
+        }
+        if (!best && *selector && !*end && index < self->workers_length)
+            best = &self->workers[index];
+    } else {
+        for (i = 0; i < self->workers_length; i++) {
+            if (!best || self->workers[i].load < best->load)
+                best = &self->workers[i];
+        }
+    }
+    if (best)
+        best->load++;
+    pthread_mutex_unlock(&self->lock);
+
+    return best;
+}
+
+/* like sp_pool_acquire, but only by index */
+SPWorker* sp_pool_acquire_index(SPPool* self, unsigned int index) {
+    SPWorker* w = NULL;
+
+    pthread_mutex_lock(&self->lock);
+    if (index < self->workers_length) {
+        w = &self->workers[index];
+        w->load++;
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    return w;
+}
+
+/* gives back a slot reserved by sp_pool_acquire that was never submitted */
+void sp_pool_release(SPPool* self, SPWorker* worker) {
+    pthread_mutex_lock(&self->lock);
+    worker->load--;
+    pthread_mutex_unlock(&self->lock);
+}
+
+void sp_pool_close(SPPool* self) {
+    unsigned int i;
+    if (!self)
+        return;
+
+    for (i = 0; i < self->workers_length; i++) {
+        SPWorker* w = &self->workers[i];
+        if (w->started) {
+            pthread_mutex_lock(&w->lock);
+            w->stopping = 1;
+            pthread_cond_signal(&w->cond);
+            pthread_mutex_unlock(&w->lock);
+            pthread_join(w->thread, NULL);
+        } else if (self->leased) {
+            /* late jobs from the binary listeners */
+            sp_worker_drain(w);
+        }
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+        if (self->leased)
+            sp_pair_release(w->pair);
+        sp_pair_close(w->pair);
+        free(w->name);
+    }
+
+    /* the workers are all done, so this gets every run */
+    sp_archive_close(self->archive);
+    pthread_mutex_destroy(&self->lock);
+    free(self->workers);
+    sp_cache_free(self->results);
+    if (self->wake_fd >= 0)
+        close(self->wake_fd);
+    free(self);
+}
+
+/* event loop mode: takes every pair's leases, since waiting for one
+ * would stall the loop, and binds their interrupts to eventfds.
+ * returns 0 on failure
+ */
+static int sp_pool_setup_events(SPPool* self) {
+    unsigned int i;
+
+    self->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (self->wake_fd < 0)
+        return 0;
+
+    for (i = 0; i < self->workers_length; i++) {
+        if (!sp_pair_acquire(self->workers[i].pair)) {
+            while (i--)
+                sp_pair_release(self->workers[i].pair);
+            return 0;
+        }
+    }
+    self->leased = 1;
+
+    for (i = 0; i < self->workers_length; i++) {
+        SPWorker* w = &self->workers[i];
+        if (sp_device_eventfd(w->pair->samp) < 0 || sp_device_eventfd(w->pair->play) < 0)
+            fprintf(stderr, "pair %s: no interrupts, polling instead\n", w->name);
+    }
+    return 1;
+}
+
+SPPool* sp_pool_open(const SPPairSpec* specs, unsigned int specs_length, const SPPoolOptions* options) {
+    unsigned int i;
+    SPPool* self = calloc(1, sizeof(SPPool));
+    if (!self)
+        return NULL;
+    pthread_mutex_init(&self->lock, NULL);
+    self->options = *options;
+    self->wake_fd = -1;
+
+    if (options->result_budget) {
+        self->results = sp_cache_new(options->result_budget);
+        if (!self->results) {
+            sp_pool_close(self);
+            return NULL;
+        }
+    }
+
+    self->workers = calloc(specs_length, sizeof(SPWorker));
+    if (!self->workers) {
+        sp_pool_close(self);
+        return NULL;
+    }
+
+    for (i = 0; i < specs_length; i++) {
+        SPWorker* w = &self->workers[i];
+        self->workers_length++;
+
+        w->pool = self;
+        w->name = strdup(specs[i].name);
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, NULL);
+
+        w->pair = sp_pair_open(specs[i].sampler, specs[i].player);
+        if (!w->pair) {
+            fprintf(stderr, "failed to open %s/%s\n", specs[i].sampler, specs[i].player);
+            sp_pool_close(self);
+            return NULL;
+        }
+
+        {
+            SPDevice* samp = w->pair->samp;
+            SPDevice* play = w->pair->play;
+            char key[3 * STRBUFSIZE];
+            snprintf(key, sizeof(key), "%s %s %s %d %d %d %d", w->name, samp->name, play->name,
+                     samp->sample_width, samp->time_length, play->sample_width, play->time_length);
+            w->result_key = sp_hash((const uint8_t*)key, strlen(key));
+        }
+
+        if (options->event_loop)
+            continue;
+        if (pthread_create(&w->thread, NULL, sp_worker_main, w) != 0) {
+            sp_pool_close(self);
+            return NULL;
+        }
+        w->started = 1;
+    }
+
+    if (options->archive_path) {
+        size_t capture_max = 0;
+        SPText pairs = {0};
+        for (i = 0; i < self->workers_length; i++) {
+            if (self->workers[i].pair->samp->length > capture_max)
+                capture_max = self->workers[i].pair->samp->length;
+            sp_text_printf(&pairs, "%s\n", self->workers[i].name);
+        }
+        if (pairs.data)
+            self->archive = sp_archive_open(options->archive_path, options->archive_segment, capture_max, pairs.data, options->realtime_cpu >= 0);
+        free(pairs.data);
+        if (!self->archive) {
+            sp_pool_close(self);
+            return NULL;
+        }
+    }
+
+    if (options->event_loop && !sp_pool_setup_events(self)) {
+        sp_pool_close(self);
+        return NULL;
+    }
+
+    return self;
+}
+
+/*
+ * parsing uploaded arrays (see server_pack in osuqlsp.py)
+ */
+
+typedef struct {
+    uint8_t header[8];
+    unsigned int header_length;
+    int incorrect_data;
+    uint32_t arrsize1;
+    uint32_t arrsize2;
+    uint32_t i;
+} SPUpload;
+
+/* feeds a chunk of upload into dest, padding each row out to
+ * dev->sample_length bytes. stops at the end of the array, and
+ * returns how much of data was used.
+ */
+size_t sp_upload_feed(SPUpload* self, SPDevice* dev, uint8_t* dest, const uint8_t* data, size_t length) {
+    size_t start = length;
+    uint32_t bytesize, end;
+
+    while (self->header_length < 8 && length) {
+        self->header[self->header_length++] = *data;
+        data++;
+        length--;
+
+        if (self->header_length == 8) {
+            const uint8_t* h = self->header;
+            self->arrsize1 = (h[0] << 24) | (h[1] << 16) | (h[2] << 8) | h[3];
+            self->arrsize2 = (h[4] << 24) | (h[5] << 16) | (h[6] << 8) | h[7];
+
+            if (self->arrsize1 > dev->time_length || self->arrsize2 > dev->sample_width)
+                self->incorrect_data = 1;
+            self->i = 0;
+        }
+    }
+
+    if (self->incorrect_data || self->header_length < 8)
+        return start - length;
+
+    bytesize = (self->arrsize2 + 7) / 8;
+    end = self->arrsize1 * dev->sample_length;
+    while (self->i < end) {
+        uint32_t column = self->i % dev->sample_length;
+        uint32_t amount;
+
+        /* if we're in a no-data zone, add zeroes until we're out */
+        if (column >= bytesize) {
+            amount = dev->sample_length - column;
+            memset(dest + self->i, 0, amount);
+            self->i += amount;
+            continue;
+        }
+
+        if (!length)
+            break;
+        amount = bytesize - column;
+        if (amount > length)
+            amount = length;
+        memcpy(dest + self->i, data, amount);
+        data += amount;
+        length -= amount;
+        self->i += amount;
+    }
+    return start - length;
+}
+
+/* returns 1 once every row of the array has been fed */
+int sp_upload_complete(SPUpload* self, SPDevice* dev) {
+    return self->header_length == 8 && !self->incorrect_data && self->i >= self->arrsize1 * dev->sample_length;
+}
+
+/* fills in the rest of dest with zeroes
+ * returns 0 if the upload was malformed
+ */
+int sp_upload_finish(SPUpload* self, SPDevice* dev, uint8_t* dest) {
+    /* an empty upload is fine, and means all zeroes */
+    if (self->incorrect_data || (self->header_length > 0 && self->header_length < 8))
+        return 0;
+
+    memset(dest + self->i, 0, dev->length - self->i);
+    self->i = dev->length;
+    return 1;
+}
+
+/*
+ * server-wide state, and the library of stored stimuli
+ */
+
+/* longest stimulus id, including the terminating 0 */
+#define SP_ID_LENGTH 64
+
+/* largest body we will hold in memory for a request */
+#define SP_MAX_UPLOAD (64 * 1024 * 1024)
+
+/* default stimulus library budget, in bytes */
+#define SP_STIMULI_BUDGET (64 * 1024 * 1024)
+
+typedef struct {
+    SPPool* pool;
+
+    /* uploads stored by POST /stimulus, keyed by sp_hash of their id */
+    SPCache* stimuli;
+
+    /* for /metrics, see sp_counter_add */
+    uint64_t requests;
+    uint64_t frames;
+    uint64_t bad_uploads;
+    uint64_t dropped_sessions;
+} SPContext;
+
+void sp_context_close(SPContext* self) {
+    sp_pool_close(self->pool);
+    sp_cache_free(self->stimuli);
+}
+
+static uint64_t sp_stimulus_key(const char* id) {
+    return sp_hash((const uint8_t*)id, strlen(id));
+}
+
+/* stores a packed upload (which must be malloc'd) under name, or under
+ * a hash of its contents if name is NULL. the id is written to id.
+ * returns 0 on failure, and frees data either way.
+ */
+int sp_stimulus_store(SPContext* self, const char* name, uint8_t* data, size_t length, char* id) {
+    if (length < 8) {
+        free(data);
+        return 0;
+    }
+
+    if (name) {
+        const char* c;
+        if (!*name || strlen(name) >= SP_ID_LENGTH) {
+            free(data);
+            return 0;
+        }
+        for (c = name; *c; c++) {
+            if (!(('a' <= *c && *c <= 'z') || ('A' <= *c && *c <= 'Z') || ('0' <= *c && *c <= '9') || *c == '_' || *c == '-' || *c == '.')) {
+                free(data);
+                return 0;
+            }
+        }
+        strcpy(id, name);
+    } else {
+        snprintf(id, SP_ID_LENGTH, "%016llx", (unsigned long long)sp_hash(data, length));
+    }
+
+    return sp_cache_put(self->stimuli, sp_stimulus_key(id), sp_hash_check((const uint8_t*)id, strlen(id)), strlen(id), data, length);
+}
+
+/* finds a stored stimulus. release it with sp_cache_unref. */
+SPCacheEntry* sp_stimulus_lookup(SPContext* self, const char* id) {
+    return sp_cache_get(self->stimuli, sp_stimulus_key(id), sp_hash_check((const uint8_t*)id, strlen(id)), strlen(id));
+}
+
+/* unpacks a stored stimulus into dest, padded for dev
+ * returns 0 if it does not fit
+ */
+int sp_stimulus_expand(SPCacheEntry* entry, SPDevice* dev, uint8_t* dest) {
+    SPUpload upload;
+    memset(&upload, 0, sizeof(upload));
+    sp_upload_feed(&upload, dev, dest, entry->data, entry->length);
+    return sp_upload_finish(&upload, dev, dest);
+}
+
+/*
+ * now, some infrastructure for dealing with HTTP requests
+ */
+
+typedef struct _SPState SPState;
+
+typedef int (*SPRequestFunc)(SPState*, struct MHD_Connection*, const uint8_t*, size_t*);
+
+struct _SPState {
+    SPRequestFunc handler;
+    struct MHD_Connection* conn;
+    SPContext* ctx;
+
+    SPWorker* worker;
+    SPUpload upload;
+    SPJob job;
+    int submitted;
+
+    /* for runs of a stored stimulus */
+    SPCacheEntry* stimulus;
+
+    /* for /run replies streamed straight from the worker */
+    SPStream* stream;
+
+    /* for /check, which array of the body we are on (0 for the
+     * stimulus, 1 for expected, 2 for the mask) and its parser
+     */
+    int check_stage;
+    SPUpload check;
+    uint32_t expected_rows;
+    uint32_t expected_bits;
+
+    /* time spent parsing the upload so far */
+    uint64_t upload_ns;
+
+    /* raw request body, for /stimulus */
+    uint8_t* body;
+    size_t body_length;
+    size_t body_capacity;
+    int body_too_large;
+};
+
+#define QUEUE_RESPONSE(conn, code, resp) do {           \
+        int ret = MHD_NO;                               \
+        if (resp) {                                     \
+            ret = MHD_queue_response(conn, code, resp); \
+            MHD_destroy_response(resp);                 \
+        }                                               \
+        return ret;                                     \
+    } while(0)
+
+#define QUEUE_STATIC_RESPONSE(conn, code, typ, str) do {            \
+        struct MHD_Response* response = MHD_create_response_from_buffer(strlen(str), (void*)(str), MHD_RESPMEM_PERSISTENT); \
+        if (response) {                                                 \
+            MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, typ);     \
+        }                                                               \
+        QUEUE_RESPONSE(conn, code, response);                      \
+    } while(0)
+
+#define QUEUE_ERROR_RESPONSE(conn, code, str) QUEUE_STATIC_RESPONSE(conn, code, "text/html", "<html><body><h1>" str "</h1></body></html>\n")
+
+/* wakes up a connection suspended while its job ran */
+static void sp_state_job_complete(SPJob* job) {
+    SPState* state = job->complete_data;
+    MHD_resume_connection(state->conn);
+}
+
+/*
+ * our HTTP request handlers
+ */
+
+static int handler_run(SPState* state, struct MHD_Connection* conn, const uint8_t* upload_data, size_t* data_size) {
+    SPPair* pair = state->worker->pair;
+
+    if (*data_size) {
+        /* runs of stored stimuli ignore any body */
+        if (!state->stimulus) {
+            uint64_t start = sp_now_ns();
+            sp_upload_feed(&state->upload, pair->play, state->job.inputs, upload_data, *data_size);
+            state->upload_ns += sp_now_ns() - start;
+        }
+        *data_size = 0;
+        return MHD_YES;
+    } else if (!state->submitted) {
+        uint64_t start = sp_now_ns();
+        int ok;
+
+        if (state->stimulus)
+            ok = sp_stimulus_expand(state->stimulus, pair->play, state->job.inputs);
+        else
+            ok = sp_upload_finish(&state->upload, pair->play, state->job.inputs);
+        if (!ok) {
+            sp_counter_add(&state->ctx->bad_uploads, 1);
+            QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_BAD_REQUEST, "Bad Request");
+        }
+        sp_job_tag(&state->job, pair->inputs_length);
+        state->upload_ns += sp_now_ns() - start;
+        sp_metric_record(&state->worker->stages[SP_STAGE_UPLOAD], state->upload_ns);
+
+        /* plain captures can go out while they are still being read */
+        if (!state->job.repeat && state->job.encoding == SP_ENCODING_IDENTITY) {
+            state->stream = sp_stream_new(conn);
+            state->job.stream = state->stream;
+        }
+
+        /* park this connection until the worker is done with it */
+        state->submitted = 1;
+        MHD_suspend_connection(conn);
+        sp_worker_submit(state->worker, &state->job);
+        return MHD_YES;
+    } else {
+        struct MHD_Response* response;
+
+        if (!state->job.ok) {
+            QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_INTERNAL_SERVER_ERROR, "Internal Server Error");
+        }
+
+        if (state->stream && state->stream->data) {
+            response = MHD_create_response_from_callback(state->stream->length + 8, SP_STREAM_CHUNK, &sp_stream_read, state->stream, &sp_stream_response_free);
+            if (response) {
+                sp_stream_ref(state->stream);
+                MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "application/octet-stream");
+            }
+            QUEUE_RESPONSE(conn, MHD_HTTP_OK, response);
+        }
+
+        response = MHD_create_response_from_buffer(state->job.outputs_length, state->job.outputs, MHD_RESPMEM_MUST_FREE);
+        if (response) {
+            state->job.outputs = NULL;
+            MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "application/octet-stream");
+            if (state->job.encoding != SP_ENCODING_IDENTITY)
+                MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_ENCODING, sp_encoding_names[state->job.encoding]);
+        }
+        QUEUE_RESPONSE(conn, MHD_HTTP_OK, response);
+    }
+}
+
+/* feeds the body of a /check: the stimulus (unless a stored one is
+ * used), the expected capture, and optionally a don't-care mask, each
+ * packed like an upload to /run
+ */
+static void sp_state_check_feed(SPState* state, const uint8_t* data, size_t length) {
+    SPPair* pair = state->worker->pair;
+
+    while (length && state->check_stage <= 2) {
+        SPUpload* upload = &state->check;
+        SPDevice* dev = pair->samp;
+        uint8_t* dest = state->check_stage == 1 ? state->job.expected : state->job.care;
+        size_t used;
+
+        if (state->check_stage == 0) {
+            upload = &state->upload;
+            dev = pair->play;
+            dest = state->job.inputs;
+        }
+
+        used = sp_upload_feed(upload, dev, dest, data, length);
+        data += used;
+        length -= used;
+
+        /* the parser only stops early at the end of an array, or on
+         * bad data
+         */
+        if (!sp_upload_complete(upload, dev))
+            return;
+
+        if (state->check_stage == 1) {
+            state->expected_rows = upload->arrsize1;
+            state->expected_bits = upload->arrsize2;
+        }
+        if (state->check_stage > 0) {
+            sp_upload_finish(upload, dev, dest);
+            memset(upload, 0, sizeof(SPUpload));
+        }
+        state->check_stage++;
+    }
+}
+
+static int handler_check(SPState* state, struct MHD_Connection* conn, const uint8_t* upload_data, size_t* data_size) {
+    SPPair* pair = state->worker->pair;
+
+    if (*data_size) {
+        uint64_t start = sp_now_ns();
+        sp_state_check_feed(state, upload_data, *data_size);
+        state->upload_ns += sp_now_ns() - start;
+        *data_size = 0;
+        return MHD_YES;
+    } else if (!state->submitted) {
+        uint64_t start = sp_now_ns();
+
+        /* a mask, if there is one, must be whole */
+        if (state->check_stage < 2 || (state->check_stage == 2 && state->check.header_length > 0)) {
+            sp_counter_add(&state->ctx->bad_uploads, 1);
+            QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_BAD_REQUEST, "Bad Request");
+        }
+        sp_check_care(pair->samp, state->job.care, state->expected_rows, state->expected_bits, state->check_stage > 2);
+        state->upload_ns += sp_now_ns() - start;
+    }
+
+    /* the rest is just like a run */
+    return handler_run(state, conn, upload_data, data_size);
+}
+
+static int handler_store(SPState* state, struct MHD_Connection* conn, const uint8_t* upload_data, size_t* data_size) {
+    const char* name;
+    char id[SP_ID_LENGTH];
+    struct MHD_Response* response;
+
+    if (*data_size) {
+        if (state->body_length + *data_size > SP_MAX_UPLOAD) {
+            state->body_too_large = 1;
+        } else {
+            if (state->body_length + *data_size > state->body_capacity) {
+                size_t capacity = state->body_capacity ? state->body_capacity : STRBUFSIZE;
+                uint8_t* body;
+                while (capacity < state->body_length + *data_size)
+                    capacity *= 2;
+                body = realloc(state->body, capacity);
+                if (!body) {
+                    state->body_too_large = 1;
+                    *data_size = 0;
+                    return MHD_YES;
+                }
+                state->body = body;
+                state->body_capacity = capacity;
+            }
+            memcpy(state->body + state->body_length, upload_data, *data_size);
+            state->body_length += *data_size;
+        }
+        *data_size = 0;
+        return MHD_YES;
+    }
+
+    if (state->body_too_large)
+        QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_REQUEST_ENTITY_TOO_LARGE, "Request Entity Too Large");
+
+    name = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "name");
+    if (!sp_stimulus_store(state->ctx, name, state->body, state->body_length, id)) {
+        state->body = NULL;
+        QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_BAD_REQUEST, "Bad Request");
+    }
+    state->body = NULL;
+
+    response = MHD_create_response_from_buffer(strlen(id), id, MHD_RESPMEM_MUST_COPY);
+    if (response) {
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain");
+    }
+    QUEUE_RESPONSE(conn, MHD_HTTP_OK, response);
+}
+
+static int handler_latency(SPState* state, struct MHD_Connection* conn, const uint8_t* upload_data, size_t* data_size) {
+    SPPool* pool = state->ctx->pool;
+    struct MHD_Response* response;
+    SPText text = {0};
+    unsigned int i;
+
+    for (i = 0; i < pool->workers_length; i++) {
+        SPWorker* w = &pool->workers[i];
+        SPHistogram latency;
+
+        pthread_mutex_lock(&w->lock);
+        latency = w->latency;
+        pthread_mutex_unlock(&w->lock);
+
+        sp_text_printf(&text, "pair %s (%s):\n", w->name, w->realtime ? "realtime" : "default");
+        sp_histogram_print(&latency, &text);
+    }
+    if (!text.data)
+        QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_INTERNAL_SERVER_ERROR, "Internal Server Error");
+
+    response = MHD_create_response_from_buffer(text.length, text.data, MHD_RESPMEM_MUST_FREE);
+    if (response) {
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain");
+    } else {
+        free(text.data);
+    }
+    QUEUE_RESPONSE(conn, MHD_HTTP_OK, response);
+}
+
+/* the quantiles /metrics estimates for every stage */
+static const double sp_metric_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static int handler_metrics(SPState* state, struct MHD_Connection* conn, const uint8_t* upload_data, size_t* data_size) {
+    SPContext* ctx = state->ctx;
+    SPPool* pool = ctx->pool;
+    SPCache* stimuli = ctx->stimuli;
+    struct MHD_Response* response;
+    SPText text = {0};
+    char labels[STRBUFSIZE];
+    uint64_t used, budget, hits, misses, evictions;
+    unsigned int i, j, k;
+
+    sp_text_printf(&text, "# HELP sp_requests_total HTTP requests received.\n");
+    sp_text_printf(&text, "# TYPE sp_requests_total counter\n");
+    sp_text_printf(&text, "sp_requests_total %llu\n", (unsigned long long)sp_counter_get(&ctx->requests));
+    sp_text_printf(&text, "# HELP sp_frames_total Binary protocol frames received.\n");
+    sp_text_printf(&text, "# TYPE sp_frames_total counter\n");
+    sp_text_printf(&text, "sp_frames_total %llu\n", (unsigned long long)sp_counter_get(&ctx->frames));
+    sp_text_printf(&text, "# HELP sp_bad_uploads_total Uploads rejected as malformed or too big for the pair.\n");
+    sp_text_printf(&text, "# TYPE sp_bad_uploads_total counter\n");
+    sp_text_printf(&text, "sp_bad_uploads_total %llu\n", (unsigned long long)sp_counter_get(&ctx->bad_uploads));
+    sp_text_printf(&text, "# HELP sp_dropped_sessions_total Binary protocol clients dropped for not reading their replies.\n");
+    sp_text_printf(&text, "# TYPE sp_dropped_sessions_total counter\n");
+    sp_text_printf(&text, "sp_dropped_sessions_total %llu\n", (unsigned long long)sp_counter_get(&ctx->dropped_sessions));
+
+    pthread_mutex_lock(&stimuli->lock);
+    used = stimuli->used;
+    budget = stimuli->budget;
+    hits = stimuli->hits;
+    misses = stimuli->misses;
+    evictions = stimuli->evictions;
+    pthread_mutex_unlock(&stimuli->lock);
+
+    sp_text_printf(&text, "# HELP sp_stimuli_bytes Bytes held by the stored stimulus library.\n");
+    sp_text_printf(&text, "# TYPE sp_stimuli_bytes gauge\n");
+    sp_text_printf(&text, "sp_stimuli_bytes %llu\n", (unsigned long long)used);
+    sp_text_printf(&text, "# HELP sp_stimuli_budget_bytes Most bytes the stored stimulus library may hold.\n");
+    sp_text_printf(&text, "# TYPE sp_stimuli_budget_bytes gauge\n");
+    sp_text_printf(&text, "sp_stimuli_budget_bytes %llu\n", (unsigned long long)budget);
+    sp_text_printf(&text, "# HELP sp_stimuli_lookups_total Stored stimulus lookups, by result.\n");
+    sp_text_printf(&text, "# TYPE sp_stimuli_lookups_total counter\n");
+    sp_text_printf(&text, "sp_stimuli_lookups_total{result=\"hit\"} %llu\n", (unsigned long long)hits);
+    sp_text_printf(&text, "sp_stimuli_lookups_total{result=\"miss\"} %llu\n", (unsigned long long)misses);
+    sp_text_printf(&text, "# HELP sp_stimuli_evictions_total Stored stimuli evicted to stay under budget.\n");
+    sp_text_printf(&text, "# TYPE sp_stimuli_evictions_total counter\n");
+    sp_text_printf(&text, "sp_stimuli_evictions_total %llu\n", (unsigned long long)evictions);
+
+    sp_text_printf(&text, "# HELP sp_queue_depth Jobs assigned to a pair and not yet finished.\n");
+    sp_text_printf(&text, "# TYPE sp_queue_depth gauge\n");
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < pool->workers_length; i++)
+        sp_text_printf(&text, "sp_queue_depth{pair=\"%s\"} %u\n", pool->workers[i].name, pool->workers[i].load);
+    pthread_mutex_unlock(&pool->lock);
+
+    sp_text_printf(&text, "# HELP sp_runs_total Completed hardware runs.\n");
+    sp_text_printf(&text, "# TYPE sp_runs_total counter\n");
+    for (i = 0; i < pool->workers_length; i++)
+        sp_text_printf(&text, "sp_runs_total{pair=\"%s\"} %llu\n", pool->workers[i].name, (unsigned long long)sp_counter_get(&pool->workers[i].runs));
+    sp_text_printf(&text, "# HELP sp_run_errors_total Hardware runs that failed to read back a capture.\n");
+    sp_text_printf(&text, "# TYPE sp_run_errors_total counter\n");
+    for (i = 0; i < pool->workers_length; i++)
+        sp_text_printf(&text, "sp_run_errors_total{pair=\"%s\"} %llu\n", pool->workers[i].name, (unsigned long long)sp_counter_get(&pool->workers[i].run_errors));
+    sp_text_printf(&text, "# HELP sp_player_writes_skipped_total Runs whose stimulus was already in the player.\n");
+    sp_text_printf(&text, "# TYPE sp_player_writes_skipped_total counter\n");
+    for (i = 0; i < pool->workers_length; i++)
+        sp_text_printf(&text, "sp_player_writes_skipped_total{pair=\"%s\"} %llu\n", pool->workers[i].name, (unsigned long long)sp_counter_get(&pool->workers[i].pair->writes_skipped));
+
+    if (pool->results) {
+        SPCache* results = pool->results;
+        pthread_mutex_lock(&results->lock);
+        used = results->used;
+        budget = results->budget;
+        hits = results->hits;
+        misses = results->misses;
+        evictions = results->evictions;
+        pthread_mutex_unlock(&results->lock);
+
+        sp_text_printf(&text, "# HELP sp_results_bytes Bytes held by the result cache.\n");
+        sp_text_printf(&text, "# TYPE sp_results_bytes gauge\n");
+        sp_text_printf(&text, "sp_results_bytes %llu\n", (unsigned long long)used);
+        sp_text_printf(&text, "# HELP sp_results_budget_bytes Most bytes the result cache may hold.\n");
+        sp_text_printf(&text, "# TYPE sp_results_budget_bytes gauge\n");
+        sp_text_printf(&text, "sp_results_budget_bytes %llu\n", (unsigned long long)budget);
+        sp_text_printf(&text, "# HELP sp_results_lookups_total Result cache lookups, by result.\n");
+        sp_text_printf(&text, "# TYPE sp_results_lookups_total counter\n");
+        sp_text_printf(&text, "sp_results_lookups_total{result=\"hit\"} %llu\n", (unsigned long long)hits);
+        sp_text_printf(&text, "sp_results_lookups_total{result=\"miss\"} %llu\n", (unsigned long long)misses);
+        sp_text_printf(&text, "# HELP sp_results_evictions_total Captures evicted from the result cache to stay under budget.\n");
+        sp_text_printf(&text, "# TYPE sp_results_evictions_total counter\n");
+        sp_text_printf(&text, "sp_results_evictions_total %llu\n", (unsigned long long)evictions);
+        sp_text_printf(&text, "# HELP sp_results_verified_total Result cache hits run anyway, by whether the hardware agreed.\n");
+        sp_text_printf(&text, "# TYPE sp_results_verified_total counter\n");
+        for (i = 0; i < pool->workers_length; i++) {
+            sp_text_printf(&text, "sp_results_verified_total{pair=\"%s\",result=\"match\"} %llu\n", pool->workers[i].name, (unsigned long long)sp_counter_get(&pool->workers[i].result_matches));
+            sp_text_printf(&text, "sp_results_verified_total{pair=\"%s\",result=\"drift\"} %llu\n", pool->workers[i].name, (unsigned long long)sp_counter_get(&pool->workers[i].result_drifts));
+        }
+    }
+
+    if (pool->archive) {
+        SPArchive* archive = pool->archive;
+        sp_text_printf(&text, "# HELP sp_archive_runs_total Runs written to the archive.\n");
+        sp_text_printf(&text, "# TYPE sp_archive_runs_total counter\n");
+        sp_text_printf(&text, "sp_archive_runs_total %llu\n", (unsigned long long)sp_counter_get(&archive->runs));
+        sp_text_printf(&text, "# HELP sp_archive_dropped_total Runs left out of the archive for lack of space, or of a segment ready in time.\n");
+        sp_text_printf(&text, "# TYPE sp_archive_dropped_total counter\n");
+        sp_text_printf(&text, "sp_archive_dropped_total %llu\n", (unsigned long long)sp_counter_get(&archive->dropped));
+        sp_text_printf(&text, "# HELP sp_archive_commits_total Group commits flushing the archive to disk.\n");
+        sp_text_printf(&text, "# TYPE sp_archive_commits_total counter\n");
+        sp_text_printf(&text, "sp_archive_commits_total %llu\n", (unsigned long long)sp_counter_get(&archive->commits));
+        sp_text_printf(&text, "# HELP sp_archive_commit_seconds Time taken by each archive commit.\n");
+        sp_text_printf(&text, "# TYPE sp_archive_commit_seconds histogram\n");
+        sp_metric_print(&archive->commit_ns, &text, "sp_archive_commit_seconds", "");
+    }
+
+    sp_text_printf(&text, "# HELP sp_device_info Sampler and player geometry.\n");
+    sp_text_printf(&text, "# TYPE sp_device_info gauge\n");
+    for (i = 0; i < pool->workers_length; i++) {
+        SPDevice* devs[2] = {pool->workers[i].pair->samp, pool->workers[i].pair->play};
+        for (j = 0; j < 2; j++)
+            sp_text_printf(&text, "sp_device_info{pair=\"%s\",device=\"%s\",sample_width=\"%d\",time_length=\"%d\",length=\"%d\"} 1\n",
+                           pool->workers[i].name, devs[j]->name, devs[j]->sample_width, devs[j]->time_length, devs[j]->length);
+    }
+    sp_text_printf(&text, "# HELP sp_device_io_bytes_total Bytes read from samplers and written to players.\n");
+    sp_text_printf(&text, "# TYPE sp_device_io_bytes_total counter\n");
+    for (i = 0; i < pool->workers_length; i++) {
+        SPDevice* devs[2] = {pool->workers[i].pair->samp, pool->workers[i].pair->play};
+        for (j = 0; j < 2; j++)
+            sp_text_printf(&text, "sp_device_io_bytes_total{pair=\"%s\",device=\"%s\"} %llu\n",
+                           pool->workers[i].name, devs[j]->name, (unsigned long long)sp_counter_get(&devs[j]->io_bytes));
+    }
+    sp_text_printf(&text, "# HELP sp_device_io_calls_total Read and write calls made on samplers and players.\n");
+    sp_text_printf(&text, "# TYPE sp_device_io_calls_total counter\n");
+    for (i = 0; i < pool->workers_length; i++) {
+        SPDevice* devs[2] = {pool->workers[i].pair->samp, pool->workers[i].pair->play};
+        for (j = 0; j < 2; j++)
+            sp_text_printf(&text, "sp_device_io_calls_total{pair=\"%s\",device=\"%s\"} %llu\n",
+                           pool->workers[i].name, devs[j]->name, (unsigned long long)sp_counter_get(&devs[j]->io_calls));
+    }
+
+    sp_text_printf(&text, "# HELP sp_stage_seconds Time spent in each stage of handling a run.\n");
+    sp_text_printf(&text, "# TYPE sp_stage_seconds histogram\n");
+    for (i = 0; i < pool->workers_length; i++) {
+        for (k = 0; k < SP_STAGES; k++) {
+            snprintf(labels, STRBUFSIZE, "pair=\"%s\",stage=\"%s\"", pool->workers[i].name, sp_stage_names[k]);
+            sp_metric_print(&pool->workers[i].stages[k], &text, "sp_stage_seconds", labels);
+        }
+    }
+    sp_text_printf(&text, "# HELP sp_stage_quantile_seconds Estimated quantiles of sp_stage_seconds, to within about 12%%.\n");
+    sp_text_printf(&text, "# TYPE sp_stage_quantile_seconds gauge\n");
+    for (i = 0; i < pool->workers_length; i++) {
+        for (k = 0; k < SP_STAGES; k++) {
+            for (j = 0; j < sizeof(sp_metric_quantiles) / sizeof(sp_metric_quantiles[0]); j++) {
+                sp_text_printf(&text, "sp_stage_quantile_seconds{pair=\"%s\",stage=\"%s\",quantile=\"%g\"} %.9g\n",
+                               pool->workers[i].name, sp_stage_names[k], sp_metric_quantiles[j],
+                               sp_metric_quantile(&pool->workers[i].stages[k], sp_metric_quantiles[j]) / 1e9);
+            }
+        }
+    }
+
+    if (!text.data)
+        QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_INTERNAL_SERVER_ERROR, "Internal Server Error");
+
+    response = MHD_create_response_from_buffer(text.length, text.data, MHD_RESPMEM_MUST_FREE);
+    if (response) {
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain; version=0.0.4");
+    } else {
+        free(text.data);
+    }
+    QUEUE_RESPONSE(conn, MHD_HTTP_OK, response);
+}
+
+static int handler_default(void* cls, struct MHD_Connection* conn, const char* url, const char* method, const char* verison, const char* upload_data, size_t* upload_data_size, void** ptr) {
+    SPContext* ctx = cls;
+    SPState* state = *ptr;
+
+    if (!(*ptr)) {
+        /* this is the first call, it has only read headers */
+        sp_counter_add(&ctx->requests, 1);
+        state = *ptr = calloc(1, sizeof(SPState));
+        if (!(*ptr))
+            QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_INTERNAL_SERVER_ERROR, "Internal Server Error");
+        state->conn = conn;
+        state->ctx = ctx;
+
+        if ((strcmp(url, "/run") == 0 || strcmp(url, "/check") == 0) && strcmp(method, "POST") == 0) {
+            const char* selector = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "pair");
+            const char* stimulus = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "stimulus");
+            if (stimulus) {
+                state->stimulus = sp_stimulus_lookup(ctx, stimulus);
+                if (!state->stimulus)
+                    QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_NOT_FOUND, "Not Found");
+            }
+
+            state->worker = sp_pool_acquire(ctx->pool, selector);
+            if (!state->worker)
+                QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_NOT_FOUND, "Not Found");
+
+            state->job.inputs = sp_worker_alloc_inputs(state->worker);
+            if (!state->job.inputs)
+                QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_INTERNAL_SERVER_ERROR, "Internal Server Error");
+            state->job.complete = sp_state_job_complete;
+            state->job.complete_data = state;
+            state->job.encoding = sp_encoding_parse(MHD_lookup_connection_value(conn, MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT_ENCODING));
+
+            state->handler = handler_run;
+            if (strcmp(url, "/run") == 0) {
+                const char* repeat = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "repeat");
+                const char* result = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "result");
+
+                if (repeat) {
+                    char* end;
+                    unsigned long r = strtoul(repeat, &end, 10);
+                    if (!*repeat || *end || r < 1 || r > SP_REPEAT_MAX)
+                        QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_BAD_REQUEST, "Bad Request");
+                    state->job.repeat = r;
+                }
+                if (result && strcmp(result, "majority") == 0)
+                    state->job.majority = 1;
+                else if (result && strcmp(result, "counts") != 0)
+                    QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_BAD_REQUEST, "Bad Request");
+            } else {
+                const char* limit = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "limit");
+                size_t length = state->worker->pair->outputs_length;
+
+                state->job.limit = SP_CHECK_DEFAULT_LIMIT;
+                if (limit) {
+                    char* end;
+                    unsigned long l = strtoul(limit, &end, 10);
+                    if (!*limit || *end || l > SP_CHECK_MAX_LIMIT)
+                        QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_BAD_REQUEST, "Bad Request");
+                    state->job.limit = l;
+                }
+
+                state->job.expected = malloc(length);
+                state->job.care = calloc(1, length);
+                if (!state->job.expected || !state->job.care)
+                    QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_INTERNAL_SERVER_ERROR, "Internal Server Error");
+                if (state->stimulus)
+                    state->check_stage = 1;
+                state->handler = handler_check;
+            }
+            return MHD_YES;
+        } else if (strcmp(url, "/stimulus") == 0 && strcmp(method, "POST") == 0) {
+            state->handler = handler_store;
+            return MHD_YES;
+        } else if (strcmp(url, "/latency") == 0 && strcmp(method, "GET") == 0) {
+            state->handler = handler_latency;
+            return MHD_YES;
+        } else if (strcmp(url, "/metrics") == 0 && strcmp(method, "GET") == 0) {
+            state->handler = handler_metrics;
+            return MHD_YES;
+        } else {
+            QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_NOT_FOUND, "Not Found");
+        }
+    }
+
+    return state->handler(state, conn, (const uint8_t*)upload_data, upload_data_size);
+}
+
+static void request_completed(void* cls, struct MHD_Connection* conn, void** ptr, enum MHD_RequestTerminationCode toe) {
+    SPContext* ctx = cls;
+    SPState* state = *ptr;
+
+    if (state) {
+        /* a submitted job gives back its own slot when it finishes */
+        if (state->worker && !state->submitted)
+            sp_pool_release(ctx->pool, state->worker);
+        if (state->stimulus)
+            sp_cache_unref(ctx->stimuli, state->stimulus);
+        if (state->stream) {
+            sp_stream_detach(state->stream);
+            sp_stream_unref(state->stream);
+        }
+        free(state->body);
+        free(state->job.inputs);
+        free(state->job.expected);
+        free(state->job.care);
+        free(state->job.outputs);
+        free(state);
+        *ptr = NULL;
+    }
+}
 
 /*
- * First off, some generic sampler/player drivers
- */
-
-/* swaps bit order in a single byte */
-static uint8_t swaptable[256] = {
-     0, 128,  64, 192,  32, 160,  96, 224,  16, 144,  80, 208,  48,
-    176, 112, 240,   8, 136,  72, 200,  40, 168, 104, 232,  24, 152,
-     88, 216,  56, 184, 120, 248,   4, 132,  68, 196,  36, 164, 100,
-    228,  20, 148,  84, 212,  52, 180, 116, 244,  12, 140,  76, 204,
-     44, 172, 108, 236,  28, 156,  92, 220,  60, 188, 124, 252,   2,
-    130,  66, 194,  34, 162,  98, 226,  18, 146,  82, 210,  50, 178,
-    114, 242,  10, 138,  74, 202,  42, 170, 106, 234,  26, 154,  90,
-    218,  58, 186, 122, 250,   6, 134,  70, 198,  38, 166, 102, 230,
-     22, 150,  86, 214,  54, 182, 118, 246,  14, 142,  78, 206,  46,
-    174, 110, 238,  30, 158,  94, 222,  62, 190, 126, 254,   1, 129,
-     65, 193,  33, 161,  97, 225,  17, 145,  81, 209,  49, 177, 113,
-    241,   9, 137,  73, 201,  41, 169, 105, 233,  25, 153,  89, 217,
-     57, 185, 121, 249,   5, 133,  69, 197,  37, 165, 101, 229,  21,
-    149,  85, 213,  53, 181, 117, 245,  13, 141,  77, 205,  45, 173,
-    109, 237,  29, 157,  93, 221,  61, 189, 125, 253,   3, 131,  67,
-    195,  35, 163,  99, 227,  19, 147,  83, 211,  51, 179, 115, 243,
-     11, 139,  75, 203,  43, 171, 107, 235,  27, 155,  91, 219,  59,
-    187, 123, 251,   7, 135,  71, 199,  39, 167, 103, 231,  23, 151,
-     87, 215,  55, 183, 119, 247,  15, 143,  79, 207,  47, 175, 111,
-    239,  31, 159,  95, 223,  63, 191, 127, 255
+ * a lighter, persistent binary protocol over TCP and unix sockets
+ *
+ * every frame, both ways, starts with a 12 byte big-endian header:
+ *   u32 payload length
+ *   u32 request id, echoed back in the response
+ *   u8  op (for requests) or status (for responses)
+ *   u8  flags
+ *   u16 pair index, or SP_FRAME_ANY_PAIR to pick the least loaded
+ * run requests carry the same payload as a POST to /run, and their
+ * responses carry the same payload as its reply. responses may come
+ * back out of order when several runs are in flight.
+ *
+ * the flags of a run request ask for a capture encoding (an
+ * SP_ENCODING_* value), and the flags of its response say which one
+ * was actually used. they are 0 everywhere else.
+ *
+ * store requests carry a u16 name length, the name (which may be
+ * empty), and then the same payload as a POST to /stimulus. their
+ * responses carry the stimulus id. run stored requests carry just the
+ * id, and are answered like runs.
+ */
+
+#define SP_FRAME_HEADER 12
+#define SP_FRAME_ANY_PAIR 0xffff
+#define SP_FRAME_MAX_PAYLOAD SP_MAX_UPLOAD
+#define SP_FRAME_CHUNK (64 * 1024)
+
+/* most reply bytes a session may have waiting on a client, though one
+ * frame alone always fits. past that, or once nothing has gone out for
+ * SP_SESSION_STALL_NS, the client is dropped
+ */
+#define SP_SESSION_QUEUE_MAX (64 * 1024 * 1024)
+#define SP_SESSION_STALL_NS (30 * 1000000000ull)
+
+enum {
+    SP_OP_RUN = 1,
+    SP_OP_STORE = 2,
+    SP_OP_RUN_STORED = 3,
+};
+
+enum {
+    SP_STATUS_OK = 0,
+    SP_STATUS_BAD_REQUEST = 1,
+    SP_STATUS_NOT_FOUND = 2,
+    SP_STATUS_ERROR = 3,
+};
+
+typedef struct _SPListener SPListener;
+typedef struct _SPSession SPSession;
+typedef struct _SPFrameOut SPFrameOut;
+
+/* a reply waiting to be written, see sp_session_queue */
+struct _SPFrameOut {
+    SPFrameOut* next;
+    uint8_t header[SP_FRAME_HEADER];
+    uint8_t* payload;
+    size_t length;
+    /* how much of header and payload has gone out */
+    size_t sent;
+};
+
+struct _SPSession {
+    SPListener* listener;
+    SPSession* next;
+    /* non-blocking, so only the reading thread ever waits on it */
+    int fd;
+    /* tells the reading thread there is more to flush, or fewer refs */
+    int wake_fd;
+
+    /* guards everything below */
+    pthread_mutex_t lock;
+    /* one for the reading thread, and one per job in flight */
+    unsigned int refs;
+    /* replies not yet written, oldest first, and their unsent bytes */
+    SPFrameOut* out_head;
+    SPFrameOut* out_tail;
+    size_t out_bytes;
+    /* when the queue was last empty or last made progress */
+    uint64_t out_progress;
+    /* set once the session is given up on, after which nothing is sent */
+    int dropped;
+};
+
+struct _SPListener {
+    SPContext* ctx;
+    int fd;
+    char* path;
+    pthread_t thread;
+
+    /* guards everything below */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    SPSession* sessions;
+    int stopping;
 };
 
-typedef struct {
-    char* name;
-    enum {
-        SP_SAMPLER,
-        SP_PLAYER,
-    } type;
-    int fd;
+typedef struct {
+    SPJob job;
+    SPSession* session;
+    SPWorker* worker;
+    uint32_t id;
+} SPFrameJob;
+
+static void sp_frame_out_free(SPFrameOut* frame) {
+    free(frame->payload);
+    free(frame);
+}
+
+/* gives up on the session, with the lock held: queued replies are
+ * thrown away, and the reading thread wakes up to find the socket shut
+ */
+static void sp_session_drop(SPSession* self) {
+    if (self->dropped)
+        return;
+    self->dropped = 1;
+    while (self->out_head) {
+        SPFrameOut* frame = self->out_head;
+        self->out_head = frame->next;
+        sp_frame_out_free(frame);
+    }
+    self->out_tail = NULL;
+    self->out_bytes = 0;
+    shutdown(self->fd, SHUT_RDWR);
+    eventfd_write(self->wake_fd, 1);
+}
+
+/* writes as much of the queue as the socket takes without blocking,
+ * with the lock held. drops the session if the socket fails.
+ */
+static void sp_session_flush(SPSession* self) {
+    while (self->out_head) {
+        SPFrameOut* frame = self->out_head;
+        struct iovec iov[2];
+        struct msghdr msg;
+        ssize_t amount;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        if (frame->sent < SP_FRAME_HEADER) {
+            iov[0].iov_base = frame->header + frame->sent;
+            iov[0].iov_len = SP_FRAME_HEADER - frame->sent;
+            iov[1].iov_base = frame->payload;
+            iov[1].iov_len = frame->length;
+            msg.msg_iovlen = frame->length ? 2 : 1;
+        } else {
+            iov[0].iov_base = frame->payload + (frame->sent - SP_FRAME_HEADER);
+            iov[0].iov_len = frame->length - (frame->sent - SP_FRAME_HEADER);
+            msg.msg_iovlen = 1;
+        }
 
-    int sample_width;
-    int sample_bits;
-    int sample_length;
-    int time_bits;
-    int time_length;
-    int bits;
-    int length;
+        amount = sendmsg(self->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (amount < 0 && errno == EINTR)
+            continue;
+        if (amount < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (amount <= 0) {
+            sp_session_drop(self);
+            return;
+        }
 
-    uint8_t* data;
-} SPDevice;
+        frame->sent += amount;
+        self->out_bytes -= amount;
+        self->out_progress = sp_now_ns();
+        if (frame->sent == SP_FRAME_HEADER + frame->length) {
+            self->out_head = frame->next;
+            if (!self->out_head)
+                self->out_tail = NULL;
+            sp_frame_out_free(frame);
+        }
+    }
+}
 
-int sp_device_sysfs_read(SPDevice* self, const char* key, char* buffer, size_t buffer_len) {
-    char fname[STRBUFSIZE];
-    int i;
-    FILE* fp;
-    snprintf(fname, STRBUFSIZE, "/sys/block/%s/device/%s", self->name, key);
-    fp = fopen(fname, "r");
-    if (!fp)
+/* queues a whole frame, taking payload (which must be malloc'd, or
+ * NULL), and sends what it can right away. the rest is left for the
+ * reading thread, so this never blocks, and is safe to call from any
+ * thread. returns 0 if the session has been dropped.
+ */
+static int sp_session_queue(SPSession* self, uint32_t id, uint8_t status, uint8_t flags, uint16_t pair, uint8_t* payload, size_t length) {
+    SPFrameOut* frame = calloc(1, sizeof(SPFrameOut));
+    int ok;
+
+    pthread_mutex_lock(&self->lock);
+    if (!frame) {
+        /* the client would wait forever for this reply */
+        sp_session_drop(self);
+    } else if (self->out_head && self->out_bytes + SP_FRAME_HEADER + length > SP_SESSION_QUEUE_MAX && !self->dropped) {
+        fprintf(stderr, "dropping a binary client that is not reading its replies\n");
+        sp_counter_add(&self->listener->ctx->dropped_sessions, 1);
+        sp_session_drop(self);
+    }
+    if (self->dropped) {
+        pthread_mutex_unlock(&self->lock);
+        free(payload);
+        free(frame);
         return 0;
-    i = fread(buffer, 1, buffer_len, fp);
-    buffer[i] = 0;
-    fclose(fp);
-
-    // strip off whitespace at end
-    for (i = i - 1; i >= 0; i--) {
-        if (buffer[i] == '\n')
-            buffer[i] = 0;
-        else
-            break;
     }
-    return 1;
-}
 
-int sp_device_sysfs_read_int(SPDevice* self, const char* key) {
-    char buffer[STRBUFSIZE];
-    if (!sp_device_sysfs_read(self, key, buffer, STRBUFSIZE)) {
-        return -1;
+    sp_put_be32(frame->header, length);
+    sp_put_be32(frame->header + 4, id);
+    frame->header[8] = status;
+    frame->header[9] = flags;
+    frame->header[10] = (pair >> 8) & 0xff;
+    frame->header[11] = pair & 0xff;
+    frame->payload = payload;
+    frame->length = length;
+
+    if (self->out_tail) {
+        self->out_tail->next = frame;
+    } else {
+        self->out_head = frame;
+        self->out_progress = sp_now_ns();
     }
-    return atoi(buffer);
-}
+    self->out_tail = frame;
+    self->out_bytes += SP_FRAME_HEADER + length;
 
-int sp_device_get_enabled(SPDevice* self) {
-    return ioctl(self->fd, OSUQL_SP_GET_ENABLED);
-}
+    sp_session_flush(self);
+    if (self->out_head)
+        eventfd_write(self->wake_fd, 1);
+    ok = !self->dropped;
+    pthread_mutex_unlock(&self->lock);
 
-void sp_device_set_enabled(SPDevice* self, int enabled) {
-    ioctl(self->fd, OSUQL_SP_SET_ENABLED, enabled);
+    return ok;
 }
 
-int sp_device_get_done(SPDevice* self) {
-    return ioctl(self->fd, OSUQL_SP_GET_DONE);
+/* queues a whole frame, copying payload. see sp_session_queue */
+int sp_session_send_flags(SPSession* self, uint32_t id, uint8_t status, uint8_t flags, uint16_t pair, const uint8_t* payload, size_t length) {
+    uint8_t* copy = NULL;
+
+    if (length) {
+        copy = malloc(length);
+        if (!copy) {
+            pthread_mutex_lock(&self->lock);
+            sp_session_drop(self);
+            pthread_mutex_unlock(&self->lock);
+            return 0;
+        }
+        memcpy(copy, payload, length);
+    }
+    return sp_session_queue(self, id, status, flags, pair, copy, length);
 }
 
-static inline void sp_device_swap_data(SPDevice* self) {
-    unsigned int i;
-    for (i = 0; i < self->length; i++)
-        self->data[i] = swaptable[self->data[i]];
+int sp_session_send(SPSession* self, uint32_t id, uint8_t status, uint16_t pair, const uint8_t* payload, size_t length) {
+    return sp_session_send_flags(self, id, status, 0, pair, payload, length);
 }
 
-const uint8_t* sp_device_read(SPDevice* self) {
-    uint8_t* data = self->data;
-    unsigned int length = self->length;
-    lseek(self->fd, 0, SEEK_SET);
-    while (length) {
-        ssize_t amount = read(self->fd, data, length);
-        if (amount <= 0)
-            return NULL;
-        data += amount;
-        if (amount > length)
-            length = 0;
-        else
-            length -= amount;
+/* reading thread only: sleeps until the socket is readable (if reading
+ * is set), flushing queued replies as the socket takes them. without
+ * reading, it returns once the jobs in flight have all replied and the
+ * replies are out. returns 0 when the session should end.
+ */
+static int sp_session_wait(SPSession* self, int reading) {
+    for (;;) {
+        struct pollfd fds[2];
+        int timeout = -1;
+        int waiting, done;
+
+        pthread_mutex_lock(&self->lock);
+        if (self->out_head && !self->dropped) {
+            uint64_t idle = sp_now_ns() - self->out_progress;
+            if (idle >= SP_SESSION_STALL_NS) {
+                fprintf(stderr, "dropping a binary client that is not reading its replies\n");
+                sp_counter_add(&self->listener->ctx->dropped_sessions, 1);
+                sp_session_drop(self);
+            } else {
+                timeout = (SP_SESSION_STALL_NS - idle) / 1000000 + 1;
+            }
+        }
+        waiting = self->out_head != NULL;
+        done = self->dropped || (!reading && !waiting && self->refs == 1);
+        pthread_mutex_unlock(&self->lock);
+        if (done)
+            return 0;
+
+        fds[0].fd = self->fd;
+        fds[0].events = (reading ? POLLIN : 0) | (waiting ? POLLOUT : 0);
+        fds[1].fd = self->wake_fd;
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            eventfd_t count;
+            eventfd_read(self->wake_fd, &count);
+        }
+        if (reading && (fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+            return 1;
+        if (fds[0].revents & (POLLOUT | POLLHUP | POLLERR)) {
+            pthread_mutex_lock(&self->lock);
+            if (fds[0].revents & POLLOUT)
+                sp_session_flush(self);
+            else
+                /* nobody left to reply to */
+                sp_session_drop(self);
+            pthread_mutex_unlock(&self->lock);
+        }
     }
-    sp_device_swap_data(self);
-    return self->data;
 }
 
-int sp_device_write(SPDevice* self) {
-    uint8_t* data = self->data;
-    unsigned int length = self->length;
-    lseek(self->fd, 0, SEEK_SET);
+/* reads exactly length bytes, flushing replies while it waits */
+static int sp_session_read(SPSession* self, uint8_t* data, size_t length) {
     while (length) {
-        ssize_t amount = write(self->fd, data, length);
+        ssize_t amount;
+
+        pthread_mutex_lock(&self->lock);
+        if (self->out_head)
+            sp_session_flush(self);
+        pthread_mutex_unlock(&self->lock);
+
+        amount = read(self->fd, data, length);
+        if (amount < 0 && errno == EINTR)
+            continue;
+        if (amount < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!sp_session_wait(self, 1))
+                return 0;
+            continue;
+        }
         if (amount <= 0)
             return 0;
         data += amount;
-        if (amount > length)
-            length = 0;
-        else
-            length -= amount;
+        length -= amount;
     }
-    sp_device_swap_data(self);
     return 1;
 }
 
-void sp_device_close(SPDevice* self) {
-    if (self) {
-        free(self->name);
-        if (self->fd >= 0)
-            close(self->fd);
-        if (self->data)
-            free(self->data);
+static int sp_session_discard(SPSession* self, size_t length) {
+    uint8_t chunk[SP_FRAME_CHUNK];
+    while (length) {
+        size_t amount = length < SP_FRAME_CHUNK ? length : SP_FRAME_CHUNK;
+        if (!sp_session_read(self, chunk, amount))
+            return 0;
+        length -= amount;
     }
+    return 1;
 }
 
-SPDevice* sp_device_open(const char* name) {
-    char buffer[STRBUFSIZE];
-    
-    SPDevice* self = calloc(1, sizeof(SPDevice));
-    self->fd = -1;
+static void sp_session_unref(SPSession* self) {
+    unsigned int refs;
 
-    self->name = strdup(name);
+    pthread_mutex_lock(&self->lock);
+    refs = --self->refs;
+    /* the reading thread may be waiting for its last job to reply */
+    if (refs)
+        eventfd_write(self->wake_fd, 1);
+    pthread_mutex_unlock(&self->lock);
 
-    if (!sp_device_sysfs_read(self, "type", buffer, STRBUFSIZE)) {
-        sp_device_close(self);
-        return NULL;
+    if (!refs) {
+        while (self->out_head) {
+            SPFrameOut* frame = self->out_head;
+            self->out_head = frame->next;
+            sp_frame_out_free(frame);
+        }
+        close(self->fd);
+        close(self->wake_fd);
+        pthread_mutex_destroy(&self->lock);
+        free(self);
     }
-    if (strcmp(buffer, "sampler") == 0) {
-        self->type = SP_SAMPLER;
-    } else if (strcmp(buffer, "player") == 0) {
-        self->type = SP_PLAYER;
+}
+
+static void sp_frame_job_complete(SPJob* job) {
+    SPFrameJob* self = (SPFrameJob*)job;
+    uint16_t pair = self->worker - self->worker->pool->workers;
+
+    /* queued, never sent from here, so a client that stops reading
+     * can't hold up the worker or the event loop
+     */
+    if (job->ok) {
+        sp_session_queue(self->session, self->id, SP_STATUS_OK, job->encoding, pair, job->outputs, job->outputs_length);
+        job->outputs = NULL;
     } else {
-        sp_device_close(self);
-        return NULL;
+        sp_session_send(self->session, self->id, SP_STATUS_ERROR, pair, NULL, 0);
     }
 
-    self->sample_width = sp_device_sysfs_read_int(self, "sample_width");
-    if (self->sample_width < 0) {
-        sp_device_close(self);
-        return NULL;
-    }
+    sp_session_unref(self->session);
+    free(job->inputs);
+    free(job->outputs);
+    free(self);
+}
+
+/* takes a slot on the requested pair, and allocates a job for it
+ * on failure, replies and returns NULL
+ */
+static SPFrameJob* sp_session_job_new(SPSession* self, uint32_t id, uint8_t flags, uint16_t index, int* ok) {
+    SPPool* pool = self->listener->ctx->pool;
+    SPFrameJob* fj;
+    SPWorker* worker;
 
-    self->sample_bits = sp_device_sysfs_read_int(self, "sample_bits");
-    if (self->sample_bits < 0) {
-        sp_device_close(self);
+    if (index == SP_FRAME_ANY_PAIR)
+        worker = sp_pool_acquire(pool, NULL);
+    else
+        worker = sp_pool_acquire_index(pool, index);
+    if (!worker) {
+        *ok = sp_session_send(self, id, SP_STATUS_NOT_FOUND, index, NULL, 0);
         return NULL;
     }
 
-    self->sample_length = sp_device_sysfs_read_int(self, "sample_length");
-    if (self->sample_length < 0) {
-        sp_device_close(self);
+    fj = calloc(1, sizeof(SPFrameJob));
+    if (fj)
+        fj->job.inputs = sp_worker_alloc_inputs(worker);
+    if (!fj || !fj->job.inputs) {
+        sp_pool_release(pool, worker);
+        free(fj);
+        *ok = sp_session_send(self, id, SP_STATUS_ERROR, index, NULL, 0);
         return NULL;
     }
 
-    self->time_bits = sp_device_sysfs_read_int(self, "time_bits");
-    if (self->time_bits < 0) {
-        sp_device_close(self);
-        return NULL;
+    fj->session = self;
+    fj->worker = worker;
+    fj->id = id;
+    fj->job.complete = sp_frame_job_complete;
+    fj->job.encoding = flags < SP_ENCODINGS ? flags : SP_ENCODING_IDENTITY;
+    return fj;
+}
+
+/* gives back a job that was never submitted */
+static void sp_session_job_free(SPSession* self, SPFrameJob* fj) {
+    sp_pool_release(self->listener->ctx->pool, fj->worker);
+    free(fj->job.inputs);
+    free(fj);
+}
+
+static void sp_session_job_submit(SPSession* self, SPFrameJob* fj) {
+    sp_job_tag(&fj->job, fj->worker->pair->inputs_length);
+
+    pthread_mutex_lock(&self->lock);
+    self->refs++;
+    pthread_mutex_unlock(&self->lock);
+
+    sp_worker_submit(fj->worker, &fj->job);
+}
+
+/* reads the payload of a run request and queues it up
+ * returns 0 if the connection should be dropped
+ */
+static int sp_session_run(SPSession* self, uint32_t id, uint8_t flags, uint16_t index, uint32_t length) {
+    uint8_t chunk[SP_FRAME_CHUNK];
+    SPUpload upload;
+    SPFrameJob* fj;
+    SPDevice* play;
+    uint64_t start, parse_ns = 0;
+    int ok = 1;
+
+    fj = sp_session_job_new(self, id, flags, index, &ok);
+    if (!fj)
+        return ok && sp_session_discard(self, length);
+    play = fj->worker->pair->play;
+
+    memset(&upload, 0, sizeof(upload));
+    while (length) {
+        size_t amount = length < SP_FRAME_CHUNK ? length : SP_FRAME_CHUNK;
+        if (!sp_session_read(self, chunk, amount)) {
+            sp_session_job_free(self, fj);
+            return 0;
+        }
+        start = sp_now_ns();
+        sp_upload_feed(&upload, play, fj->job.inputs, chunk, amount);
+        parse_ns += sp_now_ns() - start;
+        length -= amount;
     }
 
-    self->time_length = sp_device_sysfs_read_int(self, "time_length");
-    if (self->time_length < 0) {
-        sp_device_close(self);
-        return NULL;
+    start = sp_now_ns();
+    if (!sp_upload_finish(&upload, play, fj->job.inputs)) {
+        sp_counter_add(&self->listener->ctx->bad_uploads, 1);
+        sp_session_job_free(self, fj);
+        return sp_session_send(self, id, SP_STATUS_BAD_REQUEST, index, NULL, 0);
     }
+    parse_ns += sp_now_ns() - start;
+    sp_metric_record(&fj->worker->stages[SP_STAGE_UPLOAD], parse_ns);
 
-    self->bits = sp_device_sysfs_read_int(self, "bits");
-    if (self->bits < 0) {
-        sp_device_close(self);
-        return NULL;
+    sp_session_job_submit(self, fj);
+    return 1;
+}
+
+static int sp_session_run_stored(SPSession* self, uint32_t id, uint8_t flags, uint16_t index, uint32_t length) {
+    SPContext* ctx = self->listener->ctx;
+    char name[SP_ID_LENGTH];
+    SPCacheEntry* stimulus;
+    SPFrameJob* fj;
+    uint64_t start;
+    int ok = 1;
+
+    if (length >= SP_ID_LENGTH)
+        return sp_session_discard(self, length) && sp_session_send(self, id, SP_STATUS_BAD_REQUEST, index, NULL, 0);
+    if (!sp_session_read(self, (uint8_t*)name, length))
+        return 0;
+    name[length] = 0;
+
+    stimulus = sp_stimulus_lookup(ctx, name);
+    if (!stimulus)
+        return sp_session_send(self, id, SP_STATUS_NOT_FOUND, index, NULL, 0);
+
+    fj = sp_session_job_new(self, id, flags, index, &ok);
+    if (!fj) {
+        sp_cache_unref(ctx->stimuli, stimulus);
+        return ok;
     }
 
-    self->length = sp_device_sysfs_read_int(self, "length");
-    if (self->length < 0) {
-        sp_device_close(self);
-        return NULL;
+    start = sp_now_ns();
+    ok = sp_stimulus_expand(stimulus, fj->worker->pair->play, fj->job.inputs);
+    sp_cache_unref(ctx->stimuli, stimulus);
+    if (!ok) {
+        sp_counter_add(&ctx->bad_uploads, 1);
+        sp_session_job_free(self, fj);
+        return sp_session_send(self, id, SP_STATUS_BAD_REQUEST, index, NULL, 0);
     }
-    
-    snprintf(buffer, STRBUFSIZE, "/dev/%s", name);
-    if (self->type == SP_SAMPLER) {
-        self->fd = open(buffer, O_RDONLY | O_DIRECT | O_SYNC);
-    } else {
-        self->fd = open(buffer, O_WRONLY | O_DIRECT | O_SYNC);
+    sp_metric_record(&fj->worker->stages[SP_STAGE_UPLOAD], sp_now_ns() - start);
+
+    sp_session_job_submit(self, fj);
+    return 1;
+}
+
+static int sp_session_store(SPSession* self, uint32_t id, uint16_t index, uint32_t length) {
+    char name[SP_ID_LENGTH];
+    char stored[SP_ID_LENGTH];
+    uint8_t* data;
+    uint16_t name_length;
+
+    data = malloc(length ? length : 1);
+    if (!data)
+        return sp_session_discard(self, length) && sp_session_send(self, id, SP_STATUS_ERROR, index, NULL, 0);
+    if (!sp_session_read(self, data, length)) {
+        free(data);
+        return 0;
     }
-    if (self->fd < 0) {
-        sp_device_close(self);
-        return NULL;
+
+    name_length = length >= 2 ? (data[0] << 8) | data[1] : 0xffff;
+    if (length < 2 || name_length >= SP_ID_LENGTH || name_length > length - 2) {
+        free(data);
+        return sp_session_send(self, id, SP_STATUS_BAD_REQUEST, index, NULL, 0);
     }
+    memcpy(name, data + 2, name_length);
+    name[name_length] = 0;
 
-    posix_memalign((void**)&(self->data), 512, self->length);
+    /* shift the packed upload down to the front */
+    memmove(data, data + 2 + name_length, length - 2 - name_length);
+    if (!sp_stimulus_store(self->listener->ctx, name_length ? name : NULL, data, length - 2 - name_length, stored))
+        return sp_session_send(self, id, SP_STATUS_BAD_REQUEST, index, NULL, 0);
 
-    return self;
+    return sp_session_send(self, id, SP_STATUS_OK, index, (const uint8_t*)stored, strlen(stored));
 }
 
-SPDevice* sp_sampler_open(const char* name) {
-    SPDevice* dev = sp_device_open(name);
-    if (dev && dev->type != SP_SAMPLER) {
-        sp_device_close(dev);
-        return NULL;
+static void* sp_session_main(void* data) {
+    SPSession* self = data;
+    SPListener* listener = self->listener;
+    SPSession** prev;
+    uint8_t header[SP_FRAME_HEADER];
+
+    while (sp_session_read(self, header, SP_FRAME_HEADER)) {
+        uint32_t length = sp_get_be32(header);
+        uint32_t id = sp_get_be32(header + 4);
+        uint8_t op = header[8];
+        uint8_t flags = header[9];
+        uint16_t index = (header[10] << 8) | header[11];
+        int ok;
+
+        if (length > SP_FRAME_MAX_PAYLOAD)
+            break;
+        sp_counter_add(&listener->ctx->frames, 1);
+
+        switch (op) {
+        case SP_OP_RUN:
+            ok = sp_session_run(self, id, flags, index, length);
+            break;
+        case SP_OP_RUN_STORED:
+            ok = sp_session_run_stored(self, id, flags, index, length);
+            break;
+        case SP_OP_STORE:
+            ok = sp_session_store(self, id, index, length);
+            break;
+        default:
+            ok = sp_session_discard(self, length) && sp_session_send(self, id, SP_STATUS_BAD_REQUEST, index, NULL, 0);
+            break;
+        }
+        if (!ok)
+            break;
     }
-    return dev;
-}
 
-SPDevice* sp_player_open(const char* name) {
-    SPDevice* dev = sp_device_open(name);
-    if (dev && dev->type != SP_PLAYER) {
-        sp_device_close(dev);
-        return NULL;
+    /* jobs still in flight reply through us, so keep flushing until
+     * they are all out, or the client stops taking them
+     */
+    sp_session_wait(self, 0);
+
+    pthread_mutex_lock(&listener->lock);
+    for (prev = &listener->sessions; *prev; prev = &(*prev)->next) {
+        if (*prev == self) {
+            *prev = self->next;
+            break;
+        }
     }
-    return dev;
-}
+    pthread_cond_broadcast(&listener->cond);
+    pthread_mutex_unlock(&listener->lock);
 
-typedef struct {
-    SPDevice* samp;
-    SPDevice* play;
+    sp_session_unref(self);
+    return NULL;
+}
 
-    uint8_t* inputs;
-    unsigned int inputs_length;
-    const uint8_t* outputs;
-    unsigned int outputs_length;
-} SPPair;
+static void* sp_listener_main(void* data) {
+    SPListener* self = data;
+    int one = 1;
 
-const uint8_t* sp_pair_run(SPPair* self) {
-    sp_device_set_enabled(self->samp, 0);
-    sp_device_set_enabled(self->play, 0);
+    for (;;) {
+        SPSession* session;
+        pthread_attr_t attr;
+        pthread_t thread;
+        int fd = accept(self->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
 
-    sp_device_write(self->play);
+        /* harmless failure on unix sockets */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 
-    sp_device_set_enabled(self->samp, 1);
-    sp_device_set_enabled(self->play, 1);
+        session = calloc(1, sizeof(SPSession));
+        if (session)
+            session->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (!session || session->wake_fd < 0) {
+            free(session);
+            close(fd);
+            continue;
+        }
+        session->listener = self;
+        session->fd = fd;
+        session->refs = 1;
+        pthread_mutex_init(&session->lock, NULL);
 
-    while (!sp_device_get_done(self->samp));
-    while (!sp_device_get_done(self->play));
+        pthread_mutex_lock(&self->lock);
+        if (self->stopping) {
+            pthread_mutex_unlock(&self->lock);
+            sp_session_unref(session);
+            break;
+        }
+        session->next = self->sessions;
+        self->sessions = session;
 
-    sp_device_set_enabled(self->samp, 0);
-    sp_device_set_enabled(self->play, 0);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, sp_session_main, session) != 0) {
+            self->sessions = session->next;
+            sp_session_unref(session);
+        }
+        pthread_attr_destroy(&attr);
+        pthread_mutex_unlock(&self->lock);
+    }
 
-    return sp_device_read(self->samp);
+    return NULL;
 }
 
-void sp_pair_close(SPPair* self) {
-    if (self) {
-        if (self->samp)
-            sp_device_close(self->samp);
-        if (self->play)
-            sp_device_close(self->play);
+/* stops accepting, stops reading from every session, and waits for
+ * their threads. jobs already queued still get their replies, unless
+ * their client stops taking them.
+ */
+void sp_listener_close(SPListener* self) {
+    SPSession* session;
+    if (!self)
+        return;
+
+    pthread_mutex_lock(&self->lock);
+    self->stopping = 1;
+    for (session = self->sessions; session; session = session->next)
+        shutdown(session->fd, SHUT_RD);
+    pthread_mutex_unlock(&self->lock);
+
+    shutdown(self->fd, SHUT_RDWR);
+    pthread_join(self->thread, NULL);
+
+    pthread_mutex_lock(&self->lock);
+    while (self->sessions)
+        pthread_cond_wait(&self->cond, &self->lock);
+    pthread_mutex_unlock(&self->lock);
+
+    close(self->fd);
+    if (self->path) {
+        unlink(self->path);
+        free(self->path);
     }
+    pthread_mutex_destroy(&self->lock);
+    pthread_cond_destroy(&self->cond);
+    free(self);
 }
 
-SPPair* sp_pair_open(const char* sampname, const char* playname) {
-    SPPair* self = calloc(1, sizeof(SPPair));
-    self->samp = sp_sampler_open(sampname);
-    self->play = sp_player_open(playname);
+static SPListener* sp_listener_start(SPContext* ctx, int fd, const char* path) {
+    SPListener* self;
 
-    if (!self->samp || !self->play) {
-        sp_pair_close(self);
+    if (listen(fd, 16) != 0) {
+        close(fd);
         return NULL;
     }
 
-    self->inputs = self->play->data;
-    self->inputs_length = self->play->length;
-    self->outputs = self->samp->data;
-    self->outputs_length = self->samp->length;
+    self = calloc(1, sizeof(SPListener));
+    if (!self) {
+        close(fd);
+        return NULL;
+    }
+    self->ctx = ctx;
+    self->fd = fd;
+    if (path)
+        self->path = strdup(path);
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->cond, NULL);
+
+    if (pthread_create(&self->thread, NULL, sp_listener_main, self) != 0) {
+        close(fd);
+        pthread_mutex_destroy(&self->lock);
+        pthread_cond_destroy(&self->cond);
+        free(self->path);
+        free(self);
+        return NULL;
+    }
 
     return self;
 }
 
-/*
- * now, some infrastructure for dealing with HTTP requests
- */
+SPListener* sp_listener_open_tcp(SPContext* ctx, int port) {
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return NULL;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
-typedef struct _SPState SPState;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return NULL;
+    }
 
-typedef int (*SPRequestFunc)(SPState*, SPPair*, struct MHD_Connection*, const uint8_t*, size_t*);
+    return sp_listener_start(ctx, fd, NULL);
+}
 
-struct _SPState {
-    SPRequestFunc handler;
-    int have_arrsize;
-    int incorrect_data;
-    uint32_t arrsize1;
-    uint32_t arrsize2;
-    uint32_t i;
-};
+SPListener* sp_listener_open_unix(SPContext* ctx, const char* path) {
+    struct sockaddr_un addr;
+    int fd;
 
-#define QUEUE_RESPONSE(conn, code, resp) do {           \
-        int ret = MHD_NO;                               \
-        if (resp) {                                     \
-            ret = MHD_queue_response(conn, code, resp); \
-            MHD_destroy_response(resp);                 \
-        }                                               \
-        return ret;                                     \
-    } while(0)
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return NULL;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return NULL;
 
-#define QUEUE_STATIC_RESPONSE(conn, code, typ, str) do {            \
-        struct MHD_Response* response = MHD_create_response_from_buffer(strlen(str), (void*)(str), MHD_RESPMEM_PERSISTENT); \
-        if (response) {                                                 \
-            MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, typ);     \
-        }                                                               \
-        QUEUE_RESPONSE(conn, code, response);                      \
-    } while(0)
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return NULL;
+    }
 
-#define QUEUE_ERROR_RESPONSE(conn, code, str) QUEUE_STATIC_RESPONSE(conn, code, "text/html", "<html><body><h1>" str "</h1></body></html>\n")
+    return sp_listener_start(ctx, fd, path);
+}
 
 /*
- * our HTTP request handlers
+ * tying it all together
  */
 
-static int handler_run(SPState* state, SPPair* pair, struct MHD_Connection* conn, const uint8_t* upload_data, size_t* data_size) {
-    if (*data_size) {
-        uint32_t bytesize;
-        /* FIXME failure here does not result in proper http responses */
-        if (!state->have_arrsize) {
-            if (*data_size < 8) {
-                *data_size = 0;
-                state->incorrect_data = 1;
-                return MHD_YES;
-            }
-            
-            state->arrsize1 = (upload_data[0] << 24) | (upload_data[1] << 16) | (upload_data[2] << 8) | upload_data[3];
-            state->arrsize2 = (upload_data[4] << 24) | (upload_data[5] << 16) | (upload_data[6] << 8) | upload_data[7];
-
-            if (state->arrsize1 > pair->play->time_length || state->arrsize2 > pair->play->sample_width) {
-                *data_size = 0;
-                state->incorrect_data = 1;
-                return MHD_YES;
-            }
-            
-            *data_size -= 8;
-            upload_data += 8;
-            state->have_arrsize = 1;
-            state->i = 0;
-        }
+static void sp_fd_add(fd_set* set, int fd, int* max_fd) {
+    FD_SET(fd, set);
+    if (fd > *max_fd)
+        *max_fd = fd;
+}
 
-        bytesize = (state->arrsize2 + 7) / 8;
+static int sp_fd_ready(fd_set* set, int fd) {
+    return fd >= 0 && FD_ISSET(fd, set);
+}
 
-        while (state->i < pair->inputs_length && *data_size) {
-            /* if we're in a no-data zone, add zeroes until we're out */
-            while (state->i % pair->play->sample_length >= bytesize && state->i < pair->inputs_length) {
-                pair->inputs[state->i] = 0;
-                state->i++;
-            }
+/* event loop mode: serves HTTP and runs every pair from this thread,
+ * sleeping in select until a socket, a pair's interrupt, or a new job
+ * needs us. returns when stdin is readable, like the threaded mode.
+ */
+static void sp_event_loop(SPPool* pool, struct MHD_Daemon* d) {
+    unsigned int i;
 
-            pair->inputs[state->i] = *upload_data;
+    for (;;) {
+        fd_set rs, ws, es;
+        MHD_socket max_fd = -1;
+        MHD_UNSIGNED_LONG_LONG mhd_timeout;
+        uint64_t timeout_ns = UINT64_MAX;
+        struct timeval tv;
+        int running = 0;
+        int polling = 0;
+        int ready;
 
-            upload_data += 1;
-            *data_size -= 1;
-            state->i++;
+        FD_ZERO(&rs);
+        FD_ZERO(&ws);
+        FD_ZERO(&es);
+        if (MHD_get_fdset(d, &rs, &ws, &es, &max_fd) != MHD_YES) {
+            fprintf(stderr, "could not get fds from libmicrohttpd\n");
+            break;
         }
+        if (MHD_get_timeout(d, &mhd_timeout) == MHD_YES)
+            timeout_ns = (uint64_t)mhd_timeout * 1000000;
 
-        return MHD_YES;
-    } else {
-        struct MHD_Response* response;
-
-        if (state->incorrect_data) {
-            QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_BAD_REQUEST, "Bad Request");
+        sp_fd_add(&rs, STDIN_FILENO, &max_fd);
+        sp_fd_add(&rs, pool->wake_fd, &max_fd);
+        for (i = 0; i < pool->workers_length; i++) {
+            SPWorker* w = &pool->workers[i];
+            if (!w->running)
+                continue;
+            running = 1;
+            if (w->pair->samp->event_fd >= 0 && w->pair->play->event_fd >= 0) {
+                sp_fd_add(&rs, w->pair->samp->event_fd, &max_fd);
+                sp_fd_add(&rs, w->pair->play->event_fd, &max_fd);
+            } else {
+                polling = 1;
+            }
         }
+        if (polling && timeout_ns > SP_POLL_SLEEP_NS)
+            timeout_ns = SP_POLL_SLEEP_NS;
+        else if (running && timeout_ns > SP_EVENT_CHECK_NS)
+            timeout_ns = SP_EVENT_CHECK_NS;
 
-        /* fill in the rest with zeroes */
-        while (state->i < pair->inputs_length) {
-            pair->inputs[state->i] = 0;
-            state->i++;
+        tv.tv_sec = timeout_ns / 1000000000;
+        tv.tv_usec = (timeout_ns % 1000000000) / 1000;
+        ready = select(max_fd + 1, &rs, &ws, &es, timeout_ns == UINT64_MAX ? NULL : &tv);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "select failed: %s\n", strerror(errno));
+            break;
         }
 
-        if (sp_pair_run(pair)) {
-            uint8_t* outputs = malloc(pair->outputs_length + 8);
+        if (sp_fd_ready(&rs, STDIN_FILENO))
+            break;
+        if (sp_fd_ready(&rs, pool->wake_fd)) {
+            eventfd_t count;
+            eventfd_read(pool->wake_fd, &count);
+        }
 
-            outputs[0] = (pair->samp->time_length >> 24) & 0xff;
-            outputs[1] = (pair->samp->time_length >> 16) & 0xff;
-            outputs[2] = (pair->samp->time_length >>  8) & 0xff;
-            outputs[3] = (pair->samp->time_length >>  0) & 0xff;
+        /* this may submit jobs, which we start below */
+        MHD_run_from_select(d, &rs, &ws, &es);
 
-            outputs[4] = (pair->samp->sample_width >> 24) & 0xff;
-            outputs[5] = (pair->samp->sample_width >> 16) & 0xff;
-            outputs[6] = (pair->samp->sample_width >>  8) & 0xff;
-            outputs[7] = (pair->samp->sample_width >>  0) & 0xff;
+        for (i = 0; i < pool->workers_length; i++) {
+            SPWorker* w = &pool->workers[i];
+            SPDevice* samp = w->pair->samp;
+            SPDevice* play = w->pair->play;
+            int check = ready == 0 || samp->event_fd < 0 || play->event_fd < 0;
 
-            /* technically we should exclude the extra 0's, but I'm ok
-             * with this for now
-             */
-            memcpy(outputs + 8, pair->outputs, pair->outputs_length);
-            
-            response = MHD_create_response_from_buffer(pair->outputs_length + 8, outputs, MHD_RESPMEM_MUST_FREE);
-            if (response) {
-                MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "application/octet-stream");
+            if (sp_fd_ready(&rs, samp->event_fd)) {
+                sp_device_event_clear(samp);
+                check = 1;
             }
-            QUEUE_RESPONSE(conn, MHD_HTTP_OK, response);
-        } else {
-            QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_INTERNAL_SERVER_ERROR, "Internal Server Error");
-        }        
-    }
-}
-
-static int handler_default(void* cls, struct MHD_Connection* conn, const char* url, const char* method, const char* verison, const char* upload_data, size_t* upload_data_size, void** ptr) {
-    SPPair* pair = cls;
-    SPState* state = *ptr;
-
-    if (!(*ptr)) {
-        /* this is the first call, it has only read headers */
-        state = *ptr = calloc(1, sizeof(SPState));
-        if (!(*ptr))
-            QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_INTERNAL_SERVER_ERROR, "Internal Server Error");
-
-        if (strcmp(url, "/run") == 0 && strcmp(method, "POST") == 0) {
-            state->handler = handler_run;
-            return MHD_YES;
-        } else {
-            QUEUE_ERROR_RESPONSE(conn, MHD_HTTP_NOT_FOUND, "Not Found");
+            if (sp_fd_ready(&rs, play->event_fd)) {
+                sp_device_event_clear(play);
+                check = 1;
+            }
+            sp_worker_step(w, check);
         }
     }
 
-    return state->handler(state, pair, conn, upload_data, upload_data_size);
+    /* fail whatever is left while the daemon can still answer */
+    for (i = 0; i < pool->workers_length; i++)
+        sp_worker_drain(&pool->workers[i]);
 }
 
-static void request_completed(void* cls, struct MHD_Connection* conn, void** ptr, enum MHD_RequestTerminationCode toe) {
-    if (*ptr) {
-        free(*ptr);
-        *ptr = NULL;
-    }
+static void usage(const char* name) {
+    fprintf(stderr, "%s [-c PAIRFILE] [-r CPU | -e] [-b PORT] [-u PATH] [-S MB] [-C MB [-V N]] [-a DIR [-A MB]] PORT\n", name);
+    fprintf(stderr, "  -c PAIRFILE  read SAMPLER PLAYER [NAME] lines from PAIRFILE,\n");
+    fprintf(stderr, "               instead of pairing samplerN with playerN\n");
+    fprintf(stderr, "  -r CPU       low-latency mode: lock memory, and pin each pair's\n");
+    fprintf(stderr, "               worker to its own SCHED_FIFO CPU, starting at CPU\n");
+    fprintf(stderr, "  -e           event loop mode: no worker threads; serve HTTP and run\n");
+    fprintf(stderr, "               every pair from one thread, woken by interrupts.\n");
+    fprintf(stderr, "               holds every pair's leases while running\n");
+    fprintf(stderr, "  -b PORT      also speak the binary protocol on TCP port PORT\n");
+    fprintf(stderr, "  -u PATH      also speak the binary protocol on unix socket PATH\n");
+    fprintf(stderr, "  -S MB        keep up to MB megabytes of stored stimuli (default %i)\n", SP_STIMULI_BUDGET / (1024 * 1024));
+    fprintf(stderr, "  -C MB        cache up to MB megabytes of captures, and answer repeated\n");
+    fprintf(stderr, "               stimuli from there. only for deterministic DUTs!\n");
+    fprintf(stderr, "  -V N         with -C, run one in N cache hits anyway to check\n");
+    fprintf(stderr, "  -a DIR       archive every run's capture in DIR, for osuqlsp.SPArchive\n");
+    fprintf(stderr, "  -A MB        with -a, make archive segments MB megabytes (default %i)\n", SP_ARCHIVE_SEGMENT / (1024 * 1024));
+    fprintf(stderr, "run latency histograms are served at /latency\n");
 }
 
-/*
- * tying it all together
- */
-
 int main(int argc, char** argv) {
     struct MHD_Daemon* d;
-    SPPair* pair;
+    SPContext ctx = {0};
+    size_t stimuli_budget = SP_STIMULI_BUDGET;
+    SPListener* tcp = NULL;
+    SPListener* unix_socket = NULL;
+    int binary_port = -1;
+    const char* socket_path = NULL;
+    SPPairSpec* specs;
+    int specs_length;
+    SPPoolOptions options = { .realtime_cpu = -1, .archive_segment = SP_ARCHIVE_SEGMENT };
+    const char* pairfile = NULL;
+    int opt;
     int i;
     struct timeb start, end;
     float seconds;
-    if (argc != 2) {
-        fprintf(stderr, "%s PORT\n", argv[0]);
+
+    while ((opt = getopt(argc, argv, "c:r:eb:u:S:C:V:a:A:")) != -1) {
+        switch (opt) {
+        case 'c':
+            pairfile = optarg;
+            break;
+        case 'r':
+            options.realtime_cpu = atoi(optarg);
+            if (options.realtime_cpu < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'e':
+            options.event_loop = 1;
+            break;
+        case 'b':
+            binary_port = atoi(optarg);
+            break;
+        case 'u':
+            socket_path = optarg;
+            break;
+        case 'S':
+            stimuli_budget = (size_t)atoi(optarg) * 1024 * 1024;
+            break;
+        case 'C':
+            options.result_budget = (size_t)atoi(optarg) * 1024 * 1024;
+            break;
+        case 'V':
+            options.result_verify_every = atoi(optarg);
+            break;
+        case 'a':
+            options.archive_path = optarg;
+            break;
+        case 'A':
+            options.archive_segment = (size_t)atoi(optarg) * 1024 * 1024;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    /* realtime mode pins one thread per pair, and there is only one */
+    if (optind != argc - 1 || (options.event_loop && options.realtime_cpu >= 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (pairfile) {
+        specs_length = sp_pairs_load(pairfile, &specs);
+        if (specs_length < 0) {
+            fprintf(stderr, "failed to read %s\n", pairfile);
+            return 1;
+        }
+    } else {
+        specs_length = sp_pairs_discover(&specs);
+    }
+    if (specs_length == 0) {
+        fprintf(stderr, "no sampler/player pairs found\n");
         return 1;
     }
 
-    pair = sp_pair_open("sampler0", "player0");
-    if (!pair) {
+    if (options.realtime_cpu >= 0 && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        fprintf(stderr, "could not lock memory: %s\n", strerror(errno));
+
+    ctx.stimuli = sp_cache_new(stimuli_budget);
+    ctx.pool = sp_pool_open(specs, specs_length, &options);
+    if (!ctx.stimuli || !ctx.pool) {
         fprintf(stderr, "failed to open sampler/player\n");
+        sp_context_close(&ctx);
+        free(specs);
         return 1;
     }
-    
-    d = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY, atoi(argv[1]), NULL, NULL, &handler_default, pair, MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL, MHD_OPTION_END);
+    for (i = 0; i < specs_length; i++)
+        fprintf(stderr, "pair %s: %s, %s\n", specs[i].name, specs[i].sampler, specs[i].player);
+    free(specs);
+
+    d = MHD_start_daemon((options.event_loop ? 0 : MHD_USE_SELECT_INTERNALLY) | MHD_USE_SUSPEND_RESUME, atoi(argv[optind]), NULL, NULL, &handler_default, &ctx, MHD_OPTION_NOTIFY_COMPLETED, &request_completed, &ctx, MHD_OPTION_END);
 
     if (!d) {
-        sp_pair_close(pair);
+        sp_context_close(&ctx);
         return 1;
     }
 
+    if (binary_port >= 0) {
+        tcp = sp_listener_open_tcp(&ctx, binary_port);
+        if (!tcp) {
+            fprintf(stderr, "failed to listen on port %i: %s\n", binary_port, strerror(errno));
+            MHD_stop_daemon(d);
+            sp_context_close(&ctx);
+            return 1;
+        }
+    }
+    if (socket_path) {
+        unix_socket = sp_listener_open_unix(&ctx, socket_path);
+        if (!unix_socket) {
+            fprintf(stderr, "failed to listen on %s: %s\n", socket_path, strerror(errno));
+            sp_listener_close(tcp);
+            MHD_stop_daemon(d);
+            sp_context_close(&ctx);
+            return 1;
+        }
+    }
+
 #define NUM_ITERS 100
     //ftime(&start);
     //for (i = 0; i < NUM_ITERS; i++) {
-    //    sp_pair_run(pair);
+    //    sp_pair_run(ctx.pool->workers[0].pair);
     //}
     //ftime(&end);
     //seconds = 1.0 * (end.time - start.time) + 0.001 * (end.millitm - start.millitm);
     //printf("%i iters in %f seconds: %f / second\n", NUM_ITERS, seconds, NUM_ITERS / seconds);
 
-    (void) getc(stdin);
+    if (options.event_loop)
+        sp_event_loop(ctx.pool, d);
+    else
+        (void) getc(stdin);
+    sp_listener_close(tcp);
+    sp_listener_close(unix_socket);
     MHD_stop_daemon(d);
-    sp_pair_close(pair);
+    sp_context_close(&ctx);
     return 0;
 }